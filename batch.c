@@ -0,0 +1,512 @@
+/*
+** simple expression evaluator library (batch evaluation over columns)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* batch evaluation runs the compiled code over a block of rows at a time:
+** each instruction is applied to BATCH_ROWS values before moving on to the
+** next instruction, so the dispatch cost is paid once per block instead of
+** once per row and the arithmetic runs as SIMD loops. Registers become
+** vectors of BATCH_ROWS doubles; variables bound to columns are read in
+** place, and vectors are reused as soon as the value they hold is dead, so
+** the working set stays small even for long expressions. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "evalcode.h"
+
+/* arithmetic kernels, one set per instruction set */
+typedef struct
+{
+	void (*add)(size_t n, double *d, const double *a, const double *b);
+	void (*sub)(size_t n, double *d, const double *a, const double *b);
+	void (*mul)(size_t n, double *d, const double *a, const double *b);
+	void (*div)(size_t n, double *d, const double *a, const double *b);
+	void (*neg)(size_t n, double *d, const double *a);
+	void (*fill)(size_t n, double *d, double v);
+	const char *isa;
+} Kernels;
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(EVAL_NO_SIMD)
+
+#include <immintrin.h>
+
+/* define the kernels for one x86 instruction set. The vector loop handles
+** WIDTH rows at a time and the scalar loop finishes the block, negation
+** flips the sign bit just like the scalar -x */
+#define X86_KERNELS(ISA, TARGET, VEC, WIDTH, LOADU, STOREU, SET1, ADD, SUB, MUL, DIV, XOR) \
+static __attribute__((target(TARGET))) void ISA##_add(size_t n, double *d, \
+	const double *a, const double *b) \
+{ \
+	size_t i = 0; \
+	for(; i+WIDTH <= n; i += WIDTH) \
+		STOREU(d+i, ADD(LOADU(a+i), LOADU(b+i))); \
+	for(; i < n; i++) \
+		d[i] = a[i]+b[i]; \
+	return; \
+} \
+static __attribute__((target(TARGET))) void ISA##_sub(size_t n, double *d, \
+	const double *a, const double *b) \
+{ \
+	size_t i = 0; \
+	for(; i+WIDTH <= n; i += WIDTH) \
+		STOREU(d+i, SUB(LOADU(a+i), LOADU(b+i))); \
+	for(; i < n; i++) \
+		d[i] = a[i]-b[i]; \
+	return; \
+} \
+static __attribute__((target(TARGET))) void ISA##_mul(size_t n, double *d, \
+	const double *a, const double *b) \
+{ \
+	size_t i = 0; \
+	for(; i+WIDTH <= n; i += WIDTH) \
+		STOREU(d+i, MUL(LOADU(a+i), LOADU(b+i))); \
+	for(; i < n; i++) \
+		d[i] = a[i]*b[i]; \
+	return; \
+} \
+static __attribute__((target(TARGET))) void ISA##_div(size_t n, double *d, \
+	const double *a, const double *b) \
+{ \
+	size_t i = 0; \
+	for(; i+WIDTH <= n; i += WIDTH) \
+		STOREU(d+i, DIV(LOADU(a+i), LOADU(b+i))); \
+	for(; i < n; i++) \
+		d[i] = a[i]/b[i]; \
+	return; \
+} \
+static __attribute__((target(TARGET))) void ISA##_neg(size_t n, double *d, \
+	const double *a) \
+{ \
+	VEC sign = SET1(-0.0); \
+	size_t i = 0; \
+	for(; i+WIDTH <= n; i += WIDTH) \
+		STOREU(d+i, XOR(LOADU(a+i), sign)); \
+	for(; i < n; i++) \
+		d[i] = -a[i]; \
+	return; \
+} \
+static __attribute__((target(TARGET))) void ISA##_fill(size_t n, double *d, \
+	double v) \
+{ \
+	VEC vv = SET1(v); \
+	size_t i = 0; \
+	for(; i+WIDTH <= n; i += WIDTH) \
+		STOREU(d+i, vv); \
+	for(; i < n; i++) \
+		d[i] = v; \
+	return; \
+} \
+static const Kernels G_##ISA##_kernels = { \
+	ISA##_add, ISA##_sub, ISA##_mul, ISA##_div, ISA##_neg, ISA##_fill, #ISA \
+};
+
+X86_KERNELS(sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd,
+	_mm_set1_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd, _mm_xor_pd)
+X86_KERNELS(avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd,
+	_mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd,
+	_mm256_div_pd, _mm256_xor_pd)
+X86_KERNELS(avx512, "avx512f,avx512dq", __m512d, 8, _mm512_loadu_pd,
+	_mm512_storeu_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_sub_pd,
+	_mm512_mul_pd, _mm512_div_pd, _mm512_xor_pd)
+
+/* pick the widest instruction set the cpu supports */
+static const Kernels *select_kernels(void)
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+		return &G_avx512_kernels;
+	if(__builtin_cpu_supports("avx2"))
+		return &G_avx2_kernels;
+	return &G_sse2_kernels;
+}
+
+#else
+
+/* the generic kernels are plain loops, which the compiler may vectorize */
+static void c_add(size_t n, double *d, const double *a, const double *b)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+		d[i] = a[i]+b[i];
+	
+	return;
+}
+
+static void c_sub(size_t n, double *d, const double *a, const double *b)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+		d[i] = a[i]-b[i];
+	
+	return;
+}
+
+static void c_mul(size_t n, double *d, const double *a, const double *b)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+		d[i] = a[i]*b[i];
+	
+	return;
+}
+
+static void c_div(size_t n, double *d, const double *a, const double *b)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+		d[i] = a[i]/b[i];
+	
+	return;
+}
+
+static void c_neg(size_t n, double *d, const double *a)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+		d[i] = -a[i];
+	
+	return;
+}
+
+static void c_fill(size_t n, double *d, double v)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+		d[i] = v;
+	
+	return;
+}
+
+static const Kernels G_c_kernels = {
+	c_add, c_sub, c_mul, c_div, c_neg, c_fill, "c"
+};
+
+static const Kernels *select_kernels(void)
+{
+	return &G_c_kernels;
+}
+
+#endif
+
+static const Kernels *G_kernels = NULL;
+
+/* the kernels for this cpu, selected on first use */
+static const Kernels *kernels(void)
+{
+	if(G_kernels == NULL)
+		G_kernels = select_kernels(); /* same answer from every thread */
+	return G_kernels;
+}
+
+/* a batch plan maps the registers of the compiled code onto vectors, and
+** the variable slots onto columns */
+struct BatchPlan_struct
+{
+	const eval_compiled *ce;
+	const double **col; /* column bound to each variable slot, or NULL */
+	int *vec; /* vector holding each register, -1 for column loads */
+	int nvecs; /* number of vectors needed */
+};
+
+/* plan a batch evaluation, returns NULL if out of memory */
+BatchPlan *batch_plan(const eval_compiled *ce, int ncols, const char **names,
+	const double **cols)
+{
+	BatchPlan *bp;
+	const Instr *ip;
+	const Call *c;
+	const char *name;
+	int *last, *free_vec, nfree = 0, i, j, r;
+	
+	bp = (BatchPlan*)malloc(sizeof(BatchPlan)
+		+sizeof(int)*ce->nregs
+		+sizeof(double*)*ce->nvars);
+	last = (int*)malloc(sizeof(int)*ce->nregs*2);
+	if(bp == NULL || last == NULL)
+	{
+		free(bp);
+		free(last);
+		return NULL;
+	}
+	free_vec = last+ce->nregs;
+	bp->ce = ce;
+	bp->col = (const double**)(bp+1);
+	bp->vec = (int*)(bp->col+ce->nvars);
+	bp->nvecs = 0;
+	
+	for(i = 0; i < ce->nvars; i++)
+		bp->col[i] = NULL;
+	for(j = 0; j < ncols; j++)
+	{ /* bind the slots that have a column, unknown names are ignored */
+		if(names[j] == NULL || (name = intern_find(names[j])) == NULL)
+			continue;
+		for(i = 0; i < ce->nvars; i++)
+			if(ce->slot[i].name == name)
+				bp->col[i] = cols[j];
+	}
+	
+	/* find the last instruction that reads each register */
+	for(r = 0; r < ce->nregs; r++)
+		last[r] = -1;
+	for(i = 0, ip = ce->code; i < ce->ninstr; i++, ip++)
+	{
+		switch(ip->op)
+		{
+		case OP_LOADV:
+			break;
+		case OP_CALL:
+			c = ce->call+ip->a;
+			for(j = 0; j < c->nargs; j++)
+				last[c->arg[j]] = i;
+			break;
+		case OP_NEG:
+		case OP_PCT:
+		case OP_RET:
+			last[ip->a] = i;
+			break;
+		default:
+			last[ip->a] = i;
+			last[ip->b] = i;
+		}
+	}
+	
+	/* constants that are used get their own vector for the whole batch */
+	for(r = 0; r < ce->nconst; r++)
+		bp->vec[r] = last[r] >= 0 ? bp->nvecs++ : -1;
+	
+	/* results take a free vector, and give it back after their last use.
+	** Operands are released before the result is placed, since every
+	** kernel reads each row before writing that row. Calls are the
+	** exception, vector functions are promised a result that doesn't
+	** overlap their arguments, so those are released after the result */
+	for(i = 0, ip = ce->code; i < ce->ninstr; i++, ip++)
+	{
+		if(ip->op != OP_LOADV && ip->op != OP_CALL)
+		{
+			for(j = 0; j < 2; j++)
+			{
+				r = j == 0 ? ip->a : ip->b;
+				if(j == 1 && (ip->op == OP_NEG || ip->op == OP_PCT || ip->op == OP_RET))
+					break;
+				if(r >= ce->nconst && last[r] == i && bp->vec[r] >= 0)
+				{
+					free_vec[nfree++] = bp->vec[r];
+					last[r] = -1;
+				}
+			}
+		}
+		if(ip->op == OP_RET || (ip->op == OP_LOADV && bp->col[ip->a] != NULL))
+			bp->vec[ip->dst] = -1; /* no vector, read in place */
+		else if(nfree > 0)
+			bp->vec[ip->dst] = free_vec[--nfree];
+		else
+			bp->vec[ip->dst] = bp->nvecs++;
+		if(ip->op == OP_CALL)
+		{
+			c = ce->call+ip->a;
+			for(j = 0; j < c->nargs; j++)
+			{
+				r = c->arg[j];
+				if(r >= ce->nconst && last[r] == i && bp->vec[r] >= 0)
+				{
+					free_vec[nfree++] = bp->vec[r];
+					last[r] = -1; /* don't release twice */
+				}
+			}
+		}
+	}
+	free(last);
+	
+	return bp;
+}
+
+/* per thread scratch space for running a batch plan */
+struct BatchScratch_struct
+{
+	const double **src; /* data of each register in the current block */
+	const double **argp; /* argument vectors passed to vector functions */
+	double *argv; /* argument values passed to functions */
+	double *vec; /* vector storage */
+};
+
+/* allocate scratch space for running a batch plan, NULL if out of memory */
+BatchScratch *batch_scratch(const BatchPlan *bp)
+{
+	const eval_compiled *ce = bp->ce;
+	const Kernels *k = kernels();
+	BatchScratch *bs;
+	int r;
+	
+	bs = (BatchScratch*)malloc(sizeof(BatchScratch)
+		+sizeof(double*)*(ce->nregs+ce->maxargs)
+		+sizeof(double)*(ce->maxargs+(size_t)bp->nvecs*BATCH_ROWS));
+	if(bs == NULL)
+		return NULL;
+	bs->src = (const double**)(bs+1);
+	bs->argp = bs->src+ce->nregs;
+	bs->argv = (double*)(bs->argp+ce->maxargs);
+	bs->vec = bs->argv+ce->maxargs;
+	for(r = 0; r < ce->nregs; r++)
+	{
+		if(bp->vec[r] >= 0)
+			bs->src[r] = bs->vec+(size_t)bp->vec[r]*BATCH_ROWS;
+		else
+			bs->src[r] = NULL;
+	}
+	for(r = 0; r < ce->nconst; r++)
+		if(bp->vec[r] >= 0) /* broadcast the constants once */
+			k->fill(BATCH_ROWS, (double*)bs->src[r], ce->reg[r]);
+	
+	return bs;
+}
+
+/* return nonzero if any of the n values is zero */
+static int has_zero(size_t n, const double *v)
+{
+	size_t i;
+	int z = 0;
+	
+	for(i = 0; i < n; i++)
+		z |= v[i] == 0.0;
+	return z;
+}
+
+/* evaluate rows row0 to row0+rows-1 of a batch plan into out, returns 0
+** (zero) on success or an EVAL_* error code */
+int batch_rows(const BatchPlan *bp, BatchScratch *bs, size_t row0,
+	size_t rows, double *out)
+{
+	const eval_compiled *ce = bp->ce;
+	const Kernels *k = kernels();
+	const double **src = bs->src;
+	const Instr *ip;
+	const Call *c;
+	double *d;
+	size_t n, j;
+	int i;
+	
+	for(; rows > 0; row0 += n, rows -= n)
+	{
+		n = rows < BATCH_ROWS ? rows : BATCH_ROWS;
+		for(ip = ce->code; ; ip++)
+		{
+			d = (double*)src[ip->dst];
+			switch(ip->op)
+			{
+			case OP_LOADV:
+				if(bp->col[ip->a] != NULL)
+					src[ip->dst] = bp->col[ip->a]+row0;
+				else
+					k->fill(n, d, *ce->var[ip->a]);
+				break;
+			case OP_ADD:
+				k->add(n, d, src[ip->a], src[ip->b]);
+				break;
+			case OP_SUB:
+				k->sub(n, d, src[ip->a], src[ip->b]);
+				break;
+			case OP_MUL:
+				k->mul(n, d, src[ip->a], src[ip->b]);
+				break;
+			case OP_DIV:
+				if(has_zero(n, src[ip->b]))
+					return EVAL_DIVIDE_BY_ZERO;
+				k->div(n, d, src[ip->a], src[ip->b]);
+				break;
+			case OP_MOD:
+				if(has_zero(n, src[ip->b]))
+					return EVAL_DIVIDE_BY_ZERO;
+				for(j = 0; j < n; j++)
+					d[j] = fmod(src[ip->a][j], src[ip->b][j]);
+				break;
+			case OP_POW:
+				for(j = 0; j < n; j++)
+					d[j] = pow(src[ip->a][j], src[ip->b][j]);
+				break;
+			case OP_NEG:
+				k->neg(n, d, src[ip->a]);
+				break;
+			case OP_PCT:
+				for(j = 0; j < n; j++)
+					d[j] = src[ip->a][j]/100.0;
+				break;
+			case OP_CALL: /* one call per block, or one call per row */
+				c = ce->call+ip->a;
+				if(c->vfn != NULL)
+				{
+					for(i = 0; i < c->nargs; i++)
+						bs->argp[i] = src[c->arg[i]];
+					if(c->vfn(c->nargs, n, bs->argp, d, c->data) != 0)
+						return EVAL_FUNCTION_ERROR;
+					break;
+				}
+				for(j = 0; j < n; j++)
+				{
+					for(i = 0; i < c->nargs; i++)
+						bs->argv[i] = src[c->arg[i]][j];
+					if(c->fn(c->nargs, bs->argv, d+j, c->data) != 0)
+						return EVAL_FUNCTION_ERROR;
+				}
+				break;
+			case OP_RET:
+				memcpy(out+row0, src[ip->a], sizeof(double)*n);
+				break;
+			default:
+				return EVAL_SYNTAX_ERROR; /* bad opcode, can't happen */
+			}
+			if(ip->op == OP_RET)
+				break;
+		}
+	}
+	
+	return 0;
+}
+
+/* public: evaluate a compiled expression over columns of data */
+int eval_run_batch(eval_compiled *compiled, size_t rows, int ncols,
+	const char **names, const double **cols, double *out)
+{
+	BatchPlan *bp;
+	int err;
+	
+	if(compiled == NULL || compiled->tag != COMPILED_TAG)
+		return EVAL_NULL_EXPRESSION;
+	if(out == NULL || (ncols > 0 && (names == NULL || cols == NULL)))
+		return EVAL_NULL_EXPRESSION;
+	bp = batch_plan(compiled, ncols, names, cols);
+	if(bp == NULL)
+		return EVAL_MEM_ERROR;
+	err = pool_run(bp, rows, out);
+	free(bp);
+	
+	return err;
+}
+
+/* public: name of the instruction set used by batch evaluation */
+const char *eval_batch_isa(void)
+{
+	return kernels()->isa;
+}
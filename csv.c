@@ -0,0 +1,403 @@
+/*
+** simple expression evaluator library (CSV columns)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* a CSV file is loaded into one column of doubles per header field, so
+** that an expression can be evaluated over every row by eval_run_batch()
+** with the header names bound to the columns. The file is mapped into
+** memory and the body is cut into chunks at line ends, a few per thread
+** (see eval_batch_threads()), which are run as tasks by the thread pool
+** (see pool.c). The rows of each chunk are counted, which gives the first
+** row of every chunk, then each chunk is parsed into the columns. Fields
+** that aren't numbers, and missing fields, are NaN. Blank lines are
+** skipped. Quoted fields may hold commas and doubled quotes, but not line
+** breaks. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "evalcode.h"
+
+#define CSV_TAG 0x76734345 /* ECsv */
+#define CSV_CHUNKS 4 /* chunks per thread, so threads can share the work */
+#define CSV_MAX_CHUNKS 256
+#define CSV_MIN_CHUNK (256*1024) /* smallest chunk */
+#define FIELD_MAX 63 /* longest number parsed */
+
+struct eval_csv_struct
+{
+	int tag;
+	int ncols;
+	size_t rows;
+	char **name; /* header names */
+	double **col; /* the columns */
+	double *data; /* all the columns, one after the other */
+};
+
+/* a chunk of the body, parsed by one thread */
+typedef struct
+{
+	const char *start, *end;
+	size_t row0, rows; /* first row and row count */
+	eval_csv *csv;
+} Chunk;
+
+/* the end of a field starting at p, a comma or the end of the line */
+static const char *field_end(const char *p, const char *end)
+{
+	int quoted = 0;
+	
+	for(; p < end; p++)
+	{
+		if(*p == '"')
+			quoted = !quoted;
+		else if(!quoted && (*p == ',' || *p == '\n'))
+			break;
+	}
+	
+	return p;
+}
+
+/* copy a field without quotes and surrounding blanks into buf, which
+** holds size bytes, returns the length (which may be more than fits) */
+static size_t field_text(const char *p, const char *e, char *buf, size_t size)
+{
+	size_t n = 0;
+	int quoted = 0;
+	
+	while(p < e && (*p == ' ' || *p == '\t'))
+		p++;
+	while(e > p && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r'))
+		e--;
+	for(; p < e; p++)
+	{
+		if(*p == '"')
+		{
+			if(quoted && p+1 < e && p[1] == '"')
+				p++; /* a doubled quote is a quote */
+			else
+			{
+				quoted = !quoted;
+				continue;
+			}
+		}
+		if(n+1 < size)
+			buf[n] = *p;
+		n++;
+	}
+	if(size > 0)
+		buf[n < size ? n : size-1] = '\0';
+	
+	return n;
+}
+
+/* the value of a field, NaN if it isn't a number */
+static double field_value(const char *p, const char *e)
+{
+	char buf[FIELD_MAX+1], *stop;
+	size_t n;
+	double v;
+	
+	n = field_text(p, e, buf, sizeof(buf));
+	if(n == 0 || n > FIELD_MAX)
+		return NAN;
+	v = strtod(buf, &stop);
+	
+	return *stop == '\0' ? v : NAN;
+}
+
+/* non-zero if a line holds nothing but blanks */
+static int blank_line(const char *p, const char *e)
+{
+	for(; p < e; p++)
+		if(*p != ' ' && *p != '\t' && *p != '\r')
+			return 0;
+	
+	return 1;
+}
+
+/* count the rows of a chunk */
+static void count_rows(Chunk *c)
+{
+	const char *p, *nl;
+	
+	c->rows = 0;
+	for(p = c->start; p < c->end; p = nl+1)
+	{
+		nl = memchr(p, '\n', c->end-p);
+		if(nl == NULL)
+			nl = c->end;
+		if(!blank_line(p, nl))
+			c->rows++;
+	}
+	
+	return;
+}
+
+/* parse the rows of a chunk into the columns */
+static void parse_rows(Chunk *c)
+{
+	eval_csv *csv = c->csv;
+	const char *p, *nl, *e;
+	size_t row = c->row0;
+	int i;
+	
+	for(p = c->start; p < c->end; p = nl+1)
+	{
+		nl = memchr(p, '\n', c->end-p);
+		if(nl == NULL)
+			nl = c->end;
+		if(blank_line(p, nl))
+			continue;
+		for(i = 0; i < csv->ncols; i++)
+		{
+			if(p > nl)
+			{ /* missing field */
+				csv->col[i][row] = NAN;
+				continue;
+			}
+			e = field_end(p, nl);
+			csv->col[i][row] = field_value(p, e);
+			p = e+1;
+		}
+		row++;
+	}
+	
+	return;
+}
+
+static int count_task(void *arg, void *state, long task)
+{
+	(void)state;
+	count_rows((Chunk*)arg+task);
+	
+	return 0;
+}
+
+static int parse_task(void *arg, void *state, long task)
+{
+	(void)state;
+	parse_rows((Chunk*)arg+task);
+	
+	return 0;
+}
+
+/* read the header into a new csv, returns NULL if out of memory */
+static eval_csv *read_header(const char *p, const char *end)
+{
+	eval_csv *csv;
+	const char *e, *nl;
+	char *s;
+	size_t size;
+	int n, i;
+	
+	nl = memchr(p, '\n', end-p);
+	if(nl == NULL)
+		nl = end;
+	size = sizeof(eval_csv);
+	for(n = 0, e = p; ; e++)
+	{
+		e = field_end(e, nl);
+		n++;
+		if(e >= nl)
+			break;
+	}
+	size += (sizeof(char*)+sizeof(double*))*n+(nl-p)+n;
+	csv = (eval_csv*)malloc(size);
+	if(csv == NULL)
+		return NULL;
+	csv->tag = CSV_TAG;
+	csv->ncols = n;
+	csv->rows = 0;
+	csv->data = NULL;
+	csv->name = (char**)(csv+1);
+	csv->col = (double**)(csv->name+n);
+	s = (char*)(csv->col+n);
+	for(i = 0; i < n; i++)
+	{
+		e = field_end(p, nl);
+		csv->name[i] = s;
+		s += field_text(p, e, s, e-p+1)+1;
+		csv->col[i] = NULL;
+		p = e+1;
+	}
+	
+	return csv;
+}
+
+/* is a header name one the parser reads as a variable? (see pull_token()) */
+static int var_name(const char *s)
+{
+	if(!isalpha((unsigned char)*s) && *s != '_')
+		return 0;
+	while(*++s != '\0')
+	{
+		if(!isalnum((unsigned char)*s) && *s != '_' && *s != '.')
+			return 0;
+	}
+	
+	return 1;
+}
+
+/* load the text of a CSV file */
+static eval_csv *load_text(const char *text, size_t size)
+{
+	Chunk chunk[CSV_MAX_CHUNKS];
+	eval_csv *csv;
+	const char *body, *end = text+size, *p;
+	int nchunks, i;
+	
+	csv = read_header(text, end);
+	if(csv == NULL)
+		return NULL;
+	body = memchr(text, '\n', size);
+	body = body != NULL ? body+1 : end;
+	nchunks = pool_threads() > 1 ? pool_threads()*CSV_CHUNKS : 1;
+	if(nchunks > CSV_MAX_CHUNKS)
+		nchunks = CSV_MAX_CHUNKS;
+	if((size_t)nchunks > (size_t)(end-body)/CSV_MIN_CHUNK)
+		nchunks = (int)((end-body)/CSV_MIN_CHUNK);
+	if(nchunks < 1)
+		nchunks = 1;
+	for(i = 0, p = body; i < nchunks; i++)
+	{ /* cut at the first line end past an even share */
+		chunk[i].start = p;
+		if(i == nchunks-1)
+			p = end;
+		else
+		{
+			p = body+(end-body)*(i+1)/nchunks;
+			if(p < chunk[i].start)
+				p = chunk[i].start;
+			p = memchr(p, '\n', end-p);
+			p = p != NULL ? p+1 : end;
+		}
+		chunk[i].end = p;
+		chunk[i].csv = csv;
+	}
+	pool_tasks(count_task, chunk, nchunks);
+	for(i = 0; i < nchunks; i++)
+	{
+		chunk[i].row0 = csv->rows;
+		csv->rows += chunk[i].rows;
+	}
+	csv->data = (double*)malloc(sizeof(double)*
+		(csv->rows > 0 ? csv->rows : 1)*csv->ncols);
+	if(csv->data == NULL)
+	{
+		free(csv);
+		return NULL;
+	}
+	for(i = 0; i < csv->ncols; i++)
+		csv->col[i] = csv->data+csv->rows*i;
+	pool_tasks(parse_task, chunk, nchunks);
+	
+	return csv;
+}
+
+/* public: load a CSV file and define its header names as variables */
+int eval_ctx_csv_load(eval_ctx *ctx, const char *path, eval_csv **csv)
+{
+	eval_csv *c;
+	const char *text;
+	size_t size = 0;
+	double value;
+	int i;
+	
+	if(path == NULL || csv == NULL)
+		return EVAL_NULL_EXPRESSION;
+	*csv = NULL;
+	if((text = file_map(path, &size, 1)) == NULL)
+		return EVAL_CSV_ERROR; /* unreadable, or not even a header */
+	c = load_text(text, size);
+	file_unmap(text, size);
+	if(c == NULL)
+		return EVAL_MEM_ERROR;
+	for(i = 0; i < c->ncols; i++)
+	{ /* existing variables keep their values, bad names aren't bound */
+		if(var_name(c->name[i])
+			&& eval_ctx_get_var(ctx, c->name[i], &value) != 0)
+			eval_ctx_set_var(ctx, c->name[i], 0.0);
+	}
+	*csv = c;
+	
+	return 0;
+}
+
+int eval_csv_load(const char *path, eval_csv **csv)
+{
+	return eval_ctx_csv_load(NULL, path, csv);
+}
+
+/* public: the number of rows of a CSV file */
+size_t eval_csv_rows(const eval_csv *csv)
+{
+	if(csv == NULL || csv->tag != CSV_TAG)
+		return 0;
+	return csv->rows;
+}
+
+/* public: the number of columns of a CSV file */
+int eval_csv_cols(const eval_csv *csv)
+{
+	if(csv == NULL || csv->tag != CSV_TAG)
+		return 0;
+	return csv->ncols;
+}
+
+/* public: the header name of a column */
+const char *eval_csv_name(const eval_csv *csv, int col)
+{
+	if(csv == NULL || csv->tag != CSV_TAG || col < 0 || col >= csv->ncols)
+		return NULL;
+	return csv->name[col];
+}
+
+/* public: the values of a column */
+const double *eval_csv_column(const eval_csv *csv, int col)
+{
+	if(csv == NULL || csv->tag != CSV_TAG || col < 0 || col >= csv->ncols)
+		return NULL;
+	return csv->col[col];
+}
+
+/* public: evaluate a compiled expression for every row */
+int eval_csv_run(const eval_csv *csv, eval_compiled *compiled, double *out)
+{
+	if(csv == NULL || csv->tag != CSV_TAG)
+		return EVAL_NULL_EXPRESSION;
+	if(csv->rows == 0)
+		return 0;
+	return eval_run_batch(compiled, csv->rows, csv->ncols,
+		(const char**)csv->name, (const double**)csv->col, out);
+}
+
+/* public: release a loaded CSV file */
+void eval_csv_free(eval_csv *csv)
+{
+	if(csv == NULL || csv->tag != CSV_TAG)
+		return;
+	csv->tag = 0;
+	free(csv->data);
+	free(csv);
+	
+	return;
+}
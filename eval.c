@@ -1,5 +1,5 @@
 /*
-** simple expression evaluator library (recursive descent parser)
+** simple expression evaluator library (operator precedence parser)
 ** Copyright (C) 2006, 2007  Jeffrey S. Dutky
 **
 ** This library is free software; you can redistribute it and/or
@@ -25,9 +25,38 @@
 **  5 Jan 2007 - v1.0.6 - changed info strings and added build date
 **  6 Jan 2007 - v1.0.7 - fixed stuff done in 1.0.6 for info strings and dates
 **  6 Jan 2007 - v1.0.8 - fixed bug in var() and version string construction
+** 16 Oct 2026 - v1.1.0 - parse into expression trees, added eval_compile(),
+**                        eval_run() and eval_free(); compile expression trees
+**                        to register machine code; added eval_jit(), x86-64
+**                        native code generator; constant folding, added
+**                        eval_def_const() and eval_def_pure_fn(); common
+**                        subexpression elimination; one slot per variable,
+**                        added eval_bind_var(); added eval_run_batch(), SIMD
+**                        batch evaluation; vector versions of the standard
+**                        functions, added eval_def_vector_fn();
+**                        multi-threaded batch evaluation, added
+**                        eval_batch_threads(); reentrant evaluation contexts,
+**                        added eval_ctx_*(); parser memory kept between
+**                        expressions, added eval_arena_keep(); tokens refer
+**                        to the expression instead of copies; non-recursive
+**                        parser, - / and \ are now left associative; eval()
+**                        caches compiled expressions, added
+**                        eval_cache_limit() and eval_cache_info(); the
+**                        variable/function table grows as needed; open
+**                        addressing variable/function table, names hashed
+**                        with FNV-1a; added eval_ctx_create_shared(),
+**                        contexts on other threads share a table they read
+**                        without locking; interned names, names may contain
+**                        dots; hashtable benchmark (make bench-hashtable);
+**                        evaluation benchmark (make bench); added
+**                        eval_stats_*(), evaluation statistics; added
+**                        eval_profile_*(), sampling profiler; evalrun bulk
+**                        evaluation tool replaces eval_test; added
+**                        eval_csv_*(), columnar CSV evaluation; added
+**                        eval_serialize(), eval_load(), plan cache
 */
 
-/* simple recursive descent parser for arithmetic expressions
+/* simple operator precedence parser for arithmetic expressions
 **
 ** Copyright (C) 11-17 Dec. 2006, Jeffrey Dutky
 **
@@ -35,11 +64,14 @@
 ** multiplication (*), division (/), modulo division (\), exponentiation (^),
 ** grouping (()), sign change (-+), percentages (%) and function evaluation (()) 
 **
-**   expr = term+expr | term-expr | term
-**   term = fact*term | fact/term | fact\term | fact
+**   expr = expr+term | expr-term | term
+**   term = term*fact | term/fact | term\fact | fact
 **   fact = item^fact | item
-**   item = +item | -item | num | var | fn(args) | item% | (expr)
-**   args = expr,args | expr
+**   item = +fact | -fact | num | var | fn(args) | item% | (expr)
+**   args = expr,args | expr |
+**
+** the grammar was originally parsed by recursive descent, it is now parsed
+** without recursion by an operator precedence parser (see parse_expr())
 */
 
 static int G_version = VER;
@@ -55,9 +87,11 @@ static char *G_license = "libeval license: GNU Lesser General Public License (LG
 #include <math.h>
 #include <limits.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "hashtable.h"
-#include "eval.h"
+#include "evalcode.h"
 
 #ifdef EVAL_DEBUG
 #define DB(X) X
@@ -66,145 +100,420 @@ static char *G_license = "libeval license: GNU Lesser General Public License (LG
 #endif
 
 typedef struct Node_struct Node;
-struct Node_struct { /* automatic free node */
-	Node *link;
+struct Node_struct { /* arena block */
+	Node *link; /* next block */
+	size_t size; /* bytes of data in this block */
 	char data[1];
 };
 
-static Node *G_cur_node = NULL; /* head of automatic free list */
-static size_t G_cur_data_pos = 0; /* current position in head node */
-static size_t G_cur_data_size = 0; /* size of data in head node */
+/* arena for everything allocated while parsing an expression. lalloc()
+** bumps a pointer through a chain of blocks, lreset() releases everything
+** at once by moving the pointer back to the first block. The blocks are
+** kept for the next expression, up to keep bytes of them, so evaluation
+** doesn't call malloc() once the arena has grown to fit the expressions */
+typedef struct
+{
+	Node *first; /* first block of the chain */
+	Node *cur; /* block being allocated from */
+	size_t pos; /* bytes used in the current block */
+	size_t keep; /* bytes of blocks kept by lreset() */
+	unsigned long blocks; /* blocks allocated, see eval_ctx_stats_info() */
+} Arena;
 #define MIN_ALLOC_SIZE 5000
+#define ARENA_KEEP (64*1024) /* default for Arena.keep */
+#define ARENA_ALIGN sizeof(double)
 
-/* allocate memory for later automatic clean-up*/
-static void *lalloc(size_t size)
+/* allocate memory from an arena, freed by the next lreset() */
+static void *lalloc(Arena *a, size_t size)
 {
 	size_t asize;
 	void *ptr;
-	Node *n;
+	Node *n, **p;
 	
 	DB(printf("-- lalloc(size=%zu)\n", size));
-	if(size > G_cur_data_size-G_cur_data_pos)
-	{ /* if there is not enough space in the current block */
-		if(size < MIN_ALLOC_SIZE)
-			asize = MIN_ALLOC_SIZE; /* never alloc less than MIN_ALLOC_SIZE */
-		else
-			asize = size+MIN_ALLOC_SIZE; /* alloc more than was asked for */
-		/* allocate a new block large enough to hold the requested amount */
-		DB(printf("-- lalloc new block %zu bytes\n", asize));
-		n = (Node*)malloc(sizeof(Node)+asize); /* alloc new block */
+	size = (size+ARENA_ALIGN-1) & ~(ARENA_ALIGN-1);
+	if(a->cur == NULL || size > a->cur->size-a->pos)
+	{ /* not enough space in the current block, try the next kept blocks */
+		p = a->cur == NULL ? &a->first : &a->cur->link;
+		for(n = *p; n != NULL && n->size < size; n = n->link)
+			p = &n->link;
 		if(n == NULL)
-			return NULL; /* failed to alloc new block */
-		DB(printf("-- lalloc new block at %p (old block at %p)\n",
-			n, G_cur_node));
-		n->link = G_cur_node; /* link current list head to new block */
-		G_cur_node = n; /* new block becomes new list head */
-		DB(printf("-- lalloc head block now %p\n", G_cur_node));
-		G_cur_data_pos = 0; /* alloc from start of new block */
-		G_cur_data_size = asize; /* alloc up to asize bytes from new block */
-		DB(printf("-- lalloc new block size %zu bytes\n", G_cur_data_size));
-	}
-	ptr = G_cur_node->data+G_cur_data_pos; /* return pointer to current byte */
-	DB(printf("-- lalloc old data pos = %zu\n", G_cur_data_pos));
-	G_cur_data_pos += size; /* move alloc pos forward by alloced length */
-	DB(printf("-- lalloc new data pos = %zu\n", G_cur_data_pos));
+		{ /* none big enough, add a new block to the end of the chain */
+			if(size < MIN_ALLOC_SIZE)
+				asize = MIN_ALLOC_SIZE; /* never alloc less than MIN_ALLOC_SIZE */
+			else
+				asize = size+MIN_ALLOC_SIZE; /* alloc more than was asked for */
+			DB(printf("-- lalloc new block %zu bytes\n", asize));
+			n = (Node*)malloc(sizeof(Node)+asize);
+			if(n == NULL)
+				return NULL; /* failed to alloc new block */
+			n->link = NULL;
+			n->size = asize;
+			*p = n;
+			a->blocks++;
+		}
+		DB(printf("-- lalloc block now %p\n", (void*)n));
+		a->cur = n;
+		a->pos = 0;
+	}
+	ptr = a->cur->data+a->pos; /* return pointer to current byte */
+	a->pos += size; /* move alloc pos forward by alloced length */
 	DB(printf("-- lalloc ptr=%p\n", ptr));
 	
 	return ptr;
 }
 
-/* free all memory previously allocated by lalloc */
-static void lfreeall(void)
+/* free everything allocated from an arena, keeping the blocks from the
+** start of the chain that fit in the arena's keep limit */
+static void lreset(Arena *a)
 {
-	Node *n, *t;
+	Node *n, *t, **p;
+	size_t kept = 0;
 	
-	n = G_cur_node;
+	p = &a->first;
+	while(*p != NULL && kept+(*p)->size <= a->keep)
+	{
+		kept += (*p)->size;
+		p = &(*p)->link;
+	}
+	n = *p;
+	*p = NULL;
 	while(n != NULL)
 	{
 		t = n->link;
 		free(n);
 		n = t;
 	}
-	G_cur_node = NULL;
-	G_cur_data_pos = 0;
-	G_cur_data_size = 0;
+	a->cur = NULL;
+	a->pos = 0;
+	
+	return;
+}
+
+/* free an arena's blocks */
+static void lfreeall(Arena *a)
+{
+	a->keep = 0;
+	lreset(a);
 	
 	return;
 }
 
+/* an interned name. A name is copied and hashed once, when it is first
+** defined, into a symbol table shared by all the contexts. The context
+** tables are keyed by symbols, which carry the hash code and length of the
+** name, and compiled expressions name their variables by symbol, so names
+** are compared by pointer. Symbols are never freed */
+typedef struct
+{
+	unsigned int hash; /* name_hash() of the name */
+	int len; /* length of the name */
+	char str[1]; /* the name, sized when allocated */
+} Symbol;
+
 typedef struct
 {
 	double value; /* variable value */
 	FunctionPtr fn; /* function pointer */
+	VectorFunctionPtr vfn; /* vector version of the function, or NULL */
 	int nargs; /* function argument count expected */
 	void *data; /* used by function call */
-	char name[1]; /* name of function, array sized when allocated */
+	int flags; /* VARFN_CONST for constants, VARFN_PURE for pure functions */
+	const Symbol *sym; /* name of variable or function */
 } VarFn;
 
-/* create a new variable structure with the given name and value */
-static VarFn *create_var(const char *name, double value)
+#define VARFN_CONST 1 /* value can't be changed by eval_set_var() */
+#define VARFN_PURE 2 /* result depends only on the function arguments */
+
+typedef struct
+{
+	char type; /* v f n + - * / % ^ ( ) , or null char ('\0') */
+	int start, len; /* token text, offset and length in the expression */
+	double value; /* value of token, if 'v' or 'i' */
+	int args; /* number of arguments to function, if 'f' */
+	FunctionPtr fn; /* function pointer, if 'f' */
+	void *data; /* custom data block for function, if 'f' */
+	VarFn *vf; /* variable or function table entry, if 'v' or 'f' */
+} Token;
+
+/* create a new variable structure with the given symbol and value */
+static VarFn *create_var(const Symbol *sym, double value)
 {
 	VarFn *vf;
 	
-	vf = (VarFn*)malloc(sizeof(VarFn)+strlen(name));
+	vf = (VarFn*)malloc(sizeof(VarFn));
 	if(vf != NULL)
 	{
 		vf->value = value;
 		vf->fn = NULL;
+		vf->vfn = NULL;
 		vf->nargs = 0;
 		vf->data = NULL;
-		strcpy(vf->name, name);
+		vf->flags = 0;
+		vf->sym = sym;
 	}
 	
 	return vf;
 }
 
-/* create a new function structure with the given name, pointer and args */
-static VarFn *create_fn(const char *name, FunctionPtr fn, int args, void *data)
+/* create a new function structure with the given symbol, pointer and args */
+static VarFn *create_fn(const Symbol *sym, FunctionPtr fn, int args,
+	void *data)
 {
 	VarFn *vf;
 	
-	vf = (VarFn*)malloc(sizeof(VarFn)+strlen(name));
+	vf = (VarFn*)malloc(sizeof(VarFn));
 	if(vf != NULL)
 	{
 		vf->value = 0.0;
 		vf->fn = fn;
+		vf->vfn = NULL;
 		vf->nargs = args;
 		vf->data = data;
-		strcpy(vf->name, name);
+		vf->flags = 0;
+		vf->sym = sym;
 	}
 	
 	return vf;
 }
 
-static hashtable *G_varfn_table = NULL;
-static int G_var_count = 0;
+/* an expression compiled by eval(), cached under its text. The entry, the
+** text and the list of names the expression uses are allocated together */
+typedef struct CacheEntry_struct CacheEntry;
+struct CacheEntry_struct
+{
+	CacheEntry *link; /* next entry in the same hash slot */
+	CacheEntry *prev, *next; /* more and less recently used entries */
+	unsigned long hash; /* hash code of the text */
+	size_t len; /* length of the text */
+	eval_compiled *ce;
+	int busy; /* runs in progress, the entry can't be freed while non-zero */
+	int stale; /* a name used by the expression was redefined while busy */
+	size_t size; /* bytes of the entry and its compiled expression */
+	int ndeps;
+	VarFn **dep; /* the variables and functions the expression uses */
+	char text[1]; /* the expression, sized when allocated */
+};
+
+/* compiled expressions kept by eval(), in a hash table and a list from the
+** most recently to the least recently used */
+typedef struct
+{
+	CacheEntry **slot; /* hash slots, a power of 2 of them */
+	unsigned long nslots;
+	int count, limit; /* entries, most entries kept */
+	CacheEntry *head, *tail; /* most and least recently used */
+	unsigned long hits, misses, evictions, invalidations;
+	size_t bytes; /* memory held by the entries */
+} Cache;
+#define CACHE_LIMIT 256 /* default for Cache.limit */
+
+/* a table of variables and functions shared by several contexts (see
+** eval_ctx_create_shared()). The table is concurrent, so the contexts look
+** names up without locking, but they take turns defining them */
+typedef struct
+{
+	pthread_mutex_t lock; /* held while a name is defined */
+	int refs; /* contexts sharing the table, see G_share_lock */
+	unsigned long redefs; /* constants and functions redefined */
+} Shared;
+
+/* an evaluation context holds the variables and functions, the state of
+** the parser and eval()'s cache, threads using different contexts share
+** nothing but a shared table */
+struct eval_ctx_struct
+{
+	int tag;
+	hashtable *table; /* variables and functions */
+	int var_count; /* number of variables */
+	Arena arena; /* tree nodes of the current parse */
+	int error; /* error in the current parse */
+	int recurse; /* eval() calls in progress, lreset() at zero */
+	Cache cache; /* expressions compiled by eval() */
+	Shared *shared; /* NULL unless the table is shared */
+	unsigned long redefs; /* shared->redefs the cache is up to date with */
+	eval_stats *stats; /* statistics, NULL unless they are on */
+	eval_stats *stats_mem; /* the statistics, kept while they are off */
+};
+
+#define CTX_TAG 0x78744345 /* ECtx */
+
+/* held while a table is first shared, and while counting its contexts */
+static pthread_mutex_t G_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the context used by the functions that don't take one */
+static eval_ctx G_ctx = {
+	CTX_TAG, NULL, 0, {NULL, NULL, 0, ARENA_KEEP, 0},
+	0, 0, {NULL, 0, 0, CACHE_LIMIT, NULL, NULL, 0, 0, 0, 0, 0}, NULL, 0,
+	NULL, NULL
+};
+
+static int cache_limit(eval_ctx *ctx, int limit);
+static void cache_forget(eval_ctx *ctx, VarFn *vf);
+static void redefined(eval_ctx *ctx, VarFn *vf);
+
+/* the context to use for a ctx parameter, NULL for the default context,
+** returns NULL if ctx isn't a context */
+static eval_ctx *get_ctx(eval_ctx *ctx)
+{
+	if(ctx == NULL)
+		return &G_ctx;
+	if(ctx->tag != CTX_TAG)
+		return NULL;
+	return ctx;
+}
+
+#define FNV_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+/* a name, which isn't null terminated if it's in an expression */
+typedef struct
+{
+	const char *str;
+	int len;
+} Name;
 
-/* compute hash code based on up to the first 32 bytes of the key string */
-static unsigned int vhash(const void *key)
+/* FNV-1a hash code of the whole name. Names that differ only in a digit or
+** two (cpu_01, cpu_02, ...) get well spread codes */
+static unsigned int name_hash(const Name *name)
 {
-	char *k;
-	int i, h = 0;
+	unsigned int h = FNV_BASIS;
+	int i;
 	
-	if(key == NULL)
-		return 0;
-	k = (char*)key;
-	for(i = 0; k[i] && i < 32; i++)
-		h += k[i]<<i;
+	for(i = 0; i < name->len; i++)
+		h = (h^(unsigned char)name->str[i])*FNV_PRIME;
 	
 	return h;
 }
 
-/* compare two key strings, allowing NULLs */
-static int vcomp(const void *key1, const void *key2)
+/* compare a name (key1) with a symbol (key2), 0 (zero) if equal */
+static int name_comp(const void *key1, const void *key2)
 {
-	if(key1 == NULL && key2 == NULL)
-		return 0;
-	if(key1 == NULL)
-		return -1;
-	if(key2 == NULL)
-		return 1;
-	return strcmp((char*)key1, (char*)key2);
+	const Name *name = (const Name*)key1;
+	const Symbol *sym = (const Symbol*)key2;
+	
+	return sym->len != name->len || memcmp(name->str, sym->str, name->len);
+}
+
+/* hash code of a symbol, computed when the name was interned */
+static unsigned int sym_hash(const void *key)
+{
+	return ((const Symbol*)key)->hash;
+}
+
+/* compare two symbols of the symbol table by name, 0 (zero) if equal */
+static int sym_comp(const void *key1, const void *key2)
+{
+	const Symbol *s1 = (const Symbol*)key1;
+	const Symbol *s2 = (const Symbol*)key2;
+	
+	return s1->len != s2->len || memcmp(s1->str, s2->str, s1->len);
+}
+
+/* compare two symbols of a context table, 0 (zero) if equal. Each name has
+** one symbol, so equal names are the same symbol */
+static int sym_same(const void *key1, const void *key2)
+{
+	return key1 != key2;
+}
+
+/* the symbol table, a concurrent table keyed and valued by the symbols,
+** names are interned while holding G_symbols_lock */
+static hashtable *G_symbols = NULL;
+static pthread_once_t G_symbols_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t G_symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void sym_init(void)
+{
+	G_symbols = ht_create_flat(1000, sym_hash, sym_comp, NULL, NULL);
+	if(G_symbols != NULL && ht_concurrent(G_symbols))
+	{
+		ht_delete(G_symbols);
+		G_symbols = NULL;
+	}
+	
+	return;
+}
+
+/* the symbol of a name, NULL if the name was never interned, in which case
+** no table has it */
+static const Symbol *sym_find(const Name *name)
+{
+	void *sym;
+	
+	pthread_once(&G_symbols_once, sym_init);
+	if(G_symbols == NULL
+	|| ht_lookup_hash(G_symbols, name, name_hash(name), name_comp, &sym))
+		return NULL;
+	
+	return (const Symbol*)sym;
+}
+
+/* intern a name, returns its symbol, or NULL if out of memory */
+static const Symbol *intern(const char *str)
+{
+	const Symbol *found;
+	Symbol *sym;
+	Name name;
+	
+	if(str == NULL)
+		return NULL;
+	name.str = str;
+	name.len = (int)strlen(str);
+	if((found = sym_find(&name)) != NULL || G_symbols == NULL)
+		return found;
+	pthread_mutex_lock(&G_symbols_lock);
+	found = sym_find(&name); /* another thread may have just interned it */
+	if(found == NULL)
+	{
+		sym = (Symbol*)malloc(sizeof(Symbol)+name.len);
+		if(sym != NULL)
+		{
+			sym->hash = name_hash(&name);
+			sym->len = name.len;
+			memcpy(sym->str, str, name.len+1);
+			if(ht_insert(G_symbols, sym, sym))
+			{
+				free(sym);
+				sym = NULL;
+			}
+		}
+		found = sym;
+	}
+	pthread_mutex_unlock(&G_symbols_lock);
+	
+	return found;
+}
+
+/* the interned copy of a name, NULL if it was never interned */
+const char *intern_find(const char *str)
+{
+	const Symbol *sym;
+	Name name;
+	
+	if(str == NULL)
+		return NULL;
+	name.str = str;
+	name.len = (int)strlen(str);
+	sym = sym_find(&name);
+	
+	return sym != NULL ? sym->str : NULL;
+}
+
+/* find a null terminated name in a context's table, NULL if not found */
+static VarFn *find_name(hashtable *table, const char *str)
+{
+	void *vf;
+	Name name;
+	
+	if(str == NULL)
+		return NULL;
+	name.str = str;
+	name.len = (int)strlen(str);
+	if(ht_lookup_hash(table, &name, name_hash(&name), name_comp, &vf))
+		return NULL;
+	
+	return (VarFn*)vf;
 }
 
 /* delete the variable value */
@@ -216,142 +525,425 @@ static void vdel(void *val)
 	return;
 }
 
-/* public: variable access (set) function */
-int eval_set_var(const char *name, double value)
+/* take turns defining names in a shared table */
+static void def_lock(eval_ctx *ctx)
+{
+	if(ctx->shared != NULL)
+		pthread_mutex_lock(&ctx->shared->lock);
+	
+	return;
+}
+
+static void def_unlock(eval_ctx *ctx)
+{
+	if(ctx->shared != NULL)
+		pthread_mutex_unlock(&ctx->shared->lock);
+	
+	return;
+}
+
+/* a constant or function is being redefined, drop the cached expressions
+** using it, and have the other contexts sharing the table drop theirs */
+static void redefined(eval_ctx *ctx, VarFn *vf)
+{
+	unsigned long redefs;
+	
+	cache_forget(ctx, vf);
+	if(ctx->shared != NULL)
+	{
+		redefs = __atomic_add_fetch(&ctx->shared->redefs, 1, __ATOMIC_RELEASE);
+		if(ctx->redefs == redefs-1)
+			ctx->redefs = redefs; /* nothing else was redefined meanwhile */
+	}
+	
+	return;
+}
+
+/* set a variable or constant, flags are added to an existing variable */
+static int set_var(eval_ctx *ctx, const char *name, double value, int flags)
 {
+	const Symbol *sym;
 	VarFn *var;
 	
-	if(G_varfn_table == NULL)
+	if(ctx->table == NULL)
 	{ /* allocate the var table */
-		G_varfn_table = ht_create(500, vhash, vcomp, NULL, vdel);
-		if(G_varfn_table == NULL)
+		ctx->table = ht_create_flat(500, sym_hash, sym_same, NULL, vdel);
+		if(ctx->table == NULL)
 			return 1;
 	}
 	/* find named var, update value or insert var/value */
-	if(ht_lookup(G_varfn_table, name, (void*)&var))
+	if((var = find_name(ctx->table, name)) == NULL)
 	{ /* not found, insert new variable */
-		var = create_var(name, value);
+		if((sym = intern(name)) == NULL)
+			return 2;
+		var = create_var(sym, value);
 		if(var == NULL)
 			return 2;
-		if(ht_insert(G_varfn_table, (void*)(var->name), (void*)var))
+		var->flags = flags;
+		if(ht_insert(ctx->table, sym, (void*)var))
+		{
+			free(var);
 			return 3;
-		G_var_count++;
+		}
+		ctx->var_count++;
 	}else if(var->fn != NULL)
 		return 4;
+	else if((var->flags & VARFN_CONST) && !(flags & VARFN_CONST))
+		return 5; /* constants can only be changed by eval_def_const() */
 	else
-		var->value = value;
+	{
+		if(flags & VARFN_CONST)
+			redefined(ctx, var); /* eval()'s cache may have the old value */
+		__atomic_store(&var->value, &value, __ATOMIC_RELAXED);
+		if(flags != 0)
+			__atomic_or_fetch(&var->flags, flags, __ATOMIC_RELAXED);
+	}
+	
+	return 0;
+}
+
+/* allocate a context using a table, returns NULL on failure */
+static eval_ctx *new_ctx(hashtable *table)
+{
+	eval_ctx *ctx;
+	
+	ctx = (eval_ctx*)malloc(sizeof(eval_ctx));
+	if(ctx == NULL)
+		return NULL;
+	ctx->tag = CTX_TAG;
+	ctx->table = table;
+	ctx->var_count = 0;
+	ctx->arena.first = NULL;
+	ctx->arena.cur = NULL;
+	ctx->arena.pos = 0;
+	ctx->arena.keep = ARENA_KEEP;
+	ctx->arena.blocks = 0;
+	ctx->error = 0;
+	ctx->recurse = 0;
+	ctx->cache.slot = NULL;
+	ctx->cache.nslots = 0;
+	ctx->cache.count = 0;
+	ctx->cache.limit = CACHE_LIMIT;
+	ctx->cache.head = NULL;
+	ctx->cache.tail = NULL;
+	ctx->cache.hits = 0;
+	ctx->cache.misses = 0;
+	ctx->cache.evictions = 0;
+	ctx->cache.invalidations = 0;
+	ctx->cache.bytes = 0;
+	ctx->shared = NULL;
+	ctx->redefs = 0;
+	ctx->stats = NULL;
+	ctx->stats_mem = NULL;
+	
+	return ctx;
+}
+
+/* public: create a new evaluation context */
+eval_ctx *eval_ctx_create(void)
+{
+	hashtable *table;
+	eval_ctx *ctx;
+	
+	table = ht_create_flat(500, sym_hash, sym_same, NULL, vdel);
+	if(table == NULL)
+		return NULL;
+	ctx = new_ctx(table);
+	if(ctx == NULL)
+		ht_delete(table);
+	
+	return ctx;
+}
+
+/* public: create a context sharing the variables and functions of another
+** context, for another thread */
+eval_ctx *eval_ctx_create_shared(eval_ctx *share)
+{
+	eval_ctx *ctx;
+	Shared *sh;
+	
+	if((share = get_ctx(share)) == NULL)
+		return NULL;
+	pthread_mutex_lock(&G_share_lock);
+	if(share->table == NULL)
+	{ /* allocate the default context's table */
+		share->table = ht_create_flat(500, sym_hash, sym_same, NULL, vdel);
+		if(share->table == NULL)
+		{
+			pthread_mutex_unlock(&G_share_lock);
+			return NULL;
+		}
+	}
+	if(share->shared == NULL)
+	{ /* the table's first sharing, it must become concurrent */
+		sh = (Shared*)malloc(sizeof(Shared));
+		if(sh == NULL || pthread_mutex_init(&sh->lock, NULL) != 0)
+		{
+			free(sh);
+			pthread_mutex_unlock(&G_share_lock);
+			return NULL;
+		}
+		if(ht_concurrent(share->table))
+		{
+			pthread_mutex_destroy(&sh->lock);
+			free(sh);
+			pthread_mutex_unlock(&G_share_lock);
+			return NULL;
+		}
+		sh->refs = 1;
+		sh->redefs = 0;
+		share->redefs = 0;
+		share->shared = sh;
+	}
+	ctx = new_ctx(share->table);
+	if(ctx != NULL)
+	{
+		ctx->shared = share->shared;
+		ctx->var_count = share->var_count;
+		ctx->shared->refs++;
+		ctx->redefs = __atomic_load_n(&ctx->shared->redefs, __ATOMIC_ACQUIRE);
+	}
+	pthread_mutex_unlock(&G_share_lock);
+	
+	return ctx;
+}
+
+/* public: release an evaluation context */
+void eval_ctx_free(eval_ctx *ctx)
+{
+	int refs;
+	
+	if(ctx == NULL || ctx == &G_ctx || ctx->tag != CTX_TAG)
+		return;
+	ctx->tag = 0;
+	cache_limit(ctx, 0);
+	free(ctx->cache.slot);
+	if(ctx->shared != NULL)
+	{ /* the last context sharing the table deletes it */
+		pthread_mutex_lock(&G_share_lock);
+		refs = --ctx->shared->refs;
+		pthread_mutex_unlock(&G_share_lock);
+		if(refs == 0)
+		{
+			ht_delete(ctx->table);
+			pthread_mutex_destroy(&ctx->shared->lock);
+			free(ctx->shared);
+		}
+	}else
+		ht_delete(ctx->table);
+	lfreeall(&ctx->arena);
+	free(ctx->stats_mem);
+	free(ctx);
+	
+	return;
+}
+
+/* public: set how much parser memory a context keeps between expressions */
+int eval_ctx_arena_keep(eval_ctx *ctx, size_t bytes)
+{
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	ctx->arena.keep = bytes;
+	if(ctx->recurse == 0)
+		lreset(&ctx->arena); /* trim now, not at the next expression */
 	
 	return 0;
 }
 
+int eval_arena_keep(size_t bytes)
+{
+	return eval_ctx_arena_keep(NULL, bytes);
+}
+
+/* public: variable access (set) function */
+int eval_ctx_set_var(eval_ctx *ctx, const char *name, double value)
+{
+	int rv;
+	
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	def_lock(ctx);
+	rv = set_var(ctx, name, value, 0);
+	def_unlock(ctx);
+	
+	return rv;
+}
+
+int eval_set_var(const char *name, double value)
+{
+	return eval_ctx_set_var(NULL, name, value);
+}
+
+/* public: define a named constant */
+int eval_ctx_def_const(eval_ctx *ctx, const char *name, double value)
+{
+	int rv;
+	
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	def_lock(ctx);
+	rv = set_var(ctx, name, value, VARFN_CONST);
+	def_unlock(ctx);
+	
+	return rv;
+}
+
+int eval_def_const(const char *name, double value)
+{
+	return eval_ctx_def_const(NULL, name, value);
+}
+
 /* public: variable access (get) function */
-int eval_get_var(const char *name, double *value)
+int eval_ctx_get_var(eval_ctx *ctx, const char *name, double *value)
 {
 	VarFn *var;
 	
-	if(G_varfn_table == NULL)
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	if(ctx->table == NULL)
 	{ /* allocate the var table */
-		G_varfn_table = ht_create(500, vhash, vcomp, NULL, vdel);
-		if(G_varfn_table == NULL)
+		ctx->table = ht_create_flat(500, sym_hash, sym_same, NULL, vdel);
+		if(ctx->table == NULL)
 			return 1;
 	}
 	/* find named var, return value or error if not found */
-	if(ht_lookup(G_varfn_table, name, (void*)&var))
+	if((var = find_name(ctx->table, name)) == NULL)
 		return 2; /* not found */
 	if(var->fn != NULL)
 		return 3; /* this is a funciton, NOT a variable */
 	if(value != NULL)
-		*value = var->value;
+		__atomic_load(&var->value, value, __ATOMIC_RELAXED);
 	
 	return 0;
 }
 
-int eval_def_fn(const char *name, FunctionPtr fn, void *data, int args)
+int eval_get_var(const char *name, double *value)
+{
+	return eval_ctx_get_var(NULL, name, value);
+}
+
+/* define or redefine a function, replacing its flags */
+static int def_fn(eval_ctx *ctx, const char *name, FunctionPtr fn,
+	void *data, int args, int flags)
 {
+	const Symbol *sym;
 	VarFn *f;
 	
-	if(G_varfn_table == NULL)
+	if(ctx->table == NULL)
 	{ /* allocate new fn table */
-		G_varfn_table = ht_create(500, vhash, vcomp, NULL, vdel);
-		if(G_varfn_table == NULL)
+		ctx->table = ht_create_flat(500, sym_hash, sym_same, NULL, vdel);
+		if(ctx->table == NULL)
 			return 1; /* failed to create table */
 	}
-	if(ht_lookup(G_varfn_table, name, (void*)(&f)))
+	if((f = find_name(ctx->table, name)) == NULL)
 	{
-		f = create_fn(name, fn, args, data);
+		if((sym = intern(name)) == NULL)
+			return 2; /* failed to intern the name */
+		f = create_fn(sym, fn, args, data);
 		if(f == NULL)
 			return 2; /* failed to create new entry */
-		if(ht_insert(G_varfn_table, (void*)(f->name), (void*)f))
+		f->flags = flags;
+		if(ht_insert(ctx->table, sym, (void*)f))
+		{
+			free(f);
 			return 3; /* insert failed */
+		}
 	}else if(f->fn == NULL)
 		return 4; /* this is a variable, NOT a function */
 	else
-	{
-		f->fn = fn;
-		f->data = data;
-		f->nargs = args;
+	{ /* a new entry replaces the old one, so a thread looking the function
+	  ** up in a shared table gets one or the other, never a mix of both */
+		redefined(ctx, f); /* eval()'s cache has the old function */
+		sym = f->sym;
+		f = create_fn(sym, fn, args, data);
+		if(f == NULL)
+			return 2;
+		f->flags = flags;
+		if(ht_insert(ctx->table, sym, (void*)f))
+		{
+			free(f);
+			return 3;
+		}
 	}
 	
 	return 0;
 }
 
-/* make a malloc()'d copy of a string, up to lim chars, full strlen if lim<1 */
-static char *copy_str(const char *str, int lim)
+/* public: define a function for use by eval() */
+int eval_ctx_def_fn(eval_ctx *ctx, const char *name, FunctionPtr fn,
+	void *data, int args)
 {
-	int len;
-	char *s;
+	int rv;
 	
-	DB(printf("-- copy_str(\"%s\", lim=%d)\n", str, lim));
-	len = strlen(str);
-	DB(printf("-- copy len(\"%s\")=%d\n", str, len));
-	if(lim <= 0)
-		lim = len;
-	if(len > lim)
-		len = lim;
-	DB(printf("-- copy len=%d lim=%d\n", len, lim));
-	s = lalloc(len+1);
-	DB(printf("-- copy s=%p\n", s));
-	if(s == NULL)
-		return NULL;
-	DB(printf("-- copy %d bytes from \"%s\" to s (%p)\n", len, str, s));
-	strncpy(s, str, len);
-	s[len] = '\0';
-	DB(printf("-- copy return \"%s\" (%p)\n", s, s));
-	return s;
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	def_lock(ctx);
+	rv = def_fn(ctx, name, fn, data, args, 0);
+	def_unlock(ctx);
+	
+	return rv;
 }
 
-typedef struct
+int eval_def_fn(const char *name, FunctionPtr fn, void *data, int args)
 {
-	char type; /* v f n + - * / % ^ ( ) , or null char ('\0') */
-	char *str; /* actual token string, lalloc()'d */
-	double value; /* value of token, if 'v' or 'i' */
-	int args; /* number of arguments to function, if 'f' */
-	FunctionPtr fn; /* function pointer, if 'f' */
-	void *data; /* custom data block for function, if 'f' */
-	char buf[2]; /* buffer for short token strings */
-} Token;
+	return eval_ctx_def_fn(NULL, name, fn, data, args);
+}
+
+/* public: define a pure function for use by eval() */
+int eval_ctx_def_pure_fn(eval_ctx *ctx, const char *name, FunctionPtr fn,
+	void *data, int args)
+{
+	int rv;
+	
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	def_lock(ctx);
+	rv = def_fn(ctx, name, fn, data, args, VARFN_PURE);
+	def_unlock(ctx);
+	
+	return rv;
+}
 
-Token G_pb_token = {'\0', NULL, 0.0, 0, NULL, NULL, {'\0','\0'}}; /* push back token */
+int eval_def_pure_fn(const char *name, FunctionPtr fn, void *data, int args)
+{
+	return eval_ctx_def_pure_fn(NULL, name, fn, data, args);
+}
+
+/* public: give a function a vector version for eval_run_batch() */
+int eval_ctx_def_vector_fn(eval_ctx *ctx, const char *name,
+	VectorFunctionPtr vfn)
+{
+	VarFn *f;
+	int rv = 0;
+	
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	def_lock(ctx);
+	if(ctx->table == NULL || (f = find_name(ctx->table, name)) == NULL)
+		rv = 1; /* no such function */
+	else if(f->fn == NULL)
+		rv = 2; /* this is a variable, NOT a function */
+	else
+		__atomic_store_n(&f->vfn, vfn, __ATOMIC_RELEASE);
+	def_unlock(ctx);
+	
+	return rv;
+}
 
-#define EVAL_SYNTAX_ERROR 1
-#define EVAL_DIVIDE_BY_ZERO 2
-#define EVAL_UNKNOWN_NAME 3
-#define EVAL_BAD_LITERAL 4
-#define EVAL_MEM_ERROR 5
-#define EVAL_CONVERT_ERROR 6
-#define EVAL_NESTED_PARENS 7
-#define EVAL_NULL_EXPRESSION 8
-#define EVAL_FUNCTION_ERROR 9
-#define EVAL_ARGS_ERROR 10
-static int G_eval_error = 0;
+int eval_def_vector_fn(const char *name, VectorFunctionPtr vfn)
+{
+	return eval_ctx_def_vector_fn(NULL, name, vfn);
+}
 
 #define MIN_ERR_VALUE 0
-#define MAX_ERR_VALUE 10
-static char *G_eval_err_str[11] = {
+#define MAX_ERR_VALUE 13
+static char *G_eval_err_str[14] = {
 	"No Error", "Syntax Error", "Divide By Zero", "Unknown Name",
 	"Bad Literal Value", "Error Allocating Memory", "Integer Convert Error",
 	"Missing Close Parentheses", "NULL Expression String",
-	"Error in Function Evaluation", "Invalid Argument Count"
+	"Error in Function Evaluation", "Invalid Argument Count",
+	"Error Reading CSV File", "Error Reading Compiled Expression",
+	"Compiled Expression Out of Date"
 };
 
 /* pull the next token from the buffer, starting at the indicated position
@@ -373,93 +965,42 @@ static char *G_eval_err_str[11] = {
 **    ')' = close parenthesis (end grouping or function call)
 **    ',' = comma (argument delimiter)
 */
-static Token pull_token(const char *buf, int *pos)
+static Token pull_token(eval_ctx *ctx, const char *buf, int *pos)
 {
-	char tbuf[101];
 	Token tok;
-	int i, j;
+	int i;
 	
 	tok.type = '\0';
-	tok.str = tok.buf;
+	tok.start = 0;
+	tok.len = 0;
 	tok.value = 0.0;
 	tok.args = 0;
 	tok.fn = NULL;
 	tok.data = NULL;
-	tok.buf[0] = '\0';
-	tok.buf[1] = '\0';
+	tok.vf = NULL;
 	
 	if(buf == NULL)
 		return tok;
 	
-	if(G_pb_token.type)
-	{
-		tok = G_pb_token;
-		G_pb_token.type = '\0';
-		G_pb_token.str = NULL;
-		G_pb_token.value = 0.0;
-		G_pb_token.args = 0;
-		G_pb_token.fn = NULL;
-		G_pb_token.data = NULL;
-		G_pb_token.buf[0] = '\0';
-		G_pb_token.buf[1] = '\0';
-		return tok;
-	}
-	
 	if(pos != NULL)
 		i = (*pos);
 	else
 		i = 0;
 	while(isspace(buf[i])) i++;
+	tok.start = i;
 	switch(buf[i])
 	{
 	case '+':
-		tok.type = '+';
-		tok.buf[0] = '+';
-		i++;
-		break;
 	case '-':
-		tok.type = '-';
-		tok.buf[0] = '-';
-		i++;
-		break;
 	case '*':
-		tok.type = '*';
-		tok.buf[0] = '*';
-		i++;
-		break;
 	case '/':
-		tok.type = '/';
-		tok.buf[0] = '/';
-		i++;
-		break;
 	case '\\':
-		tok.type = '\\';
-		tok.buf[0] = '\\';
-		i++;
-		break;
 	case '%':
-		tok.type = '%';
-		tok.buf[0] = '%';
-		i++;
-		break;
 	case '^':
-		tok.type = '^';
-		tok.buf[0] = '^';
-		i++;
-		break;
 	case '(':
-		tok.type = '(';
-		tok.buf[0] = '(';
-		i++;
-		break;
 	case ')':
-		tok.type = ')';
-		tok.buf[0] = ')';
-		i++;
-		break;
 	case ',':
-		tok.type = ',';
-		tok.buf[0] = ',';
+		tok.type = buf[i];
 		i++;
 		break;
 	default: /* numeric literal, variable name or invalid stuff */
@@ -472,36 +1013,44 @@ static Token pull_token(const char *buf, int *pos)
 			len = end_ptr - (buf + i);
 			if(len < 100)
 			{
-				tok.str = copy_str(buf + i, len);
 				tok.type = 'n';
 				i += len;
 			}
 			else
 			{
-				G_eval_error = EVAL_BAD_LITERAL;
+				ctx->error = EVAL_BAD_LITERAL;
 			}
 		}else if(isalpha(buf[i]) || buf[i] == '_') /* variable name */
 		{
+			unsigned long probes = 0;
 			VarFn *vf;
+			Name name;
+			int err;
 			
-			/* get variable name and lookup value in var table */
-			j = 0;
-			while(isalpha(buf[i]) || isdigit(buf[i]) || buf[i] == '_')
-			{
-				if(j < 100) tbuf[j++] = buf[i];
+			/* get variable name and lookup value in var/fn table */
+			while(isalpha(buf[i]) || isdigit(buf[i]) || buf[i] == '_'
+			|| buf[i] == '.')
 				i++;
+			name.str = buf+tok.start;
+			name.len = i-tok.start;
+			if(ctx->stats != NULL)
+				probes = ht_probes();
+			err = ht_lookup_hash(ctx->table, &name, name_hash(&name), name_comp,
+				(void*)(&vf));
+			if(ctx->stats != NULL)
+			{
+				ctx->stats->lookups++;
+				ctx->stats->probes += ht_probes()-probes;
 			}
-			tbuf[j] = '\0';
-			/* lookup variable name in var/fn table */
-			if(ht_lookup(G_varfn_table, tbuf, (void*)(&vf)))
-				G_eval_error = EVAL_UNKNOWN_NAME;
+			if(err)
+				ctx->error = EVAL_UNKNOWN_NAME;
 			else
 			{
-				tok.str = copy_str(tbuf, 0);
 				tok.args = vf->nargs;
 				tok.fn = vf->fn;
 				tok.data = vf->data;
-				tok.value = vf->value;
+				__atomic_load(&vf->value, &tok.value, __ATOMIC_RELAXED);
+				tok.vf = vf;
 				if(vf->fn == NULL)
 					tok.type = 'v'; /* name is a variable */
 				else
@@ -511,551 +1060,2254 @@ static Token pull_token(const char *buf, int *pos)
 		{
 			DB(printf("-- token end of buffer\n"));
 			tok.type = '\0';
-			tok.str = tok.buf;
-			tok.buf[0] = '\0';
 			tok.value = 0.0;
 		}else /* invalid stuff */
 		{
 			DB(printf("-- token invalid char '%c'\n", buf[i]));
-			G_eval_error = EVAL_SYNTAX_ERROR;
+			ctx->error = EVAL_SYNTAX_ERROR;
 		}
 	}
+	tok.len = i-tok.start;
 	if(pos != NULL)
 		*pos = i;
+	if(ctx->stats != NULL && tok.type != '\0')
+		ctx->stats->tokens++;
 	
 	return tok;
 }
 
-/* push the token back into the token stream */
-static int push_token(Token tok)
+/* expression tree node, built by the parser and compiled by gen_code()
+**
+** the types of nodes are:
+**
+**    'n' = numeric value (value)
+**    'v' = variable reference (vf)
+**    'f' = function call (fn, data, nargs, arg)
+**    'u' = sign change (lhs)
+**    '%' = percentage (lhs)
+**    '+' '-' '*' '/' '\' '^' = binary operators (lhs, rhs)
+**    '\0' = dead, folded into its parent by fold_nodes()
+**
+** The parser makes the operands of a node before the node itself, and
+** links the nodes together in the order it makes them, so the passes over
+** the tree walk the list instead of recursing, however deep the tree is.
+*/
+typedef struct ExprNode_struct ExprNode;
+struct ExprNode_struct
+{
+	char type; /* n v f u % + - * / \ ^ */
+	double value; /* value of numeric literal, if 'n' */
+	VarFn *vf; /* variable or function table entry, if 'v' or 'f' */
+	FunctionPtr fn; /* function pointer, if 'f' */
+	void *data; /* custom data block for function, if 'f' */
+	int nargs; /* number of arguments, if 'f' */
+	ExprNode *lhs, *rhs; /* operands, rhs is unused by unary operators */
+	ExprNode **arg; /* argument expressions, if 'f' */
+	ExprNode *next; /* next node made by the parser */
+	int reg; /* register holding the value of the node, see gen_code() */
+};
+
+/* a pending operator, group or function call on the parser's stack */
+typedef struct
 {
-	if(G_pb_token.type)
-		return 1; /* push back token is already full */
-	G_pb_token = tok;
-	return 0;
-}
+	char type; /* + - * / \ ^ u, '(' for a group or 'f' for a call */
+	int base; /* operands below the first argument, if 'f' */
+	VarFn *vf; /* function table entry, if 'f' */
+} ParseOp;
 
-static double eval_expr(const char *buf, int *pos); /* expr = term+expr | term-expr | term */
-static double eval_term(const char *buf, int *pos); /* term = fact*term | fact/term | fact%term | fact */
-static double eval_fact(const char *buf, int *pos); /* fact = item^fact | item */
-static double eval_item(const char *buf, int *pos); /* item = -item | +item | int | var | fn(args) | (expr) */
-static int eval_args(const char *buf, int *pos, int *args, double **arg,
-	int *arglen, int argpos); /* args = expr | expr,args */
+/* the state of the parser, operands (finished subtrees) and operators
+** waiting for their operands, on stacks that grow as needed */
+typedef struct
+{
+	ExprNode **val; /* operand stack */
+	int nval, maxval;
+	ParseOp *op; /* operator stack */
+	int nop, maxop;
+	ExprNode *first, *last; /* the nodes made so far, in order */
+} Parser;
 
-static double eval_expr(const char *buf, int *pos) /* expr = term+expr | term-expr | term */
+/* allocate a new (lalloc()'d) tree node with the given operands, returns
+** NULL without allocating if an error is pending or an operand is missing */
+static ExprNode *new_node(eval_ctx *ctx, Parser *p, char type, ExprNode *lhs,
+	ExprNode *rhs)
 {
-	double rv = 0.0, lhs, rhs;
-	Token tok;
+	ExprNode *n;
 	
-	DB(printf("-- eval_expr(\"%s\", &pos=%p pos=%d)\n", buf+*pos, pos, *pos));
-	lhs = eval_term(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- expr lhs=%f\n", lhs));
-	tok = pull_token(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- expr token type '%c' = ", tok.type));
-	switch(tok.type)
+	if(ctx->error)
+		return NULL;
+	if((type == 'u' || type == '%') && lhs == NULL)
+		return NULL;
+	if(strchr("+-*/\\^", type) && (lhs == NULL || rhs == NULL))
+		return NULL;
+	n = (ExprNode*)lalloc(&ctx->arena, sizeof(ExprNode));
+	if(n == NULL)
 	{
-	case '\0':
-		DB(printf("END OF BUFFER\n"));
-		rv = lhs;
-		break;
-	case '+': /* addition */
-		rhs = eval_expr(buf, pos);
-		DB(printf("%f+%f", lhs, rhs));
-		rv = lhs+rhs;
-		DB(printf("=%f\n", rv));
-		break;
-	case '-': /* subtraction */
-		rhs = eval_expr(buf, pos);
-		DB(printf("%f-%f", lhs, rhs));
-		rv = lhs-rhs;
-		DB(printf("=%f\n", rv));
-		break;
-	case ')': /* end of group */
-		DB(printf("end group"));
-		push_token(tok);
-		rv = lhs;
-		DB(printf(" (rv=%f)\n", rv));
-		break;
-	case ',': /* argument delimiter */
-		DB(printf("delimiter"));
-		push_token(tok);
-		rv = lhs;
-		DB(printf(" (rv=%f)\n", rv));
-		break;
-	default:
-		DB(printf("invalid expr token\n"));
-		G_eval_error = EVAL_SYNTAX_ERROR;
-		rv = lhs;
+		ctx->error = EVAL_MEM_ERROR;
+		return NULL;
 	}
+	n->type = type;
+	n->value = 0.0;
+	n->vf = NULL;
+	n->fn = NULL;
+	n->data = NULL;
+	n->nargs = 0;
+	n->lhs = lhs;
+	n->rhs = rhs;
+	n->arg = NULL;
+	n->next = NULL;
+	n->reg = 0;
+	if(p->last != NULL)
+		p->last->next = n;
+	else
+		p->first = n;
+	p->last = n;
 	
-	DB(printf("-- expr rv=%f\n", rv));
-	return rv;
+	return n;
 }
 
-static double eval_term(const char *buf, int *pos) /* term = fact*term | fact/term | fact */
+/* push a node onto the operand stack, returns non-zero on error */
+static int push_val(eval_ctx *ctx, Parser *p, ExprNode *n)
 {
-	double rv = 0.0, lhs, rhs;
-	Token tok;
+	ExprNode **tmp;
 	
-	DB(printf("-- eval_term(\"%s\", &pos=%p pos=%d)\n", buf+*pos, pos, *pos));
-	lhs = eval_fact(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- term lhs=%f\n", lhs));
-	tok = pull_token(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- term token type '%c' = ", tok.type));
-	switch(tok.type)
-	{
-	case '\0':
-		DB(printf("END OF BUFFER\n"));
-		rv = lhs;
-		break;
-	case '*': /* multiplication */
-		rhs = eval_term(buf, pos);
-		DB(printf("%f*%f", lhs, rhs));
-		rv = lhs*rhs;
-		DB(printf("=%f\n", rv));
-		break;
-	case '/': /* division */
-		rhs = eval_term(buf, pos);
-		DB(printf("%f/%f", lhs, rhs));
-		if(rhs == 0.0)
-		{
-			DB(printf(" DIVISION BY ZERO\n"));
-			G_eval_error = EVAL_DIVIDE_BY_ZERO;
-		}else
+	if(n == NULL)
+		return 1; /* new_node() failed, error already set */
+	if(p->nval >= p->maxval)
+	{ /* the old stack gets auto-freed later */
+		tmp = (ExprNode**)lalloc(&ctx->arena, sizeof(ExprNode*)*p->maxval*2);
+		if(tmp == NULL)
 		{
-			rv = lhs/rhs;
-			DB(printf("=%f\n", rv));
+			ctx->error = EVAL_MEM_ERROR;
+			return 2;
 		}
-		break;
-	case '\\': /* modulo division */
-		rhs = eval_term(buf, pos);
-		DB(printf("%f%%%f", lhs, rhs));
-		if(rhs == 0.0)
-		{
-			DB(printf(" DIVISION BY ZERO\n"));
-			G_eval_error = EVAL_DIVIDE_BY_ZERO;
-		}else
+		memcpy(tmp, p->val, sizeof(ExprNode*)*p->nval);
+		p->val = tmp;
+		p->maxval *= 2;
+	}
+	p->val[p->nval++] = n;
+	
+	return 0;
+}
+
+/* push an operator onto the operator stack, returns non-zero on error */
+static int push_op(eval_ctx *ctx, Parser *p, char type, VarFn *vf)
+{
+	ParseOp *tmp;
+	
+	if(p->nop >= p->maxop)
+	{
+		tmp = (ParseOp*)lalloc(&ctx->arena, sizeof(ParseOp)*p->maxop*2);
+		if(tmp == NULL)
 		{
-			rv = fmod(lhs, rhs);
-			DB(printf("=%f\n", rv));
+			ctx->error = EVAL_MEM_ERROR;
+			return 1;
 		}
-		break;
-	default:
-		DB(printf("PUSHBACK\n"));
-		push_token(tok);
-		rv = lhs;
+		memcpy(tmp, p->op, sizeof(ParseOp)*p->nop);
+		p->op = tmp;
+		p->maxop *= 2;
 	}
+	p->op[p->nop].type = type;
+	p->op[p->nop].base = p->nval;
+	p->op[p->nop].vf = vf;
+	p->nop++;
 	
-	DB(printf("-- term rv=%f\n", rv));
-	return rv;
+	return 0;
 }
 
-static double eval_fact(const char *buf, int *pos) /* fact = item^fact | item */
+/* precedence of an operator, groups and calls are never reduced by an
+** operator. A sign change applies to everything up to the next operator
+** other than exponent, so -x^2 is -(x^2) but -x*2 is (-x)*2 */
+static int op_prec(char type)
 {
-	double rv = 0.0, lhs, rhs;
-	Token tok;
-	
-	DB(printf("-- eval_fact(\"%s\", &pos=%p pos=%d)\n", buf+*pos, pos, *pos));
-	lhs = eval_item(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- fact lhs=%f\n", lhs));
-	tok = pull_token(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- fact token type '%c' = ", tok.type));
-	switch(tok.type)
+	switch(type)
 	{
-	case '\0':
-		DB(printf("END OF BUFFER\n"));
-		rv = lhs;
-		break;
-	case '^': /* exponentiation */
-		rhs = eval_fact(buf, pos);
-		DB(printf("%f^%f", lhs, rhs));
-		if(G_eval_error)
-			return rv;
-		rv = pow(lhs, rhs);
-		DB(printf("=%f\n", rv));
-		break;
-	default:
-		DB(printf("PUSHBACK\n"));
-		push_token(tok);
-		rv = lhs;
+	case '+':
+	case '-':
+		return 1;
+	case '*':
+	case '/':
+	case '\\':
+		return 2;
+	case 'u':
+		return 3;
+	case '^':
+		return 4;
 	}
+	return 0;
+}
+
+/* pop the top operator and replace its operands with a new node */
+static int reduce_op(eval_ctx *ctx, Parser *p)
+{
+	ExprNode *lhs, *rhs = NULL;
+	char type;
 	
-	DB(printf("-- fact rv=%f\n", rv));
-	return rv;
+	type = p->op[--p->nop].type;
+	if(type != 'u')
+		rhs = p->val[--p->nval];
+	lhs = p->val[--p->nval];
+	DB(printf("-- reduce '%c'\n", type));
+	
+	return push_val(ctx, p, new_node(ctx, p, type, lhs, rhs));
 }
 
-static double eval_item(const char *buf, int *pos) /* item = -item | +item | int | var | (expr) */
+/* replace the arguments of the function call on top of the operator stack
+** with a call node */
+static int reduce_call(eval_ctx *ctx, Parser *p)
 {
-	double rv = 0.0;
-	void *data;
-	int tlen, nargs, xargs;
-	DB(int i);
-	FunctionPtr fn;
-	DB(char *fname);
-	Token tok;
+	ExprNode *n;
+	VarFn *vf;
+	int i, nargs;
 	
-	DB(printf("-- eval_item(\"%s\", &pos=%p pos=%d)\n", buf+*pos, pos, *pos));
-	tok = pull_token(buf, pos);
-	if(G_eval_error)
-		return rv;
-	DB(printf("-- item token type '%c' = ", tok.type));
-	switch(tok.type)
+	p->nop--;
+	vf = p->op[p->nop].vf;
+	nargs = p->nval-p->op[p->nop].base;
+	DB(printf("-- call %d arguments\n", nargs));
+	if(vf->nargs < 0 ? nargs < 1 : nargs != vf->nargs)
 	{
-	case '+': /* positive */
-		DB(printf("positive\n"));
-		rv = eval_fact(buf, pos);
-		break;
-	case '-': /* negative */
-		DB(printf("negative\n"));
-		rv = -eval_fact(buf, pos);
-		break;
-	case 'v': /* variable */
-		DB(printf("variable name '%s'=%f\n", tok.str, tok.value));
-		rv = tok.value;
-		break;
-	case 'f': /* function */
-		DB(printf("function name '%s'=%p(%d)\n", tok.str, tok.fn, tok.args));
-		tlen = tok.args;
-		nargs = tok.args;
-		xargs = nargs;
-		data = tok.data;
-		fn = tok.fn;
-		DB(fname = tok.str);
-		tok = pull_token(buf, pos);
-		if(G_eval_error == 0)
-		{
-			if(tok.type != '(')
-				G_eval_error = EVAL_SYNTAX_ERROR;
-			else
-			{
-				double *targ = NULL;
-				
-				if(tlen > 0)
-				{
-					targ = (double*)lalloc(sizeof(double)*tlen);
-					if(targ == NULL)
-					{
-						G_eval_error = EVAL_MEM_ERROR;
-						break;
-					}
-				}else
-					tlen = 0;
-				if(eval_args(buf, pos, &nargs, &targ, &tlen, 0))
-					break;
-				DB(printf("-- item %d arguments\n", nargs));
-				if(xargs < 0)
-				{
-					if(nargs < 1)
-					{
-						DB(printf("-- item too few arguments\n"));
-						G_eval_error = EVAL_ARGS_ERROR;
-						break;
-					}
-				}else if(nargs != xargs)
-				{
-					DB(printf("-- item bad argument count (%d) need %d\n",
-						nargs, xargs));
-					G_eval_error = EVAL_ARGS_ERROR;
-					break;
-				}
-				tok = pull_token(buf, pos);
-				if(tok.type != ')')
-					G_eval_error = EVAL_SYNTAX_ERROR;
-				else if(G_eval_error == 0)
-				{
-					DB(printf("-- call function [%p] with %d args [%p]\n",
-						fn, nargs, targ));
-					DB(printf("-- %s(%f", fname, targ[0]));
-					DB(for(i=1;i<nargs;i++)printf(",%f",targ[i]));
-					DB(printf(")\n"));
-					if(fn(nargs, targ, &rv, data) != 0)
-						G_eval_error = EVAL_FUNCTION_ERROR;
-					DB(printf("-- rv = %f\n", rv));
-				}
-			}
-		}
-		break;
-	case 'n': /* number */
-		DB(printf("number value '%s'=%f\n", tok.str, tok.value));
-		rv = tok.value;
-		break;
-	case '(':
-		DB(printf("start grouping\n"));
-		rv = eval_expr(buf, pos);
-		tok = pull_token(buf, pos);
-		if(tok.type != ')')
-			G_eval_error = EVAL_SYNTAX_ERROR;
-		break;
-	default:
-		DB(printf("PUSHBACK\n"));
-		push_token(tok);
+		DB(printf("-- bad argument count (%d) need %d\n", nargs, vf->nargs));
+		ctx->error = EVAL_ARGS_ERROR;
+		return 1;
 	}
-	
-	tok = pull_token(buf, pos);
-	while(tok.type == '%')
+	n = new_node(ctx, p, 'f', NULL, NULL);
+	if(n == NULL)
+		return 2;
+	n->vf = vf;
+	n->fn = vf->fn;
+	n->data = vf->data;
+	n->nargs = nargs;
+	if(nargs > 0)
 	{
-		rv = rv/100.0;
-		tok = pull_token(buf, pos);
+		n->arg = (ExprNode**)lalloc(&ctx->arena, sizeof(ExprNode*)*nargs);
+		if(n->arg == NULL)
+		{
+			ctx->error = EVAL_MEM_ERROR;
+			return 3;
+		}
+		for(i = 0; i < nargs; i++)
+			n->arg[i] = p->val[p->op[p->nop].base+i];
 	}
-	if(tok.type != '\0')
-		push_token(tok);
+	p->nval -= nargs;
 	
-	DB(printf("-- item rv=%f\n", rv));
-	return rv;
+	return push_val(ctx, p, n);
 }
 
-static int eval_args(const char *buf, int *pos, int *args, double **arg,
-	int *arglen, int argpos) /* args = expr,args | expr | */
+/* parse an expression into a tree, returns the root of the tree and sets
+** *list to the first node made. The parser works through the tokens with
+** explicit stacks rather than recursion, so it uses the same C stack for
+** any expression (shunting yard, see op_prec() for the precedences)
+**
+**    expr = expr+expr | expr-expr | expr*expr | expr/expr | expr\expr
+**         | expr^expr | -expr | +expr | expr% | num | var | fn(args)
+**         | (expr)
+**    args = expr,args | expr |
+**
+** ^ is right associative, the other binary operators left associative.
+** A missing operand is treated as zero. The expression ends at the end
+** of the string, or at a ) or , that doesn't belong to a group or call */
+static ExprNode *parse_expr(eval_ctx *ctx, const char *buf, ExprNode **list)
 {
-	double *tmp;
+	ExprNode *vals[16];
+	ParseOp ops[16];
+	Parser p;
 	Token tok;
-	int i;
+	int pos = 0, operand = 1, arg = 0, prec;
 	
-	DB(printf("-- eval_args(\"%s\", &pos=%p pos=%d, args=%p ,arg=%p, alen=%d apos=%d)\n",
-		buf+*pos, pos, *pos, args, arg, *arglen, argpos));
-	tok = pull_token(buf, pos);
-	push_token(tok);
-	if(tok.type == ')')
+	DB(printf("-- parse_expr(\"%s\")\n", buf));
+	p.val = vals;
+	p.nval = 0;
+	p.maxval = sizeof(vals)/sizeof(vals[0]);
+	p.op = ops;
+	p.nop = 0;
+	p.maxop = sizeof(ops)/sizeof(ops[0]);
+	p.first = NULL;
+	p.last = NULL;
+	*list = NULL;
+	if(ctx->stats != NULL)
+		ctx->stats->parses++;
+	for(;;)
 	{
-		push_token(tok);
-		return 0; /* allow empty argument lists */
-	}
-	*args = argpos+1;
-	
-	if(argpos >= *arglen) /* if arg array is full, grow it */
-	{
-		DB(printf("-- realloc arglist (%d elements)\n", (*arglen)+8));
-		tmp = (double*)lalloc(sizeof(double)*((*arglen)+8));
-		if(tmp == NULL)
-		{
-			G_eval_error = EVAL_MEM_ERROR;
-			DB(printf("-- args memory alloc error\n"));
-			return 1;
+		tok = pull_token(ctx, buf, &pos);
+		if(ctx->error)
+			return NULL;
+		DB(printf("-- token '%c' (%.*s) %s\n", tok.type, tok.len,
+			buf+tok.start, operand ? "operand" : "operator"));
+		if(operand)
+		{ /* expecting an operand */
+			if(arg && tok.type == ')')
+			{ /* empty argument list, or nothing after the last , */
+				if(reduce_call(ctx, &p))
+					return NULL;
+				operand = arg = 0;
+				continue;
+			}
+			arg = 0;
+			switch(tok.type)
+			{
+			case '+': /* positive, changes nothing */
+				continue;
+			case '-': /* negative */
+				if(push_op(ctx, &p, 'u', NULL))
+					return NULL;
+				continue;
+			case '(': /* start grouping */
+				if(push_op(ctx, &p, '(', NULL))
+					return NULL;
+				continue;
+			case 'f': /* function, must be followed by arguments */
+				if(pull_token(ctx, buf, &pos).type != '(')
+					ctx->error = EVAL_SYNTAX_ERROR;
+				if(ctx->error || push_op(ctx, &p, 'f', tok.vf))
+					return NULL;
+				arg = 1;
+				continue;
+			case 'n': /* number */
+				if(push_val(ctx, &p, new_node(ctx, &p, 'n', NULL, NULL)))
+					return NULL;
+				p.last->value = tok.value;
+				operand = 0;
+				continue;
+			case 'v': /* variable */
+				if(push_val(ctx, &p, new_node(ctx, &p, 'v', NULL, NULL)))
+					return NULL;
+				p.last->vf = tok.vf;
+				operand = 0;
+				continue;
+			}
+			/* missing operand, treated as zero, then look at the token again
+			** as an operator */
+			if(push_val(ctx, &p, new_node(ctx, &p, 'n', NULL, NULL)))
+				return NULL;
+			operand = 0;
 		}
-		DB(if(*arglen>0)printf("-- copy %d arguments to new list\n", *arglen));
-		for(i = 0; i < *arglen; i++)
+		/* expecting an operator */
+		switch(tok.type)
 		{
-			DB(printf("-- %d: %f -> ", i+1, (*arg)[i]));
-			tmp[i] = (*arg)[i]; /* copy arg array to tmp array */
-			DB(printf("%f\n", tmp[i]));
+		case '%': /* percentage of the last operand */
+			if(push_val(ctx, &p, new_node(ctx, &p, '%', p.val[--p.nval], NULL)))
+				return NULL;
+			break;
+		case '+':
+		case '-':
+		case '*':
+		case '/':
+		case '\\':
+		case '^':
+			prec = op_prec(tok.type);
+			if(tok.type == '^')
+				prec++; /* right associative */
+			while(p.nop > 0 && op_prec(p.op[p.nop-1].type) >= prec)
+				if(reduce_op(ctx, &p))
+					return NULL;
+			if(push_op(ctx, &p, tok.type, NULL))
+				return NULL;
+			operand = 1;
+			break;
+		case ')': /* end of group or call */
+		case ',': /* argument delimiter */
+		case '\0': /* end of buffer */
+			while(p.nop > 0 && op_prec(p.op[p.nop-1].type) > 0)
+				if(reduce_op(ctx, &p))
+					return NULL;
+			if(p.nop == 0)
+			{ /* end of the expression */
+				*list = p.first;
+				return p.val[0];
+			}
+			if(tok.type == '\0' || (tok.type == ',' && p.op[p.nop-1].type == '('))
+			{ /* unclosed group or call, or a , in a group */
+				ctx->error = EVAL_SYNTAX_ERROR;
+				return NULL;
+			}
+			if(tok.type == ',')
+				operand = arg = 1; /* the argument stays on the operand stack */
+			else if(p.op[p.nop-1].type == '(')
+				p.nop--; /* the group's value is on the operand stack */
+			else if(reduce_call(ctx, &p))
+				return NULL;
+			break;
+		default: /* an operand after an operand */
+			DB(printf("-- invalid operator token\n"));
+			ctx->error = EVAL_SYNTAX_ERROR;
+			return NULL;
 		}
-		*arg = tmp; /* replace arg with tmp (memory will get auto-freed later */
-		*arglen = (*arglen)+8; /* update arglen to length of tmp */
-	}
-	(*arg)[argpos] = eval_expr(buf, pos);
-	DB(printf("-- arg #%d = %f\n", argpos+1, (*arg)[argpos]));
-	if(G_eval_error)
-	{
-		DB(printf("-- args eval_expr error\n"));
-		return 2;
 	}
-	tok = pull_token(buf, pos);
-	DB(printf("-- args token '%c' = ", tok.type));
-	switch(tok.type)
+}
+
+/* compute the value of an operator node whose operands are all numeric
+** literals, exactly as the compiled code would. Returns 0 (zero) if the
+** operation fails, and must be left to fail when the code is run */
+static int fold_op(ExprNode *n, double *rv)
+{
+	double lhs, rhs = 0.0;
+	
+	lhs = n->lhs->value;
+	if(n->rhs != NULL)
+		rhs = n->rhs->value;
+	switch(n->type)
 	{
-	case ',':
-		DB(printf("comma\n"));
-		if(eval_args(buf, pos, args, arg, arglen, argpos+1))
-			return 3;
+	case 'u':
+		*rv = -lhs;
 		break;
-	case ')':
-		DB(printf("end args (pushback)\n"));
-		push_token(tok);
+	case '%':
+		*rv = lhs/100.0;
+		break;
+	case '+':
+		*rv = lhs+rhs;
+		break;
+	case '-':
+		*rv = lhs-rhs;
+		break;
+	case '*':
+		*rv = lhs*rhs;
+		break;
+	case '/':
+		if(rhs == 0.0)
+			return 0;
+		*rv = lhs/rhs;
+		break;
+	case '\\':
+		if(rhs == 0.0)
+			return 0;
+		*rv = fmod(lhs, rhs);
+		break;
+	case '^':
+		*rv = pow(lhs, rhs);
 		break;
 	default:
-		DB(printf("PUSHBACK/SYNTAX ERROR\n"));
-		G_eval_error = EVAL_SYNTAX_ERROR;
-		return 4;
+		return 0;
 	}
 	
-	DB(printf("-- args return NO ERROR\n"));
-	return 0;
+	return 1;
 }
 
-/* public: expression evaluation function */
-int eval(const char *expr, double *result)
+/* fold the subtrees of an expression tree that depend only on numeric
+** literals, constants and pure functions into numeric literal nodes. The
+** nodes are folded in the order the parser made them, so the operands of
+** a node have already been folded when the node is reached */
+static void fold_nodes(eval_ctx *ctx, ExprNode *list)
 {
-	double rv = 0.0;
-	int pos = 0;
-	static int recurse = 0;
+	double *argv, rv;
+	ExprNode *n;
+	int i;
 	
-	recurse++;
+	for(n = list; n != NULL; n = n->next)
+	{
+		rv = 0.0;
+		switch(n->type)
+		{
+		case '\0':
+		case 'n':
+			continue;
+		case 'v': /* the table may be shared, see set_var() */
+			if(!(__atomic_load_n(&n->vf->flags, __ATOMIC_RELAXED) & VARFN_CONST))
+				continue;
+			__atomic_load(&n->vf->value, &rv, __ATOMIC_RELAXED);
+			break;
+		case 'f':
+			if(!(n->vf->flags & VARFN_PURE))
+				continue;
+			for(i = 0; i < n->nargs && n->arg[i]->type == 'n'; i++)
+				;
+			if(i < n->nargs)
+				continue;
+			/* functions may modify their arguments, so pass a copy */
+			argv = (double*)lalloc(&ctx->arena, sizeof(double)*(n->nargs+1));
+			if(argv == NULL)
+				continue;
+			for(i = 0; i < n->nargs; i++)
+				argv[i] = n->arg[i]->value;
+			if(n->fn(n->nargs, argv, &rv, n->data) != 0)
+				continue;
+			for(i = 0; i < n->nargs; i++)
+				n->arg[i]->type = '\0';
+			break;
+		default:
+			if(n->lhs->type != 'n' || (n->rhs != NULL && n->rhs->type != 'n'))
+				continue;
+			if(!fold_op(n, &rv))
+				continue;
+			n->lhs->type = '\0';
+			if(n->rhs != NULL)
+				n->rhs->type = '\0';
+		}
+		DB(printf("-- fold '%c' node to %f\n", n->type, rv));
+		n->type = 'n';
+		n->value = rv;
+		n->lhs = NULL;
+		n->rhs = NULL;
+		n->nargs = 0;
+		n->arg = NULL;
+	}
 	
-	if(expr == NULL)
-		return EVAL_NULL_EXPRESSION;
-	G_eval_error = 0;
-	G_pb_token.type = '\0';
-	G_pb_token.str = NULL;
-	G_pb_token.value = 0.0;
-	G_pb_token.args = 0;
-	G_pb_token.fn = NULL;
-	G_pb_token.data = NULL;
-	G_pb_token.buf[0] = '\0';
-	G_pb_token.buf[1] = '\0';
-	rv = eval_expr(expr, &pos);
-	recurse--;
-	if(recurse == 0)
-		lfreeall();
-	if(G_eval_error)
-		return G_eval_error;
-	if(result != NULL)
-		*result = rv;
-	return 0;
+	return;
 }
 
-/* return information about the expression evaluator, copyright, author, etc. */
-void eval_info(int *version, int *revision, int *buildno,
-	char *authbuf, int authlim, char *copybuf, int copylim,
-	char *licebuf, int licelim)
+/* sizes of the code and data generated for an expression tree */
+typedef struct
 {
-	if(version)
-		*version = G_version;
-	if(revision)
-		*revision = G_revision;
-	if(buildno)
-		*buildno = G_buildno;
-	if(authbuf)
-		strncpy(authbuf, G_author+16, authlim);
-	if(copybuf)
-		strncpy(copybuf, G_copyright+8, copylim);
-	if(licebuf)
-		strncpy(licebuf, G_license+17, licelim);
-	return;
-}
+	int nodes, consts, vars, calls, args, maxargs, folded;
+} CodeSize;
 
-/* public: return a string describing the specified error code */
-const char *eval_error(int err)
+/* count the nodes, constants, variables, calls and call arguments of an
+** expression tree */
+static void size_code(ExprNode *list, CodeSize *sz)
 {
-	if(err < MIN_ERR_VALUE || err > MAX_ERR_VALUE)
-		return "Unknown Error Value";
-	return G_eval_err_str[err];
+	ExprNode *n;
+	
+	for(n = list; n != NULL; n = n->next)
+	{
+		if(n->vf != NULL && (n->type == 'n' || n->type == '\0'))
+			sz->folded++; /* a constant or pure function, folded away */
+		if(n->type == '\0')
+			continue;
+		sz->nodes++;
+		if(n->type == 'n')
+			sz->consts++;
+		else if(n->type == 'v')
+			sz->vars++;
+		else if(n->type == 'f')
+		{
+			sz->calls++;
+			sz->args += n->nargs;
+			if(n->nargs > sz->maxargs)
+				sz->maxargs = n->nargs;
+		}
+	}
+	
+	return;
 }
 
-#ifdef EVAL_TEST
+/* the variables and functions an expression uses, each once. The table
+** entries may be shared with other threads (see eval_ctx_create_shared()),
+** so nothing is written to them while compiling, the entries are kept in
+** a little open addressing set allocated along with the tree instead */
+typedef struct
+{
+	VarFn *vf;
+	int slot; /* variable slot, see gen_code() */
+} Use;
 
-#include <stdio.h>
+typedef struct
+{
+	Use *use;
+	unsigned long mask; /* entries-1, a power of 2 less one */
+	int count;
+} UseSet;
 
-static int iter(unsigned long slot, const void *key, void *val)
+/* make an empty set with room for every name in the list, returns non-zero
+** on failure */
+static int use_init(eval_ctx *ctx, UseSet *u, ExprNode *list)
 {
-	VarFn *vf;
+	ExprNode *n;
+	unsigned long size = 8;
+	int names = 0;
 	
-	(void)slot;
-	(void)key;
-	
-	vf = (VarFn*)val;
-	
-	if(vf == NULL)
-		printf("\tNULL pointer!\n");
-	else if(vf->fn == NULL)
-		printf("\t%s = %f\n", vf->name, vf->value);
+	for(n = list; n != NULL; n = n->next)
+		if(n->vf != NULL)
+			names++;
+	while(size < (unsigned long)names*2)
+		size *= 2;
+	u->use = (Use*)lalloc(&ctx->arena, sizeof(Use)*size);
+	if(u->use == NULL)
+	{
+		ctx->error = EVAL_MEM_ERROR;
+		return 1;
+	}
+	memset(u->use, 0, sizeof(Use)*size);
+	u->mask = size-1;
+	u->count = 0;
 	
 	return 0;
 }
 
-int main(int args, char *arg[])
+/* find or add a table entry, *added is set non-zero if it was added */
+static Use *use_add(UseSet *u, VarFn *vf, int *added)
 {
-	char buf[1001], *p;
-	int err;
-	double rv;
-	char* ret;
+	unsigned long i;
 	
-	(void)args;
-	(void)arg;
+	i = ((unsigned long)(size_t)vf/sizeof(double)*2654435761UL)&u->mask;
+	while(u->use[i].vf != NULL && u->use[i].vf != vf)
+		i = (i+1)&u->mask;
+	*added = u->use[i].vf == NULL;
+	if(*added)
+	{
+		u->use[i].vf = vf;
+		u->count++;
+	}
 	
-	eval_set_default_env();
+	return u->use+i;
+}
+
+/* node types in opcode order, so that an opcode is the index of its type */
+static const char *G_op_types = "v+-*/\\^u%f";
+
+/* generate code for an expression tree, operands before operators, and
+** return the register holding the value of the tree (the last node) */
+static int gen_code(UseSet *vars, eval_compiled *ce, ExprNode *list,
+	int *kpos, int **argp)
+{
+	ExprNode *n;
+	Instr *ip;
+	Call *c;
+	Use *u;
+	int a, b, i, r = 0, added;
 	
-	do
+	for(n = list; n != NULL; n = n->next)
 	{
-		printf("\n> ");
-		fflush(stdout);
-		buf[0] = '\0';
-		ret = fgets(buf, 1000, stdin);
-		if(feof(stdin) || ferror(stdin) || ret == NULL)
+		a = b = 0;
+		switch(n->type)
+		{
+		case '\0':
+			continue;
+		case 'n': /* constants are loaded into the register file now */
+			ce->reg[*kpos] = n->value;
+			r = n->reg = (*kpos)++;
+			continue;
+		case 'v': /* variables are loaded through a slot pointing at the value */
+			u = use_add(vars, n->vf, &added);
+			if(added)
+			{ /* first use of this variable, give it a slot */
+				u->slot = ce->nvars;
+				ce->slot[ce->nvars].name = n->vf->sym->str;
+				ce->slot[ce->nvars].home = &(n->vf->value);
+				ce->var[ce->nvars++] = &(n->vf->value);
+			}
+			a = u->slot;
 			break;
-		if(buf[strlen(buf)-1] == '\n')
-			buf[strlen(buf)-1] = '\0';
-		if(strcasecmp(buf, "QUIT") == 0
-		|| strcasecmp(buf, "EXIT") == 0
-		|| strcasecmp(buf, "DONE") == 0)
+		case 'f':
+			c = ce->call+ce->ncalls;
+			a = ce->ncalls++;
+			c->fn = n->fn;
+			c->vfn = n->vf->vfn;
+			c->data = n->data;
+			c->pure = (n->vf->flags & VARFN_PURE) != 0;
+			c->nargs = n->nargs;
+			c->name = n->vf->sym->str;
+			c->arg = *argp;
+			(*argp) += n->nargs;
+			for(i = 0; i < n->nargs; i++)
+				c->arg[i] = n->arg[i]->reg;
 			break;
-		if(strcasecmp(buf, "HELP") == 0)
-		{ /* show help text */
-			printf("\texpr            eval expr and print result\n");
-			printf("\tname=expr       eval expr and assign to named var\n");
-			printf("\tname?           print value of named var\n");
-			printf("\t?name           same as 'name?'\n");
-			printf("\t?               list all named vars and their values\n");
-			printf("\tQUIT/EXIT/DONE  end the program\n");
-			printf("\n\toperators: + - * / %% ^ ()\n");
-		}else if((p = strchr(buf, '=')))
-		{ /* assign a value to a variable */
-			char *name, *expr;
-			
-			name = buf;
-			*p = '\0';
-			expr = p+1;
-			err = eval(expr, &rv);
-			if(err)
-				printf("eval error #%d: %s\n", err, eval_error(err));
-			else
-			{
-				printf("%s = %f", name, rv);
-				if(eval_set_var(name, rv))
-					printf(" - failed to set variable");
-				printf("\n");
-			}
-		}else if((p = strchr(buf, '?')))
-		{ /* print variable values */
-			char *name;
-			
-			if(buf[0] == '?')
-				name = buf+1;
-			else
-				name = buf;
-			*p = '\0';
-			if(G_var_count == 0)
-				printf("no variables defined\n");
-			else
-			{
-				if(name[0] == '\0')
-				{ /* print all variables */
-					if(ht_iterate(G_varfn_table, iter, NULL))
-						printf("error while iterating over var table\n");
-				}else
-				{ /* print named variable */
-					printf("%s = ", name);
-					if(eval_get_var(name, &rv))
-						printf(" - failed to get variable '%s'", name);
-					else
-						printf("%f", rv);
-					printf("\n");
-				}
-			}
-		}else
-		{ /* evaluate an expression and print result */
-			err = eval(buf, &rv);
-			if(err)
-				printf("eval error #%d: %s\n", err, eval_error(err));
-			else
-				printf("= %f\n", rv);
+		default:
+			a = n->lhs->reg;
+			if(n->rhs != NULL)
+				b = n->rhs->reg;
 		}
-	}while(!feof(stdin) && !ferror(stdin));
+		ip = ce->code+ce->ninstr;
+		ip->op = strchr(G_op_types, n->type)-G_op_types;
+		ip->dst = INSTR_REG(ce, ce->ninstr);
+		ip->a = a;
+		ip->b = b;
+		DB(printf("-- %4d: op %d r%d = %d, %d\n", ce->ninstr, ip->op, ip->dst, a, b));
+		r = n->reg = INSTR_REG(ce, ce->ninstr++);
+	}
 	
-	printf("\nprogram done.\n");
+	return r;
+}
+
+/* the size of a compiled expression block */
+static size_t code_size(int nregs, int ninstr, int nvars, int nfolded,
+	int ncalls, int maxargs, int nargs)
+{
+	return sizeof(eval_compiled)
+		+sizeof(double)*(nregs+maxargs)
+		+(sizeof(double*)+sizeof(VarSlot))*nvars
+		+sizeof(Folded)*nfolded
+		+sizeof(Call)*ncalls
+		+sizeof(Instr)*ninstr
+		+sizeof(int)*nargs;
+}
+
+/* set up the header of a compiled expression block of the given size */
+static void code_init(eval_compiled *ce, size_t size, int nregs, int nconst,
+	int ninstr, int nvars, int nfolded, int ncalls, int maxargs)
+{
+	ce->tag = COMPILED_TAG;
+	ce->size = size;
+	ce->nregs = nregs;
+	ce->nconst = nconst;
+	ce->ninstr = ninstr;
+	ce->nvars = nvars;
+	ce->ncalls = ncalls;
+	ce->maxargs = maxargs;
+	ce->nfolded = nfolded;
+	ce->native = NULL;
+	ce->native_mem = NULL;
+	ce->native_size = 0;
+	ce->prof = NULL;
+	ce->prof_gen = 0;
+	/* the storage areas follow the header in the same block */
+	ce->reg = (double*)(ce+1);
+	ce->argv = ce->reg+nregs;
+	ce->var = (const double**)(ce->argv+maxargs);
+	ce->slot = (VarSlot*)(ce->var+nvars);
+	ce->folded = (Folded*)(ce->slot+nvars);
+	ce->call = (Call*)(ce->folded+nfolded);
+	ce->code = (Instr*)(ce->call+ncalls);
 	
-	return 0;
+	return;
+}
+
+/* allocate an empty compiled expression, for loading saved ones */
+eval_compiled *code_alloc(int nregs, int nconst, int ninstr, int nvars,
+	int nfolded, int ncalls, int maxargs, int nargs)
+{
+	eval_compiled *ce;
+	size_t size;
+	
+	size = code_size(nregs, ninstr, nvars, nfolded, ncalls, maxargs, nargs);
+	ce = (eval_compiled*)malloc(size);
+	if(ce != NULL)
+		code_init(ce, size, nregs, nconst, ninstr, nvars, nfolded, ncalls,
+			maxargs);
+	
+	return ce;
+}
+
+/* compile an expression tree, given the parser's list of its nodes, into
+** a block allocated with lalloc() if arena is non-zero, or malloc(),
+** returns NULL on failure */
+static eval_compiled *new_code(eval_ctx *ctx, ExprNode *list, int arena)
+{
+	eval_compiled *ce;
+	ExprNode *n;
+	CodeSize sz;
+	UseSet vars;
+	Instr *ip;
+	size_t size;
+	int ninstr, nregs, kpos = 0, *argp, r, i = 0;
+	
+	if(use_init(ctx, &vars, list))
+		return NULL;
+	memset(&sz, 0, sizeof(sz));
+	size_code(list, &sz);
+	ninstr = sz.nodes-sz.consts+1; /* every node but constants, plus return */
+	nregs = sz.consts+ninstr;
+	DB(printf("-- compile %d nodes, %d regs, %d args\n", sz.nodes, nregs, sz.args));
+	size = code_size(nregs, ninstr, sz.vars, sz.folded, sz.calls, sz.maxargs,
+		sz.args);
+	ce = (eval_compiled*)(arena ? lalloc(&ctx->arena, size) : malloc(size));
+	if(ce == NULL)
+	{
+		ctx->error = EVAL_MEM_ERROR;
+		return NULL;
+	}
+	code_init(ce, size, nregs, sz.consts, ninstr, sz.vars, sz.folded, sz.calls,
+		sz.maxargs);
+	ce->ninstr = 0; /* counted again by gen_code() */
+	ce->nvars = 0;
+	ce->ncalls = 0;
+	for(n = list; n != NULL; n = n->next)
+	{ /* the names folded away, once each, see size_code() */
+		if(n->vf == NULL || (n->type != 'n' && n->type != '\0'))
+			continue;
+		for(r = 0; r < i && ce->folded[r].name != n->vf->sym->str; r++)
+			;
+		if(r < i)
+			continue;
+		ce->folded[i].name = n->vf->sym->str;
+		if(n->vf->fn == NULL)
+			ce->folded[i].fn = FOLDED_CONST;
+		else if(func_standard(n->vf->fn))
+			ce->folded[i].fn = FOLDED_STANDARD;
+		else
+			ce->folded[i].fn = FOLDED_USER;
+		ce->folded[i].value = 0.0;
+		if(n->vf->fn == NULL)
+			__atomic_load(&n->vf->value, &ce->folded[i].value, __ATOMIC_RELAXED);
+		i++;
+	}
+	ce->nfolded = i;
+	argp = (int*)(ce->code+ninstr);
+	r = gen_code(&vars, ce, list, &kpos, &argp);
+	ip = ce->code+ce->ninstr;
+	ip->op = OP_RET;
+	ip->dst = INSTR_REG(ce, ce->ninstr);
+	ip->a = r;
+	ip->b = 0;
+	ce->ninstr++;
+	
+	return ce;
+}
+
+/* hash a compiled value (a constant or an instruction) for cse_code() */
+static unsigned long cse_hash(const eval_compiled *ce, const Instr *ip,
+	const double *k, int epoch)
+{
+	unsigned long h;
+	const Call *c;
+	int i;
+	
+	if(k != NULL)
+	{ /* constants are identical when their bits are */
+		memcpy(&h, k, sizeof(h) < sizeof(*k) ? sizeof(h) : sizeof(*k));
+		return h*0x9e3779b1UL;
+	}
+	h = ip->op;
+	switch(ip->op)
+	{
+	case OP_LOADV: /* each variable has one slot */
+		h = h*31+ip->a+epoch;
+		break;
+	case OP_CALL:
+		c = ce->call+ip->a;
+		h = h*31+(unsigned long)c->fn;
+		h = h*31+(unsigned long)c->data;
+		for(i = 0; i < c->nargs; i++)
+			h = h*31+c->arg[i];
+		break;
+	default:
+		h = (h*31+ip->a)*31+ip->b;
+	}
+	
+	return h*0x9e3779b1UL;
+}
+
+/* compare two instructions (with renamed operands) for cse_code() */
+static int cse_same(const eval_compiled *ce, const Instr *i1, const Instr *i2)
+{
+	const Call *c1, *c2;
+	int i;
+	
+	if(i1->op != i2->op)
+		return 0;
+	switch(i1->op)
+	{
+	case OP_CALL:
+		c1 = ce->call+i1->a;
+		c2 = ce->call+i2->a;
+		if(c1->fn != c2->fn || c1->data != c2->data || c1->nargs != c2->nargs)
+			return 0;
+		for(i = 0; i < c1->nargs; i++)
+			if(c1->arg[i] != c2->arg[i])
+				return 0;
+		return 1;
+	default:
+		return i1->a == i2->a && i1->b == i2->b;
+	}
+}
+
+/* common subexpression elimination: compute each distinct value once.
+**
+** Identical constants are merged, then the code is scanned in order and
+** every instruction that computes the same operation on the same operands
+** as an earlier one (after renaming the operands) is dropped, and its
+** register is renamed to the earlier result. Variable loads are only
+** merged between calls to impure functions (which might change variables),
+** and impure calls are never merged. The surviving code is compacted so
+** that instruction i still writes register INSTR_REG(ce, i). */
+static void cse_code(eval_compiled *ce)
+{
+	Instr in, *ip;
+	int *map, *table, *born, tsize, i, j, out, epoch = 0;
+	unsigned long h;
+	
+	for(tsize = 16; tsize < 2*ce->nregs; tsize *= 2)
+		;
+	map = (int*)malloc(sizeof(int)*ce->nregs);
+	table = (int*)malloc(sizeof(int)*tsize);
+	born = (int*)malloc(sizeof(int)*ce->ninstr); /* epoch of each survivor */
+	if(map == NULL || table == NULL || born == NULL)
+	{ /* not fatal, the code just isn't optimized */
+		free(map);
+		free(table);
+		free(born);
+		return;
+	}
+	
+	for(i = 0; i < tsize; i++)
+		table[i] = -1;
+	for(i = 0; i < ce->nconst; i++)
+	{ /* merge identical constants */
+		h = cse_hash(ce, NULL, ce->reg+i, 0);
+		for(j = h&(tsize-1); table[j] >= 0; j = (j+1)&(tsize-1))
+			if(memcmp(ce->reg+table[j], ce->reg+i, sizeof(double)) == 0)
+				break;
+		if(table[j] < 0)
+			table[j] = i;
+		map[i] = table[j];
+	}
+	
+	for(i = 0; i < tsize; i++)
+		table[i] = -1;
+	for(i = 0, out = 0; i < ce->ninstr; i++)
+	{
+		in = ce->code[i];
+		if(in.op == OP_CALL)
+		{
+			for(j = 0; j < ce->call[in.a].nargs; j++)
+				ce->call[in.a].arg[j] = map[ce->call[in.a].arg[j]];
+		}else if(in.op != OP_LOADV)
+		{
+			in.a = map[in.a];
+			if(in.op != OP_NEG && in.op != OP_PCT && in.op != OP_RET)
+				in.b = map[in.b];
+		}
+		if(in.op == OP_RET || (in.op == OP_CALL && !ce->call[in.a].pure))
+		{ /* never merged, and impure calls may change variables */
+			if(in.op == OP_CALL)
+				epoch++;
+			j = -1;
+		}else
+		{
+			h = cse_hash(ce, &in, NULL, epoch);
+			for(j = h&(tsize-1); table[j] >= 0; j = (j+1)&(tsize-1))
+				if(cse_same(ce, ce->code+table[j], &in)
+					&& (in.op != OP_LOADV || born[table[j]] == epoch))
+					break; /* a load is only the same in the same epoch */
+			if(table[j] >= 0)
+			{ /* same value as an earlier instruction */
+				DB(printf("-- cse instr %d same as %d\n", i, table[j]));
+				map[in.dst] = INSTR_REG(ce, table[j]);
+				continue;
+			}
+			table[j] = out;
+		}
+		map[in.dst] = INSTR_REG(ce, out);
+		born[out] = epoch;
+		ip = ce->code+out;
+		*ip = in;
+		ip->dst = INSTR_REG(ce, out);
+		out++;
+	}
+	DB(printf("-- cse %d instructions, was %d\n", out, ce->ninstr));
+	ce->ninstr = out;
+	ce->nregs = INSTR_REG(ce, out);
+	
+	free(map);
+	free(table);
+	free(born);
+	
+	return;
+}
+
+/* reset the parser state before parsing a new expression */
+static void parse_reset(eval_ctx *ctx)
+{
+	ctx->error = 0;
+	
+	return;
+}
+
+/* compile a parsed expression into a malloc()'d block, folding constant
+** subexpressions and removing common subexpressions */
+static eval_compiled *compile_list(eval_ctx *ctx, ExprNode *list)
+{
+	eval_compiled *ce;
+	
+	fold_nodes(ctx, list);
+	ce = new_code(ctx, list, 0);
+	if(ce != NULL)
+		cse_code(ce);
+	
+	return ce;
+}
+
+/* bind the names of a loaded compiled expression to a context (see
+** plan.c): the variables to their values, the calls to their functions and
+** the names replaced by interned ones. Returns EVAL_PLAN_STALE if the
+** names folded away, or their purity, have changed since it was compiled.
+** A user's pure function folded away can't be checked (it may have been
+** redefined with the same name), so it always makes the plan stale; a
+** standard function must still be the standard one */
+static int bind_names(eval_ctx *ctx, eval_compiled *ce)
+{
+	VarFn *vf;
+	Call *c;
+	double value;
+	int i, flags;
+	
+	for(i = 0; i < ce->nvars; i++)
+	{
+		vf = find_name(ctx->table, ce->slot[i].name);
+		if(vf == NULL || vf->fn != NULL)
+			return EVAL_UNKNOWN_NAME;
+		if(__atomic_load_n(&vf->flags, __ATOMIC_RELAXED) & VARFN_CONST)
+			return EVAL_PLAN_STALE; /* would be folded now */
+		ce->slot[i].name = vf->sym->str;
+		ce->slot[i].home = &(vf->value);
+		ce->var[i] = &(vf->value);
+	}
+	for(i = 0; i < ce->ncalls; i++)
+	{
+		c = ce->call+i;
+		vf = find_name(ctx->table, c->name);
+		if(vf == NULL || vf->fn == NULL)
+			return EVAL_UNKNOWN_NAME;
+		if(vf->nargs >= 0 && vf->nargs != c->nargs)
+			return EVAL_ARGS_ERROR;
+		if(((vf->flags & VARFN_PURE) != 0) != (c->pure != 0))
+			return EVAL_PLAN_STALE;
+		c->fn = vf->fn;
+		c->vfn = __atomic_load_n(&vf->vfn, __ATOMIC_ACQUIRE);
+		c->data = vf->data;
+		c->name = vf->sym->str;
+	}
+	for(i = 0; i < ce->nfolded; i++)
+	{
+		vf = find_name(ctx->table, ce->folded[i].name);
+		if(vf == NULL || ce->folded[i].fn == FOLDED_USER
+			|| (vf->fn != NULL) != (ce->folded[i].fn == FOLDED_STANDARD))
+			return EVAL_PLAN_STALE;
+		flags = __atomic_load_n(&vf->flags, __ATOMIC_RELAXED);
+		if(vf->fn != NULL && (!(flags & VARFN_PURE)
+			|| vf->fn != func_find_standard(vf->sym->str)))
+			return EVAL_PLAN_STALE;
+		if(vf->fn == NULL)
+		{
+			__atomic_load(&vf->value, &value, __ATOMIC_RELAXED);
+			if(!(flags & VARFN_CONST)
+				|| memcmp(&value, &ce->folded[i].value, sizeof(double)) != 0)
+				return EVAL_PLAN_STALE;
+		}
+		ce->folded[i].name = vf->sym->str;
+	}
+	
+	return 0;
+}
+
+/* bind a loaded compiled expression to a context, returns 0 (zero) or an
+** EVAL_* error code */
+int code_bind(eval_ctx *ctx, eval_compiled *ce)
+{
+	int err;
+	
+	if((ctx = get_ctx(ctx)) == NULL)
+		return EVAL_NULL_EXPRESSION;
+	if(ctx->shared != NULL && ht_read_begin())
+		return EVAL_MEM_ERROR;
+	err = bind_names(ctx, ce);
+	if(ctx->shared != NULL)
+		ht_read_end();
+	
+	return err;
+}
+
+/* hash code of an expression for eval()'s cache (FNV-1a), also returns the
+** length of the expression */
+static unsigned long cache_hash(const char *expr, size_t *len)
+{
+	unsigned long h = FNV_BASIS;
+	size_t i;
+	
+	for(i = 0; expr[i] != '\0'; i++)
+		h = (h ^ (unsigned char)expr[i])*FNV_PRIME;
+	*len = i;
+	
+	return h;
+}
+
+/* remove an entry from the cache and free it, or leave it to be freed by
+** cache_run() if it is running */
+static void cache_drop(eval_ctx *ctx, CacheEntry *e)
+{
+	CacheEntry **p;
+	
+	for(p = ctx->cache.slot+(e->hash & (ctx->cache.nslots-1)); *p != e;
+		p = &(*p)->link)
+		;
+	*p = e->link;
+	if(e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		ctx->cache.head = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		ctx->cache.tail = e->prev;
+	ctx->cache.count--;
+	ctx->cache.bytes -= e->size;
+	if(e->busy)
+		e->stale = 1;
+	else
+	{
+		eval_free(e->ce);
+		free(e);
+	}
+	
+	return;
+}
+
+/* drop the cached expressions that use a variable or function that is
+** being redefined, or all of them if vf is NULL */
+static void cache_forget(eval_ctx *ctx, VarFn *vf)
+{
+	CacheEntry *e, *next;
+	int i;
+	
+	for(e = ctx->cache.head; e != NULL; e = next)
+	{
+		next = e->next;
+		for(i = 0; vf != NULL && i < e->ndeps; i++)
+			if(e->dep[i] == vf)
+				break;
+		if(vf == NULL || i < e->ndeps)
+		{
+			DB(printf("-- cache forget \"%s\"\n", e->text));
+			ctx->cache.invalidations++;
+			cache_drop(ctx, e);
+		}
+	}
+	
+	return;
+}
+
+/* drop the whole cache if another context sharing the table redefined a
+** constant or function since the cache was last checked */
+static void cache_sync(eval_ctx *ctx)
+{
+	unsigned long redefs;
+	
+	redefs = __atomic_load_n(&ctx->shared->redefs, __ATOMIC_ACQUIRE);
+	if(redefs != ctx->redefs)
+	{
+		cache_forget(ctx, NULL);
+		ctx->redefs = redefs;
+	}
+	
+	return;
+}
+
+/* set the most expressions the cache keeps, dropping the least recently
+** used ones and resizing the hash slots to fit, returns non-zero on error */
+static int cache_limit(eval_ctx *ctx, int limit)
+{
+	CacheEntry **slot, *e;
+	unsigned long n;
+	
+	if(limit < 0)
+		return 1;
+	ctx->cache.limit = limit;
+	while(ctx->cache.count > limit)
+	{
+		ctx->cache.evictions++;
+		cache_drop(ctx, ctx->cache.tail);
+	}
+	for(n = 16; limit > 0 && n < (unsigned long)limit*2; n *= 2)
+		;
+	if(limit == 0 || n == ctx->cache.nslots)
+		return 0; /* the slots are allocated by cache_add() */
+	slot = (CacheEntry**)calloc(n, sizeof(CacheEntry*));
+	if(slot == NULL)
+		return 2;
+	for(e = ctx->cache.head; e != NULL; e = e->next)
+	{
+		e->link = slot[e->hash & (n-1)];
+		slot[e->hash & (n-1)] = e;
+	}
+	free(ctx->cache.slot);
+	ctx->cache.slot = slot;
+	ctx->cache.nslots = n;
+	
+	return 0;
+}
+
+/* find an expression in the cache and make it the most recently used,
+** returns NULL if it isn't there */
+static CacheEntry *cache_find(eval_ctx *ctx, const char *expr,
+	unsigned long hash, size_t len)
+{
+	CacheEntry *e;
+	
+	if(ctx->cache.slot == NULL)
+		return NULL;
+	for(e = ctx->cache.slot[hash & (ctx->cache.nslots-1)]; e != NULL; e = e->link)
+		if(e->hash == hash && e->len == len && memcmp(e->text, expr, len) == 0)
+			break;
+	if(e != NULL && e->prev != NULL)
+	{ /* move to the front of the list */
+		e->prev->next = e->next;
+		if(e->next != NULL)
+			e->next->prev = e->prev;
+		else
+			ctx->cache.tail = e->prev;
+		e->prev = NULL;
+		e->next = ctx->cache.head;
+		ctx->cache.head->prev = e;
+		ctx->cache.head = e;
+	}
+	
+	return e;
+}
+
+/* compile a parsed expression and add it to the cache, dropping the least
+** recently used expression if the cache is full, returns NULL on error */
+static CacheEntry *cache_add(eval_ctx *ctx, const char *expr,
+	unsigned long hash, size_t len, ExprNode *list)
+{
+	eval_compiled *ce;
+	CacheEntry *e;
+	ExprNode *n;
+	UseSet deps;
+	size_t off;
+	unsigned long i;
+	int added;
+	
+	if(ctx->cache.slot == NULL && cache_limit(ctx, ctx->cache.limit))
+	{
+		ctx->error = EVAL_MEM_ERROR;
+		return NULL;
+	}
+	ce = compile_list(ctx, list);
+	if(ce == NULL)
+		return NULL;
+	/* collect the variables and functions used, each once, including those
+	** folded away */
+	if(use_init(ctx, &deps, list))
+	{
+		eval_free(ce);
+		return NULL;
+	}
+	for(n = list; n != NULL; n = n->next)
+		if(n->vf != NULL)
+			use_add(&deps, n->vf, &added);
+	off = (sizeof(CacheEntry)+len+sizeof(VarFn*)-1)/sizeof(VarFn*)*sizeof(VarFn*);
+	e = (CacheEntry*)malloc(off+sizeof(VarFn*)*deps.count);
+	if(e == NULL)
+	{
+		eval_free(ce);
+		ctx->error = EVAL_MEM_ERROR;
+		return NULL;
+	}
+	e->hash = hash;
+	e->len = len;
+	e->size = off+sizeof(VarFn*)*deps.count+ce->size;
+	e->ce = ce;
+	e->busy = 0;
+	e->stale = 0;
+	e->ndeps = 0;
+	e->dep = (VarFn**)((char*)e+off);
+	memcpy(e->text, expr, len+1);
+	for(i = 0; i <= deps.mask; i++)
+		if(deps.use[i].vf != NULL)
+			e->dep[e->ndeps++] = deps.use[i].vf;
+	if(ctx->cache.count >= ctx->cache.limit)
+	{
+		ctx->cache.evictions++;
+		cache_drop(ctx, ctx->cache.tail);
+	}
+	e->link = ctx->cache.slot[hash & (ctx->cache.nslots-1)];
+	ctx->cache.slot[hash & (ctx->cache.nslots-1)] = e;
+	e->prev = NULL;
+	e->next = ctx->cache.head;
+	if(ctx->cache.head != NULL)
+		ctx->cache.head->prev = e;
+	else
+		ctx->cache.tail = e;
+	ctx->cache.head = e;
+	ctx->cache.count++;
+	ctx->cache.bytes += e->size;
+	DB(printf("-- cache add \"%s\" (%d entries)\n", e->text, ctx->cache.count));
+	
+	return e;
+}
+
+/* run a cached expression, the entry is freed afterwards if it was dropped
+** from the cache while running */
+static int cache_run(CacheEntry *e, double *result)
+{
+	double rv = 0.0;
+	int err;
+	
+	e->busy++;
+	err = RUN_CODE(e->ce, e->ce->reg, e->ce->argv, &rv);
+	e->busy--;
+	if(e->stale && e->busy == 0)
+	{
+		eval_free(e->ce);
+		free(e);
+	}
+	if(err)
+		return err;
+	if(result != NULL)
+		*result = rv;
+	return 0;
+}
+
+/* evaluate an expression for eval_ctx_eval() */
+static int eval_expr(eval_ctx *ctx, const char *expr, double *result)
+{
+	eval_compiled *ce;
+	CacheEntry *e = NULL;
+	ExprNode *list;
+	unsigned long hash = 0;
+	size_t len = 0;
+	double rv = 0.0;
+	int cache = 0;
+	
+	if(ctx->shared != NULL)
+		cache_sync(ctx);
+	if(ctx->cache.limit > 0)
+	{
+		hash = cache_hash(expr, &len);
+		e = cache_find(ctx, expr, hash, len);
+		if(e != NULL && e->busy == 0)
+		{
+			ctx->cache.hits++;
+			if(ctx->stats != NULL)
+				ctx->stats->calls += e->ce->ncalls;
+			return cache_run(e, result);
+		}
+		ctx->cache.misses++;
+		cache = e == NULL; /* not if it is running, its registers are in use */
+		e = NULL;
+	}
+	/* the table entries found by the parser of a shared table's context
+	** mustn't be deleted before the code is generated */
+	if(ctx->shared != NULL && ht_read_begin())
+		return EVAL_MEM_ERROR;
+	ctx->recurse++;
+	parse_reset(ctx);
+	parse_expr(ctx, expr, &list);
+	if(ctx->error == 0 && cache)
+		e = cache_add(ctx, expr, hash, len, list);
+	else if(ctx->error == 0)
+	{ /* the code is lalloc()'d along with the tree */
+		ce = new_code(ctx, list, 1);
+		if(ce != NULL)
+			ctx->error = RUN_CODE(ce, ce->reg, ce->argv, &rv);
+		if(ce != NULL && ctx->stats != NULL)
+			ctx->stats->calls += ce->ncalls;
+	}
+	if(ctx->shared != NULL)
+		ht_read_end();
+	ctx->recurse--;
+	if(ctx->recurse == 0)
+		lreset(&ctx->arena);
+	if(ctx->error)
+		return ctx->error;
+	if(e != NULL && ctx->stats != NULL)
+		ctx->stats->calls += e->ce->ncalls;
+	if(e != NULL)
+		return cache_run(e, result);
+	if(result != NULL)
+		*result = rv;
+	return 0;
+}
+
+/* the time in nanoseconds, for the latency histogram */
+static unsigned long stats_clock(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (unsigned long)ts.tv_sec*1000000000UL+ts.tv_nsec;
+}
+
+/* the latency histogram bucket of a time, see eval_stats_bucket_ns() */
+static int stats_bucket(unsigned long ns)
+{
+	int e;
+	
+	if(ns < 16)
+		return (int)ns;
+	for(e = 4; e < 40 && ns>>(e+1) != 0; e++)
+		;
+	if(e == 40)
+		return EVAL_LATENCY_BUCKETS-1;
+	
+	return 16*(e-3)+(int)(ns>>(e-4))-16;
+}
+
+/* public: expression evaluation function. Expressions are compiled and
+** kept in a cache, so evaluating the same string again skips the parser */
+int eval_ctx_eval(eval_ctx *ctx, const char *expr, double *result)
+{
+	eval_stats *stats;
+	unsigned long start;
+	int err;
+	
+	if(expr == NULL || (ctx = get_ctx(ctx)) == NULL)
+		return EVAL_NULL_EXPRESSION;
+	if((stats = ctx->stats) == NULL)
+		return eval_expr(ctx, expr, result);
+	start = stats_clock();
+	err = eval_expr(ctx, expr, result);
+	stats->latency[stats_bucket(stats_clock()-start)]++;
+	stats->evals++;
+	if(err)
+		stats->errors++;
+	
+	return err;
+}
+
+int eval(const char *expr, double *result)
+{
+	return eval_ctx_eval(NULL, expr, result);
+}
+
+/* public: set the most expressions eval() keeps compiled */
+int eval_ctx_cache_limit(eval_ctx *ctx, int entries)
+{
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	return cache_limit(ctx, entries);
+}
+
+int eval_cache_limit(int entries)
+{
+	return eval_ctx_cache_limit(NULL, entries);
+}
+
+/* public: get the counters of eval()'s cache */
+int eval_ctx_cache_info(eval_ctx *ctx, unsigned long *hits,
+	unsigned long *misses, unsigned long *evictions,
+	unsigned long *invalidations, int *entries)
+{
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	if(hits != NULL)
+		*hits = ctx->cache.hits;
+	if(misses != NULL)
+		*misses = ctx->cache.misses;
+	if(evictions != NULL)
+		*evictions = ctx->cache.evictions;
+	if(invalidations != NULL)
+		*invalidations = ctx->cache.invalidations;
+	if(entries != NULL)
+		*entries = ctx->cache.count;
+	
+	return 0;
+}
+
+int eval_cache_info(unsigned long *hits, unsigned long *misses,
+	unsigned long *evictions, unsigned long *invalidations, int *entries)
+{
+	return eval_ctx_cache_info(NULL, hits, misses, evictions, invalidations,
+		entries);
+}
+
+/* public: turn a context's statistics on or off */
+int eval_ctx_stats_enable(eval_ctx *ctx, int on)
+{
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	if(on && ctx->stats_mem == NULL)
+	{
+		ctx->stats_mem = (eval_stats*)calloc(1, sizeof(eval_stats));
+		if(ctx->stats_mem == NULL)
+			return 2;
+		ctx->arena.blocks = 0;
+	}
+	ctx->stats = on ? ctx->stats_mem : NULL;
+	
+	return 0;
+}
+
+int eval_stats_enable(int on)
+{
+	return eval_ctx_stats_enable(NULL, on);
+}
+
+/* public: get a snapshot of a context's statistics */
+int eval_ctx_stats_info(eval_ctx *ctx, eval_stats *stats)
+{
+	Node *n;
+	
+	if((ctx = get_ctx(ctx)) == NULL || stats == NULL)
+		return 1;
+	if(ctx->stats_mem != NULL)
+		*stats = *ctx->stats_mem;
+	else
+		memset(stats, 0, sizeof(eval_stats));
+	stats->arena_blocks = ctx->stats_mem != NULL ? ctx->arena.blocks : 0;
+	stats->arena_bytes = 0;
+	for(n = ctx->arena.first; n != NULL; n = n->link)
+		stats->arena_bytes += sizeof(Node)+n->size;
+	stats->cache_bytes = ctx->cache.bytes;
+	
+	return 0;
+}
+
+int eval_stats_info(eval_stats *stats)
+{
+	return eval_ctx_stats_info(NULL, stats);
+}
+
+/* public: zero a context's counters */
+int eval_ctx_stats_reset(eval_ctx *ctx)
+{
+	if((ctx = get_ctx(ctx)) == NULL)
+		return 1;
+	if(ctx->stats_mem != NULL)
+		memset(ctx->stats_mem, 0, sizeof(eval_stats));
+	ctx->arena.blocks = 0;
+	
+	return 0;
+}
+
+int eval_stats_reset(void)
+{
+	return eval_ctx_stats_reset(NULL);
+}
+
+/* public: the shortest time counted by a latency histogram bucket */
+unsigned long eval_stats_bucket_ns(int bucket)
+{
+	if(bucket < 0)
+		return 0;
+	if(bucket < 16)
+		return (unsigned long)bucket;
+	if(bucket > EVAL_LATENCY_BUCKETS)
+		bucket = EVAL_LATENCY_BUCKETS;
+	
+	return (unsigned long)(16+bucket%16)<<(bucket/16-1);
+}
+
+/* public: a percentile of the latency histogram */
+double eval_stats_percentile(const eval_stats *stats, double percent)
+{
+	unsigned long total = 0, rank, seen = 0;
+	int i;
+	
+	if(stats == NULL)
+		return 0.0;
+	for(i = 0; i < EVAL_LATENCY_BUCKETS; i++)
+		total += stats->latency[i];
+	if(total == 0)
+		return 0.0;
+	rank = (unsigned long)(percent/100.0*total+0.5);
+	if(rank < 1)
+		rank = 1;
+	for(i = 0; i < EVAL_LATENCY_BUCKETS-1; i++)
+	{
+		seen += stats->latency[i];
+		if(seen >= rank)
+			break;
+	}
+	
+	return (double)eval_stats_bucket_ns(i+1);
+}
+
+/* public: parse an expression once for repeated evaluation by eval_run() */
+int eval_ctx_compile(eval_ctx *ctx, const char *expr, eval_compiled **compiled)
+{
+	ExprNode *list;
+	int err;
+	
+	if(compiled != NULL)
+		*compiled = NULL;
+	if(expr == NULL || (ctx = get_ctx(ctx)) == NULL)
+		return EVAL_NULL_EXPRESSION;
+	if(compiled != NULL && plan_find(ctx, expr, compiled) == 0)
+		return 0; /* loaded from the plan cache, see eval_plan_cache() */
+	if(ctx->shared != NULL && ht_read_begin())
+		return EVAL_MEM_ERROR;
+	ctx->recurse++;
+	parse_reset(ctx);
+	parse_expr(ctx, expr, &list);
+	if(ctx->error == 0 && compiled != NULL)
+		*compiled = compile_list(ctx, list);
+	if(ctx->shared != NULL)
+		ht_read_end();
+	err = ctx->error;
+	ctx->recurse--;
+	if(ctx->recurse == 0)
+		lreset(&ctx->arena);
+	if(err == 0 && compiled != NULL && *compiled != NULL)
+		plan_keep(expr, *compiled);
+	
+	return err;
+}
+
+int eval_compile(const char *expr, eval_compiled **compiled)
+{
+	return eval_ctx_compile(NULL, expr, compiled);
+}
+
+/* public: evaluate a compiled expression with the current variable values */
+int eval_run(eval_compiled *compiled, double *result)
+{
+	if(compiled == NULL || compiled->tag != COMPILED_TAG)
+		return EVAL_NULL_EXPRESSION;
+	if(__atomic_load_n(&G_prof_period, __ATOMIC_RELAXED) != 0)
+		return prof_run(compiled, compiled->reg, compiled->argv, result);
+	if(compiled->native != NULL)
+		return compiled->native(compiled->reg, compiled->argv, result);
+	return vm_run(compiled, compiled->reg, compiled->argv, result);
+}
+
+/* public: bind a variable of a compiled expression to other storage */
+int eval_bind_var(eval_compiled *compiled, const char *name, const double *value)
+{
+	int i;
+	
+	if(compiled == NULL || compiled->tag != COMPILED_TAG || name == NULL)
+		return 1;
+	if((name = intern_find(name)) == NULL)
+		return 2; /* no context has this variable */
+	for(i = 0; i < compiled->nvars; i++)
+	{
+		if(compiled->slot[i].name == name)
+		{
+			if(value != NULL)
+				compiled->var[i] = value;
+			else
+				compiled->var[i] = compiled->slot[i].home;
+			return 0;
+		}
+	}
+	
+	return 2; /* the expression doesn't use this variable */
+}
+
+/* public: generate native code for a compiled expression */
+int eval_jit(eval_compiled *compiled)
+{
+	if(compiled == NULL || compiled->tag != COMPILED_TAG)
+		return EVAL_NULL_EXPRESSION;
+	return jit_compile(compiled);
+}
+
+/* public: release a compiled expression */
+void eval_free(eval_compiled *compiled)
+{
+	if(compiled == NULL || compiled->tag != COMPILED_TAG)
+		return;
+	compiled->tag = 0;
+	jit_free(compiled);
+	free(compiled);
+	
+	return;
+}
+
+/* return information about the expression evaluator, copyright, author, etc. */
+void eval_info(int *version, int *revision, int *buildno,
+	char *authbuf, int authlim, char *copybuf, int copylim,
+	char *licebuf, int licelim)
+{
+	if(version)
+		*version = G_version;
+	if(revision)
+		*revision = G_revision;
+	if(buildno)
+		*buildno = G_buildno;
+	if(authbuf)
+		strncpy(authbuf, G_author+16, authlim);
+	if(copybuf)
+		strncpy(copybuf, G_copyright+8, copylim);
+	if(licebuf)
+		strncpy(licebuf, G_license+17, licelim);
+	return;
+}
+
+/* public: return a string describing the specified error code */
+const char *eval_error(int err)
+{
+	if(err < MIN_ERR_VALUE || err > MAX_ERR_VALUE)
+		return "Unknown Error Value";
+	return G_eval_err_str[err];
+}
+
+#ifdef EVAL_BENCH
+
+/* evaluation benchmark: times the lexer (pull_token()), the parser, the
+** compiler, eval() without its cache and eval() with its cache over a
+** corpus of expression shapes. Each time is taken many times, and the
+** percentiles are written as JSON, one result per line, or compared with
+** the results of an earlier run */
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_SAMPLES 101
+#define BENCH_SAMPLE_NS 50000.0 /* shortest sample, in ns */
+#define BENCH_THRESHOLD 10.0 /* median slowdown (%) that is a regression */
+#define BENCH_VARS 64 /* variables of the variable heavy expression */
+
+static const char *G_phases[] = {"lex", "parse", "compile", "eval",
+	"eval_cached"};
+#define NPHASES ((int)(sizeof(G_phases)/sizeof(G_phases[0])))
+
+/* the corpus, made by make_corpus() */
+#define NSHAPES 6
+static const char *G_shapes[NSHAPES] = {"short", "long_sum", "deep_nesting",
+	"function_heavy", "variable_heavy", "varargs"};
+static char G_corpus[NSHAPES][8192];
+
+static void make_corpus(void)
+{
+	char *s;
+	int i;
+	
+	strcpy(G_corpus[0], "x*2+y/4-1");
+	s = G_corpus[1]; /* 256 terms, variables and literals */
+	s += sprintf(s, "x");
+	for(i = 1; i < 256; i++)
+		s += sprintf(s, i%2 ? "+%d.%d" : "-y", i, i%10);
+	s = G_corpus[2]; /* 64 groups deep */
+	for(i = 0; i < 64; i++)
+		*s++ = '(';
+	s += sprintf(s, "x");
+	for(i = 0; i < 64; i++)
+		s += sprintf(s, "+%d)*y", i+1);
+	s = G_corpus[3]; /* 32 calls, nested */
+	s += sprintf(s, "sqrt(abs(x*y))");
+	for(i = 0; i < 10; i++)
+		s += sprintf(s, "+sin(x+%d)*cos(y-%d)+exp(-abs(tan(x/%d)))", i, i,
+			i+1);
+	s = G_corpus[4]; /* 64 long dotted names */
+	for(i = 0; i < BENCH_VARS; i++)
+		s += sprintf(s, "%sregion.eu.west.latency_p99.host_%02d", i ? "+" : "",
+			i);
+	s = G_corpus[5]; /* variable argument counts */
+	s += sprintf(s, "sum(x,y,1,2,3,4,5,6,7,8,9,10,11,12,13,14)");
+	s += sprintf(s, "+med(x,y,3,1,4,1,5,9,2,6,5,3,5,8,9)");
+	s += sprintf(s, "+sum(med(x,y,1),med(y,x,2,3),max(x,y,1,2,3),min(1,x,y))");
+	
+	return;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+/* do a phase of the evaluation of an expression n times, returns 0 (zero)
+** on success or an EVAL_* error code */
+static int bench_run(eval_ctx *ctx, eval_ctx *nocache, int phase,
+	const char *expr, long n)
+{
+	eval_compiled *ce;
+	ExprNode *list;
+	Token tok;
+	double rv;
+	long i;
+	int pos, err = 0;
+	
+	for(i = 0; i < n && err == 0; i++)
+	{
+		switch(phase)
+		{
+		case 0: /* lex */
+			pos = 0;
+			ctx->error = 0;
+			do
+				tok = pull_token(ctx, expr, &pos);
+			while(tok.type != '\0' && ctx->error == 0);
+			err = ctx->error;
+			break;
+		case 1: /* parse */
+			parse_reset(ctx);
+			parse_expr(ctx, expr, &list);
+			err = ctx->error;
+			lreset(&ctx->arena);
+			break;
+		case 2: /* compile */
+			err = eval_ctx_compile(ctx, expr, &ce);
+			eval_free(ce);
+			break;
+		case 3: /* eval, without the cache */
+			err = eval_ctx_eval(nocache, expr, &rv);
+			break;
+		default: /* eval, with the cache */
+			err = eval_ctx_eval(ctx, expr, &rv);
+		}
+	}
+	
+	return err;
+}
+
+static int bench_cmp(const void *p1, const void *p2)
+{
+	double d1 = *(const double*)p1, d2 = *(const double*)p2;
+	
+	return d1 < d2 ? -1 : d1 > d2;
+}
+
+/* the times of one phase of one expression, ns per run */
+typedef struct
+{
+	long iters; /* runs per sample */
+	double min, p50, p90, p99, max, mean;
+} BenchResult;
+
+static double percentile(const double *t, int n, double p)
+{
+	return t[(int)(p*(n-1)+0.5)];
+}
+
+/* time a phase of an expression, samples times, returns 0 (zero) on
+** success or an EVAL_* error code */
+static int bench_time(eval_ctx *ctx, eval_ctx *nocache, int phase,
+	const char *expr, int samples, BenchResult *res)
+{
+	double *t, t0, sum = 0.0;
+	long n = 1;
+	int i, err;
+	
+	/* warm up, and find how many runs make a sample long enough to time */
+	if((err = bench_run(ctx, nocache, phase, expr, 1)) != 0)
+		return err;
+	for(;;)
+	{
+		t0 = bench_now();
+		if((err = bench_run(ctx, nocache, phase, expr, n)) != 0)
+			return err;
+		if(bench_now()-t0 >= BENCH_SAMPLE_NS)
+			break;
+		n *= 2;
+	}
+	t = (double*)malloc(sizeof(double)*samples);
+	if(t == NULL)
+		return EVAL_MEM_ERROR;
+	for(i = 0; i < samples; i++)
+	{
+		t0 = bench_now();
+		bench_run(ctx, nocache, phase, expr, n);
+		t[i] = (bench_now()-t0)/n;
+		sum += t[i];
+	}
+	qsort(t, samples, sizeof(double), bench_cmp);
+	res->iters = n;
+	res->min = t[0];
+	res->p50 = percentile(t, samples, 0.50);
+	res->p90 = percentile(t, samples, 0.90);
+	res->p99 = percentile(t, samples, 0.99);
+	res->max = t[samples-1];
+	res->mean = sum/samples;
+	free(t);
+	
+	return 0;
+}
+
+/* the median time of an expression's phase in a file written by an earlier
+** run, returns 0 (zero) if not found */
+static double bench_base(FILE *fp, const char *shape, const char *phase)
+{
+	char line[512], s[64], p[64];
+	const char *m;
+	double p50;
+	
+	rewind(fp);
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		if((m = strstr(line, "{\"expr\": ")) == NULL
+		|| sscanf(m, "{\"expr\": \"%63[^\"]\", \"phase\": \"%63[^\"]\"",
+			s, p) != 2
+		|| strcmp(s, shape) != 0 || strcmp(p, phase) != 0)
+			continue;
+		if((m = strstr(line, "\"p50\": ")) != NULL
+		&& sscanf(m+7, "%lf", &p50) == 1)
+			return p50;
+	}
+	
+	return 0.0;
+}
+
+static void bench_usage(void)
+{
+	fprintf(stderr, "usage: evalbench [-samples n] [-o file] "
+		"[-compare file [-threshold percent]]\n");
+	
+	return;
+}
+
+int main(int args, char *arg[])
+{
+	eval_ctx *ctx, *nocache;
+	BenchResult res;
+	FILE *out = stdout, *base = NULL;
+	double threshold = BENCH_THRESHOLD, old, change;
+	char name[64];
+	int samples = BENCH_SAMPLES, regressions = 0, first = 1, a, i, j, err;
+	
+	for(a = 1; a < args; a++)
+	{
+		if(a+1 < args && strcmp(arg[a], "-samples") == 0)
+			samples = atoi(arg[++a]);
+		else if(a+1 < args && strcmp(arg[a], "-threshold") == 0)
+			threshold = atof(arg[++a]);
+		else if(a+1 < args && strcmp(arg[a], "-o") == 0)
+		{
+			if((out = fopen(arg[++a], "w")) == NULL)
+			{
+				perror(arg[a]);
+				return 1;
+			}
+		}else if(a+1 < args && strcmp(arg[a], "-compare") == 0)
+		{
+			if((base = fopen(arg[++a], "r")) == NULL)
+			{
+				perror(arg[a]);
+				return 1;
+			}
+		}else
+			break;
+	}
+	if(a < args || samples < 1)
+	{
+		bench_usage();
+		return 1;
+	}
+	if(base != NULL && out == stdout)
+		out = NULL; /* compare mode prints a table instead */
+	
+	make_corpus();
+	ctx = eval_ctx_create();
+	nocache = eval_ctx_create();
+	if(ctx == NULL || nocache == NULL || eval_ctx_set_default_env(ctx)
+	|| eval_ctx_set_default_env(nocache) || eval_ctx_cache_limit(nocache, 0))
+	{
+		fprintf(stderr, "evalbench: can't make the contexts\n");
+		return 1;
+	}
+	for(i = 0; i < BENCH_VARS+2; i++)
+	{
+		if(i < BENCH_VARS)
+			sprintf(name, "region.eu.west.latency_p99.host_%02d", i);
+		else
+			strcpy(name, i == BENCH_VARS ? "x" : "y");
+		eval_ctx_set_var(ctx, name, 1.0+i/16.0);
+		eval_ctx_set_var(nocache, name, 1.0+i/16.0);
+	}
+	
+	if(out != NULL)
+		fprintf(out, "{\n\"libeval\": \"%d.%d.%d\", \"samples\": %d, "
+			"\"unit\": \"ns\", \"results\": [\n", G_version, G_revision,
+			G_buildno, samples);
+	if(base != NULL)
+		printf("%-15s %-12s %10s %10s %8s\n", "expr", "phase", "base p50",
+			"p50", "change");
+	for(i = 0; i < NSHAPES; i++)
+	{
+		for(j = 0; j < NPHASES; j++)
+		{
+			if((err = bench_time(ctx, nocache, j, G_corpus[i], samples, &res)))
+			{
+				fprintf(stderr, "evalbench: %s %s: %s\n", G_shapes[i],
+					G_phases[j], eval_error(err));
+				return 2;
+			}
+			if(out != NULL)
+			{
+				fprintf(out, "%s {\"expr\": \"%s\", \"phase\": \"%s\", "
+					"\"iters\": %ld, \"min\": %.1f, \"p50\": %.1f, "
+					"\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f, "
+					"\"mean\": %.1f}\n", first ? " " : ",", G_shapes[i],
+					G_phases[j], res.iters, res.min, res.p50, res.p90, res.p99,
+					res.max, res.mean);
+				fflush(out);
+				first = 0;
+			}
+			if(base == NULL)
+				continue;
+			old = bench_base(base, G_shapes[i], G_phases[j]);
+			if(old <= 0.0)
+			{
+				printf("%-15s %-12s %10s %10.1f\n", G_shapes[i], G_phases[j],
+					"-", res.p50);
+				continue;
+			}
+			change = (res.p50-old)*100.0/old;
+			printf("%-15s %-12s %10.1f %10.1f %+7.1f%%%s\n", G_shapes[i],
+				G_phases[j], old, res.p50, change,
+				change > threshold ? "  REGRESSION" : "");
+			fflush(stdout);
+			if(change > threshold)
+				regressions++;
+		}
+	}
+	if(out != NULL)
+		fprintf(out, "]\n}\n");
+	if(out != NULL && out != stdout)
+		fclose(out);
+	if(base != NULL)
+	{
+		printf("%d regression%s over %.1f%%\n", regressions,
+			regressions == 1 ? "" : "s", threshold);
+		fclose(base);
+	}
+	eval_ctx_free(ctx);
+	eval_ctx_free(nocache);
+	
+	return regressions != 0;
+}
+
+#endif
+
+#ifdef EVAL_TEST
+
+/* regression tests: each check that fails is reported, and the exit status
+** is the number of failures */
+
+#include <stdio.h>
+
+static int G_failures = 0;
+
+static void check(const char *what, int ok)
+{
+	if(!ok)
+	{
+		fprintf(stderr, "FAILED: %s\n", what);
+		G_failures++;
+	}
+	
+	return;
+}
+
+/* native code for calls with many arguments, which once overran the code
+** buffer (see instr_size() in jit.c) */
+static void test_jit_args(void)
+{
+	static const int counts[] = {1, 16, 235, 236, 1000, 3000};
+	eval_compiled *ce;
+	char *expr, *s, what[64];
+	double rv;
+	int i, j;
+	
+	expr = (char*)malloc(3*3000+16);
+	if(expr == NULL)
+	{
+		check("jit args: out of memory", 0);
+		return;
+	}
+	for(i = 0; i < (int)(sizeof(counts)/sizeof(counts[0])); i++)
+	{
+		s = expr+sprintf(expr, "sum(x");
+		for(j = 1; j < counts[i]; j++)
+			s += sprintf(s, ",x");
+		strcpy(s, ")");
+		sprintf(what, "jit sum of %d arguments", counts[i]);
+		rv = 0.0;
+		if(eval_compile(expr, &ce) != 0)
+		{
+			check(what, 0);
+			continue;
+		}
+		eval_jit(ce); /* the interpreter is fine too, if it can't */
+		check(what, eval_run(ce, &rv) == 0 && rv == counts[i]);
+		eval_free(ce);
+	}
+	free(expr);
+	
+	return;
+}
+
+/* an impure function that changes a variable */
+static FUNCTION(bump, args, arg, rv, data)
+{
+	double x;
+	
+	(void)args;
+	(void)arg;
+	(void)data;
+	eval_get_var("x", &x);
+	eval_set_var("x", x+1.0);
+	*rv = 0.0;
+	
+	return 0;
+}
+
+/* loads of a variable after an impure call see its new value, even when
+** an earlier load of it hashes nearby (see cse_code()) */
+static void test_cse_epochs(void)
+{
+	eval_compiled *ce = NULL;
+	double rv;
+	
+	eval_def_fn("bump", bump, NULL, 0);
+	eval_set_var("y0", 2.0);
+	eval_set_var("x", 10.0);
+	check("cse: eval() after impure calls",
+		eval("y0+y0-y0+x+bump()+bump()+x", &rv) == 0 && rv == 24.0);
+	eval_set_var("x", 10.0);
+	check("cse: compile after impure calls",
+		eval_compile("y0+y0-y0+x+bump()+bump()+x", &ce) == 0
+		&& eval_run(ce, &rv) == 0 && rv == 24.0);
+	eval_free(ce);
+	eval_set_var("x", 10.0);
+	check("cse: loads between impure calls",
+		eval("x+bump()+x*2+x+bump()+x", &rv) == 0 && rv == 10+22+11+12);
+	eval_set_var("x", 1.0);
+	
+	return;
+}
+
+static FUNCTION(twice, args, arg, rv, data)
+{
+	(void)args;
+	(void)data;
+	*rv = 2.0*arg[0];
+	
+	return 0;
+}
+
+static FUNCTION(thrice, args, arg, rv, data)
+{
+	(void)args;
+	(void)data;
+	*rv = 3.0*arg[0];
+	
+	return 0;
+}
+
+/* compile, save and load an expression, returns the error of the load and
+** the value of the loaded expression in rv */
+static int reload(const char *expr, double *rv)
+{
+	eval_compiled *ce;
+	unsigned char buf[1024];
+	size_t size;
+	int err;
+	
+	if((err = eval_compile(expr, &ce)) != 0)
+		return err;
+	size = eval_serialize(ce, buf, sizeof(buf));
+	eval_free(ce);
+	if(size > sizeof(buf))
+		return EVAL_MEM_ERROR;
+	if((err = eval_deserialize(buf, size, &ce)) != 0)
+		return err;
+	err = eval_run(ce, rv);
+	eval_free(ce);
+	
+	return err;
+}
+
+/* a plan that folded away a user's pure function is never loaded, as the
+** function may have been redefined; a standard function must still be the
+** standard one */
+static void test_plan_folds(void)
+{
+	eval_compiled *ce = NULL;
+	unsigned char buf[1024];
+	size_t size;
+	double rv = 0.0;
+	
+	eval_def_pure_fn("f", twice, NULL, 1);
+	check("plan: folded user function is stale",
+		reload("f(5)+x", &rv) == EVAL_PLAN_STALE);
+	check("plan: standard function loads",
+		reload("sqrt(4)+x", &rv) == 0 && rv == 3.0);
+	eval_compile("sqrt(4)+x", &ce);
+	size = eval_serialize(ce, buf, sizeof(buf));
+	eval_free(ce);
+	eval_def_pure_fn("sqrt", thrice, NULL, 1);
+	check("plan: redefined standard function is stale",
+		eval_deserialize(buf, size, &ce) == EVAL_PLAN_STALE);
+	eval_def_const("k", 2.0);
+	eval_compile("k*x", &ce);
+	size = eval_serialize(ce, buf, sizeof(buf));
+	eval_free(ce);
+	eval_def_const("k", 3.0);
+	check("plan: changed constant is stale",
+		eval_deserialize(buf, size, &ce) == EVAL_PLAN_STALE);
+	eval_set_default_env();
+	
+	return;
+}
+
+/* expressions whose labels are cut to the same text get records of their
+** own, so the functions they call are reported apart */
+static void test_profile_keys(void)
+{
+	static const char *path = "evaltest.prof";
+	const char *exprs[2] = {
+		"region.eu.west.latency_p99+region.eu.west.latency_p50+"
+			"region.eu.west.errors+sqrt(region.eu.west.qps)",
+		"region.eu.west.latency_p99+region.eu.west.latency_p50+"
+			"region.eu.west.errors+abs(region.eu.west.cpu)"};
+	eval_compiled *ce[2] = {NULL, NULL};
+	char line[256];
+	int i, j, sqrts = 0, abss = 0;
+	double rv;
+	FILE *f;
+	
+	eval_set_var("region.eu.west.latency_p99", 1.0);
+	eval_set_var("region.eu.west.latency_p50", 2.0);
+	eval_set_var("region.eu.west.errors", 3.0);
+	eval_set_var("region.eu.west.qps", 4.0);
+	eval_set_var("region.eu.west.cpu", 5.0);
+	for(i = 0; i < 2; i++)
+		if(eval_compile(exprs[i], ce+i) != 0)
+		{
+			check("profile: compile", 0);
+			eval_free(ce[0]);
+			return;
+		}
+	eval_profile_reset();
+	eval_profile_enable(1);
+	for(j = 0; j < 100; j++)
+		for(i = 0; i < 2; i++)
+			eval_run(ce[i], &rv);
+	eval_profile_enable(0);
+	check("profile: write", eval_profile_write(path,
+		EVAL_PROFILE_FUNCTIONS) == 0);
+	if((f = fopen(path, "r")) != NULL)
+	{
+		while(fgets(line, sizeof(line), f) != NULL)
+		{
+			if(strncmp(line, "sqrt\t", 5) == 0 && strstr(line, "\t100\t"))
+				sqrts++;
+			if(strncmp(line, "abs\t", 4) == 0 && strstr(line, "\t100\t"))
+				abss++;
+		}
+		fclose(f);
+	}
+	remove(path);
+	check("profile: functions of expressions with the same label",
+		sqrts == 1 && abss == 1);
+	eval_profile_reset();
+	for(i = 0; i < 2; i++)
+		eval_free(ce[i]);
+	
+	return;
+}
+
+/* loading a CSV file leaves existing variables of its header names alone */
+static void test_csv_vars(void)
+{
+	static const char *path = "evaltest.csv";
+	eval_compiled *ce = NULL;
+	eval_csv *csv;
+	double out[2], v = 0.0;
+	FILE *f;
+	
+	if((f = fopen(path, "w")) == NULL)
+	{
+		check("csv: write file", 0);
+		return;
+	}
+	fputs("price,csv_qty,csv qty\n2,3,0\n4,5,0\n", f);
+	fclose(f);
+	eval_set_var("price", 7.0);
+	check("csv: load", eval_csv_load(path, &csv) == 0);
+	remove(path);
+	check("csv: existing variable keeps its value",
+		eval_get_var("price", &v) == 0 && v == 7.0);
+	check("csv: new header names are defined",
+		eval_get_var("csv_qty", &v) == 0);
+	check("csv: other header names aren't bound",
+		eval_get_var("csv qty", &v) != 0);
+	if(csv == NULL)
+		return;
+	check("csv: run", eval_compile("price*csv_qty", &ce) == 0
+		&& eval_csv_run(csv, ce, out) == 0 && out[0] == 6.0 && out[1] == 20.0);
+	eval_free(ce);
+	eval_csv_free(csv);
+	
+	return;
+}
+
+int main(void)
+{
+	eval_set_default_env();
+	eval_set_var("x", 1.0);
+	test_jit_args();
+	test_cse_epochs();
+	test_plan_folds();
+	test_profile_keys();
+	test_csv_vars();
+	printf("%s\n", G_failures == 0 ? "all tests passed" : "tests FAILED");
+	
+	return G_failures;
 }
 
 #endif
@@ -1,5 +1,5 @@
 /*
-** simple expression evaluator library (recursive descent parser)
+** simple expression evaluator library (operator precedence parser)
 ** Copyright (C) 2006  Jeffrey S. Dutky
 **
 ** This library is free software; you can redistribute it and/or
@@ -20,11 +20,54 @@
 #ifndef EVAL_EXPR_H
 #define EVAL_EXPR_H
 
+#include <stddef.h>
+
+/* an evaluation context holds a set of variables and functions, along with
+** the state of the expression parser. Each thread can evaluate expressions
+** in a context of its own without locking, but a context must not be used
+** by more than one thread at a time. Every function that takes a ctx
+** parameter has a version without it, which uses a default context, and
+** passing NULL for ctx also uses the default context. */
+typedef struct eval_ctx_struct eval_ctx;
+
+/* create a new context, without any variables or functions (see
+** eval_ctx_set_default_env()), returns NULL if out of memory */
+eval_ctx *eval_ctx_create(void);
+
+/* create a context that shares the variables and functions of another
+** context (NULL for the default context), for use by another thread. The
+** threads look names up without locking or waiting, and any of them can
+** set variables and define constants and functions while the others are
+** evaluating. The first shared context of a table must be created before
+** other threads use the table. Returns NULL if out of memory */
+eval_ctx *eval_ctx_create_shared(eval_ctx *ctx);
+
+/* release a context and all of its variables and functions (a shared
+** table is released with the last context sharing it). Expressions
+** compiled in the context must be freed first */
+void eval_ctx_free(eval_ctx *ctx);
+
+/* set how many bytes of parser memory a context keeps for the next
+** expression (64K by default). Once the kept memory is big enough for the
+** expressions being parsed, eval() doesn't allocate any memory; memory
+** beyond the limit is freed after each expression, and 0 (zero) frees it
+** all */
+int eval_arena_keep(size_t bytes);
+int eval_ctx_arena_keep(eval_ctx *ctx, size_t bytes);
+
 /* set a named variable used by the eval() function */
 int eval_set_var(const char *name, double value);
+int eval_ctx_set_var(eval_ctx *ctx, const char *name, double value);
+
+/* define a named constant used by the eval() function. Constants are used
+** like variables, but they can't be changed by eval_set_var(), and compiled
+** expressions use the value the constant had when they were compiled */
+int eval_def_const(const char *name, double value);
+int eval_ctx_def_const(eval_ctx *ctx, const char *name, double value);
 
 /* get the value of a named variable as used by eval() */
 int eval_get_var(const char *name, double *value);
+int eval_ctx_get_var(eval_ctx *ctx, const char *name, double *value);
 
 /* the FUNCTION() macro is used to declare user-defined functions that can
 ** be passed to eval_def_fn() for inclusion in the evaluation environment.
@@ -36,6 +79,36 @@ typedef FUNCTION((*FunctionPtr),args,arg,rv,data);
 
 /* define a function for use by eval() */
 int eval_def_fn(const char *name, FunctionPtr fn, void *data, int args);
+int eval_ctx_def_fn(eval_ctx *ctx, const char *name, FunctionPtr fn,
+	void *data, int args);
+
+/* define a pure function for use by eval(). The result of a pure function
+** depends only on its arguments (and data), so calls with constant arguments
+** are evaluated once when an expression is compiled */
+int eval_def_pure_fn(const char *name, FunctionPtr fn, void *data, int args);
+int eval_ctx_def_pure_fn(eval_ctx *ctx, const char *name, FunctionPtr fn,
+	void *data, int args);
+
+/* the VECTOR_FUNCTION() macro is used to declare vector versions of
+** user-defined functions, which evaluate rows calls at once: arg[i] points
+** to the rows values of argument i, and the rows results are saved into rv
+** (which never overlaps the arguments). A vector function returns 0 (zero)
+** on success, non-zero if any of the calls fails.
+**
+** the VectorFunctionPtr typedef defines pointers to vector functions
+** declared using the VECTOR_FUNCTION() macro. */
+#define VECTOR_FUNCTION(NAME,ARGS,ROWS,ARG,RV,DATA) int NAME(int ARGS, size_t ROWS, const double **ARG, double *RV, void *DATA)
+typedef VECTOR_FUNCTION((*VectorFunctionPtr),args,rows,arg,rv,data);
+
+/* give a function defined by eval_def_fn() or eval_def_pure_fn() a vector
+** version, used by eval_run_batch() in place of calling the function once
+** per row. The vector version gets the same data as the function, and must
+** give the same results. Redefining the function removes its vector
+** version, a NULL vfn removes it too. The function returns 0 (zero) on
+** success, non-zero if name is not a function */
+int eval_def_vector_fn(const char *name, VectorFunctionPtr vfn);
+int eval_ctx_def_vector_fn(eval_ctx *ctx, const char *name,
+	VectorFunctionPtr vfn);
 
 /* evaluate an arithmetic expression consisting of numeric literals,
 ** named variables, addition (+), subtraction (-), multiplication (*),
@@ -45,6 +118,232 @@ int eval_def_fn(const char *name, FunctionPtr fn, void *data, int args);
 ** value is saved into the result parameter. The function returns 0 (zero)
 ** on success, non-zero on error */
 int eval(const char *expr, double *result);
+int eval_ctx_eval(eval_ctx *ctx, const char *expr, double *result);
+
+/* eval() keeps the expressions it has seen compiled, so evaluating the same
+** string again skips the parser. Expressions that use a function or
+** constant are dropped from the cache when it is redefined. Set the most
+** expressions kept (256 by default), 0 (zero) turns the cache off */
+int eval_cache_limit(int entries);
+int eval_ctx_cache_limit(eval_ctx *ctx, int entries);
+
+/* get the cache's counters: the number of expressions found in the cache,
+** not found, dropped to make room and dropped because a name they use was
+** redefined, and the number of expressions in the cache. Any parameter
+** can be NULL */
+int eval_cache_info(unsigned long *hits, unsigned long *misses,
+	unsigned long *evictions, unsigned long *invalidations, int *entries);
+int eval_ctx_cache_info(eval_ctx *ctx, unsigned long *hits,
+	unsigned long *misses, unsigned long *evictions,
+	unsigned long *invalidations, int *entries);
+
+/* a context can keep statistics of the expressions it evaluates, to show
+** where the time and memory go. They are off by default, and cost next to
+** nothing while off. The counters count from when the statistics were
+** turned on or last reset, the memory is what the context holds now */
+#define EVAL_LATENCY_BUCKETS 592
+typedef struct
+{
+	unsigned long evals; /* eval() calls */
+	unsigned long errors; /* eval() calls that failed */
+	unsigned long parses; /* expressions parsed, by eval() or eval_compile() */
+	unsigned long tokens; /* tokens read by the parser */
+	unsigned long lookups; /* names looked up by the parser */
+	unsigned long probes; /* table slot groups or buckets the lookups read */
+	unsigned long calls; /* function calls made by eval() */
+	unsigned long arena_blocks; /* blocks of parser memory allocated */
+	size_t arena_bytes; /* parser memory held */
+	size_t cache_bytes; /* memory held by eval()'s cache */
+	unsigned long latency[EVAL_LATENCY_BUCKETS]; /* eval() calls by time */
+} eval_stats;
+
+/* turn a context's statistics on (non-zero) or off (0 (zero)), the counts
+** are kept while they are off. Returns 0 (zero) on success, non-zero if out
+** of memory */
+int eval_stats_enable(int on);
+int eval_ctx_stats_enable(eval_ctx *ctx, int on);
+
+/* get a snapshot of a context's statistics (all zeros if they were never
+** turned on), returns 0 (zero) on success, non-zero on error */
+int eval_stats_info(eval_stats *stats);
+int eval_ctx_stats_info(eval_ctx *ctx, eval_stats *stats);
+
+/* zero a context's counters and latency histogram, returns 0 (zero) on
+** success, non-zero on error */
+int eval_stats_reset(void);
+int eval_ctx_stats_reset(eval_ctx *ctx);
+
+/* eval_stats.latency[i] counts the eval() calls that took at least
+** eval_stats_bucket_ns(i) and less than eval_stats_bucket_ns(i+1)
+** nanoseconds. The buckets are 1ns wide up to 16ns, then each power of two
+** is split into 16 buckets, so a time is known to within 6.25% */
+unsigned long eval_stats_bucket_ns(int bucket);
+
+/* the time in nanoseconds that percent of the eval() calls counted by the
+** latency histogram took no longer than (the top of the bucket), 0 (zero)
+** if none were counted */
+double eval_stats_percentile(const eval_stats *stats, double percent);
+
+/* compiled expressions are parsed once by eval_compile() and can then be
+** evaluated any number of times by eval_run() without re-parsing the
+** expression string. Variables are bound when the expression is compiled,
+** but their values are read each time the expression is run, so changes
+** made with eval_set_var() are seen by later runs. Functions are bound when
+** the expression is compiled, recompile after redefining a function with
+** eval_def_fn(). A compiled expression must not be run by more than one
+** thread at a time. */
+typedef struct eval_compiled_struct eval_compiled;
+
+/* parse an expression for later evaluation by eval_run(). The compiled
+** expression is returned in the compiled parameter, if compiled is NULL the
+** expression is only checked for errors. The function returns 0 (zero) on
+** success, non-zero on error (the same error codes as eval()) */
+int eval_compile(const char *expr, eval_compiled **compiled);
+int eval_ctx_compile(eval_ctx *ctx, const char *expr, eval_compiled **compiled);
+
+/* evaluate a compiled expression using the current variable values, the
+** result is saved into the result parameter. The function returns 0 (zero)
+** on success, non-zero on error */
+int eval_run(eval_compiled *compiled, double *result);
+
+/* bind a variable used by a compiled expression to the double stored at
+** value, so that eval_run() reads the variable from there instead of from
+** the variable set by eval_set_var(). Binding to NULL restores the normal
+** binding. The function returns 0 (zero) on success, non-zero if the
+** compiled expression doesn't use the named variable */
+int eval_bind_var(eval_compiled *compiled, const char *name, const double *value);
+
+/* generate native machine code for a compiled expression, later calls to
+** eval_run() will execute the native code instead of interpreting the
+** compiled expression. Native code is only available on x86-64, the
+** function returns 0 (zero) on success, non-zero if native code could not
+** be generated (in which case eval_run() keeps using the interpreter) */
+int eval_jit(eval_compiled *compiled);
+
+/* evaluate a compiled expression for each of rows rows of data. The
+** variables named in the names parameter are read from the matching columns
+** in the cols parameter (arrays of rows doubles), ncols gives the number of
+** names and columns, names the expression doesn't use are ignored and all
+** other variables keep their current values. The result for each row is
+** saved into the out parameter (an array of rows doubles). The rows are
+** evaluated in blocks with SIMD arithmetic. The function returns 0 (zero)
+** on success, non-zero if the evaluation of any row fails (the contents of
+** out are undefined in that case) */
+int eval_run_batch(eval_compiled *compiled, size_t rows, int ncols,
+	const char **names, const double **cols, double *out);
+
+/* set the number of threads used by eval_run_batch(), 0 (zero) for one per
+** processor, and the number of rows a thread takes at a time, 0 (zero) for
+** the default. Batches are evaluated in the calling thread by default (one
+** thread). Rows are spread over the threads while the results still go to
+** the same place in the out parameter, but the functions called by the
+** expression must be safe to call from several threads at once. The
+** function returns 0 (zero) on success, non-zero if threads aren't
+** supported */
+int eval_batch_threads(int threads, size_t chunk);
+
+/* return the name of the instruction set used by eval_run_batch() on this
+** machine ("avx512", "avx2", "sse2" or "c") */
+const char *eval_batch_isa(void);
+
+/* release a compiled expression returned by eval_compile() */
+void eval_free(eval_compiled *compiled);
+
+/* save a compiled expression into buf as a plan: its code and constants,
+** with its variables and functions kept by name. Returns the size of the
+** plan, which is only written if it fits in size bytes (pass a NULL buf to
+** get the size), or 0 (zero) if compiled isn't a compiled expression */
+size_t eval_serialize(const eval_compiled *compiled, void *buf, size_t size);
+
+/* load a plan saved by eval_serialize(), without parsing the expression:
+** its names are bound to the context's variables and functions, which
+** must still be defined. Returns 0 (zero) on success, non-zero on failure
+** (EVAL_PLAN_ERROR, 12, if the plan is damaged or from another kind of
+** machine, EVAL_PLAN_STALE, 13, if a constant it used has changed since it
+** was compiled, or if it evaluated a call to a pure function other than a
+** standard one when it was compiled, as that function may have changed;
+** it must be compiled again) */
+int eval_deserialize(const void *buf, size_t size, eval_compiled **compiled);
+int eval_ctx_deserialize(eval_ctx *ctx, const void *buf, size_t size,
+	eval_compiled **compiled);
+
+/* save a compiled expression to a file, and load it (the file is mapped
+** into memory), like eval_serialize() and eval_deserialize(). Return 0
+** (zero) on success, non-zero on failure */
+int eval_save(const eval_compiled *compiled, const char *path);
+int eval_load(const char *path, eval_compiled **compiled);
+int eval_ctx_load(eval_ctx *ctx, const char *path, eval_compiled **compiled);
+
+/* keep the plan of every expression compiled by eval_compile() in a
+** directory, one file per expression named by a hash of its text, and
+** load it from there when the same text is compiled again, in this or
+** another process. Plans that are damaged or out of date are compiled
+** and saved again, and expressions that evaluated a call to a pure
+** function other than a standard one aren't saved. NULL turns the cache
+** off (the default). The directory must exist. Returns 0 (zero) on
+** success, non-zero if out of memory */
+int eval_plan_cache(const char *dir);
+
+/* a CSV file loaded as columns: the first line is a header naming the
+** columns, and every other (non-blank) line is a row. Fields that aren't
+** numbers, or are missing, are NaN. The file is parsed in chunks on the
+** threads set by eval_batch_threads() */
+typedef struct eval_csv_struct eval_csv;
+
+/* load a CSV file and define each header name that isn't already defined
+** as a variable of the context (names that can't be variables are left
+** unbound, and existing variables keep their values), so that expressions
+** using them can be compiled. Returns 0 (zero) on success, non-zero on
+** failure (EVAL_CSV_ERROR, 11, if the file can't be read) */
+int eval_csv_load(const char *path, eval_csv **csv);
+int eval_ctx_csv_load(eval_ctx *ctx, const char *path, eval_csv **csv);
+
+/* the number of rows and columns of a loaded file, a column's header name
+** and its values (NULL if there is no such column) */
+size_t eval_csv_rows(const eval_csv *csv);
+int eval_csv_cols(const eval_csv *csv);
+const char *eval_csv_name(const eval_csv *csv, int col);
+const double *eval_csv_column(const eval_csv *csv, int col);
+
+/* evaluate a compiled expression for every row of a loaded file, with the
+** header names bound to the columns, like eval_run_batch(). The results
+** go into out, an array of eval_csv_rows() doubles. Returns 0 (zero) on
+** success, non-zero on error */
+int eval_csv_run(const eval_csv *csv, eval_compiled *compiled, double *out);
+
+/* release a loaded file */
+void eval_csv_free(eval_csv *csv);
+
+/* the profiler finds where evaluation time goes. While it is on, one run
+** in every period (counted in each thread) of eval(), eval_ctx_eval() or
+** eval_run() is timed instruction by instruction with the cycle counter,
+** and the time is added to each subexpression and each function called
+** (user functions and standard ones alike). Sampled runs of expressions
+** with native code (see eval_jit()) are run by the interpreter. Batches
+** (eval_run_batch()) aren't profiled. The profile covers every context
+** and thread */
+#define EVAL_PROFILE_FOLDED 0 /* folded stacks, for flamegraph.pl */
+#define EVAL_PROFILE_FUNCTIONS 1 /* time per function */
+
+/* turn profiling on, profiling one run in every period, or off (period is
+** 0 (zero)). The profile gathered is kept while it is off. Returns 0
+** (zero) on success, non-zero on error */
+int eval_profile_enable(int period);
+
+/* throw away the profile gathered so far. It may be called while
+** expressions are being evaluated: samples already being taken go to the
+** old profile, whose memory is freed by a later reset if it is still in
+** use then. Returns 0 (zero) on success */
+int eval_profile_reset(void);
+
+/* write the profile to a file ("-" for the standard output) in one of the
+** EVAL_PROFILE_* formats. Folded stacks have a line per subexpression: the
+** path from the whole expression down to it, separated by semicolons, and
+** the nanoseconds spent in it (not counting its operands). The function
+** table has a line per function: its name, "standard" or "user", the calls
+** and nanoseconds profiled and the nanoseconds per call. Times cover only
+** the sampled runs. Returns 0 (zero) on success, non-zero on error */
+int eval_profile_write(const char *path, int format);
 
 /* return information about the expression evaluator, copyright, auther, etc. */
 void eval_info(int *version, int *revision, int *buildno,
@@ -56,5 +355,6 @@ const char *eval_error(int err);
 
 /* setup the default functions and variables */
 int eval_set_default_env(void);
+int eval_ctx_set_default_env(eval_ctx *ctx);
 
 #endif
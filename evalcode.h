@@ -0,0 +1,228 @@
+/*
+** simple expression evaluator library (compiled expression code)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* this header is private to libeval, it is not installed */
+
+#ifndef EVAL_CODE_H
+#define EVAL_CODE_H
+
+#include <stddef.h>
+
+#include "eval.h"
+
+#define EVAL_SYNTAX_ERROR 1
+#define EVAL_DIVIDE_BY_ZERO 2
+#define EVAL_UNKNOWN_NAME 3
+#define EVAL_BAD_LITERAL 4
+#define EVAL_MEM_ERROR 5
+#define EVAL_CONVERT_ERROR 6
+#define EVAL_NESTED_PARENS 7
+#define EVAL_NULL_EXPRESSION 8
+#define EVAL_FUNCTION_ERROR 9
+#define EVAL_ARGS_ERROR 10
+#define EVAL_CSV_ERROR 11
+#define EVAL_PLAN_ERROR 12
+#define EVAL_PLAN_STALE 13
+
+/* compiled expressions are register machine code. Every instruction writes
+** its own register (no register is written twice), the first nconst
+** registers hold the constants of the expression, and are loaded when the
+** expression is compiled, the rest hold instruction results. The registers
+** used by instruction i are: */
+#define INSTR_REG(CE,I) ((CE)->nconst+(I))
+
+/* opcodes, the order must match the dispatch table in vm_run() */
+#define OP_LOADV 0 /* dst = *var[a] */
+#define OP_ADD 1   /* dst = a+b */
+#define OP_SUB 2   /* dst = a-b */
+#define OP_MUL 3   /* dst = a*b */
+#define OP_DIV 4   /* dst = a/b, error if b is zero */
+#define OP_MOD 5   /* dst = fmod(a,b), error if b is zero */
+#define OP_POW 6   /* dst = pow(a,b) */
+#define OP_NEG 7   /* dst = -a */
+#define OP_PCT 8   /* dst = a/100 */
+#define OP_CALL 9  /* dst = call[a].fn(args), error if fn fails */
+#define OP_RET 10  /* return a */
+#define OP_COUNT 11
+
+typedef struct
+{
+	int op; /* OP_* opcode */
+	int dst; /* destination register */
+	int a, b; /* operand registers, variable slot or call table index */
+} Instr;
+
+typedef struct
+{
+	const char *name; /* interned variable name, see intern_find() */
+	const double *home; /* variable value in the variable table */
+} VarSlot;
+
+typedef struct
+{
+	const char *name; /* interned name of a constant or pure function */
+	double value; /* the constant's value when compiled */
+	int fn; /* FOLDED_CONST, FOLDED_STANDARD or FOLDED_USER */
+} Folded;
+
+#define FOLDED_CONST 0 /* a constant */
+#define FOLDED_STANDARD 1 /* a standard function, see func.c */
+#define FOLDED_USER 2 /* a user's pure function, which a plan can't check */
+
+typedef struct
+{
+	FunctionPtr fn; /* function pointer */
+	VectorFunctionPtr vfn; /* vector version, used by batch evaluation */
+	void *data; /* custom data block for function */
+	int nargs; /* number of arguments */
+	int pure; /* non-zero if the function is pure */
+	int *arg; /* argument registers */
+	const char *name; /* interned function name, for the profiler */
+} Call;
+
+#define COMPILED_TAG 0x70784543 /* CExp */
+
+typedef struct ProfExpr_struct ProfExpr;
+
+/* a compiled expression is allocated as a single block: the header is
+** followed by the register file, the argument scratch space, the variable
+** slots and their bindings, the names folded away, the call table, the
+** code and finally the call argument registers */
+struct eval_compiled_struct
+{
+	int tag;
+	size_t size; /* bytes of the block */
+	int nregs, nconst; /* registers used, registers holding constants */
+	int ninstr, nvars, ncalls; /* instruction, variable and call counts */
+	int maxargs; /* largest argument count of any call */
+	double *reg; /* register file */
+	double *argv; /* argument values passed to functions */
+	const double **var; /* variable slots, point to the variable values */
+	VarSlot *slot; /* the variable bound to each slot */
+	int nfolded; /* constants and pure functions folded into constants */
+	Folded *folded; /* checked when a saved expression is loaded */
+	Call *call; /* call table */
+	Instr *code; /* instructions */
+	int (*native)(double *reg, double *argv, double *result); /* jit code */
+	void *native_mem; /* mmap()'d native code block */
+	size_t native_size; /* size of native code block */
+	ProfExpr *prof; /* profile record, see prof.c */
+	unsigned long prof_gen; /* valid if this is G_prof_gen */
+};
+
+/* the interned copy of a name, NULL if no context ever defined the name.
+** Interned names are equal if and only if they are the same pointer */
+const char *intern_find(const char *name);
+
+/* allocate an empty compiled expression (with malloc()) with room for the
+** given counts, returns NULL if out of memory. The counts are set, the
+** contents are not */
+eval_compiled *code_alloc(int nregs, int nconst, int ninstr, int nvars,
+	int nfolded, int ncalls, int maxargs, int nargs);
+
+/* bind the names of a loaded compiled expression (the slot, call and folded
+** names, which needn't be interned) to a context's variables and
+** functions, returns 0 (zero) on success or an EVAL_* error code:
+** EVAL_PLAN_STALE if the names have changed in ways that would have
+** compiled differently */
+int code_bind(eval_ctx *ctx, eval_compiled *ce);
+
+/* the on-disk plan cache (see plan.c): find a saved compiled expression,
+** returns 0 (zero) and sets compiled if one was found and loaded, and save
+** a newly compiled one. Both do nothing while there is no cache */
+int plan_find(eval_ctx *ctx, const char *expr, eval_compiled **compiled);
+void plan_keep(const char *expr, const eval_compiled *compiled);
+
+/* run compiled code using the given register file and argument scratch
+** space, returns 0 (zero) on success or an EVAL_* error code */
+int vm_run(const eval_compiled *ce, double *reg, double *argv, double *result);
+
+/* profiling (see prof.c): while G_prof_period is non-zero, compiled code
+** is run by prof_run(), which profiles one run in every G_prof_period */
+extern int G_prof_period;
+#define RUN_CODE(CE,REG,ARGV,RESULT) \
+	(__atomic_load_n(&G_prof_period, __ATOMIC_RELAXED) != 0 ? \
+	prof_run((CE), (REG), (ARGV), (RESULT)) : vm_run((CE), (REG), (ARGV), (RESULT)))
+
+/* run compiled code like vm_run() (or its native code), profiling the
+** run if it is one of the sampled ones */
+int prof_run(eval_compiled *ce, double *reg, double *argv, double *result);
+
+/* non-zero if a function is one of the standard functions (see func.c) */
+int func_standard(FunctionPtr fn);
+
+/* the standard function of a name, NULL if there is none */
+FunctionPtr func_find_standard(const char *name);
+
+/* batch evaluation (see batch.c), rows are evaluated in blocks */
+#define BATCH_ROWS 256
+typedef struct BatchPlan_struct BatchPlan;
+typedef struct BatchScratch_struct BatchScratch;
+
+/* plan the evaluation of a compiled expression over columns, returns NULL
+** if out of memory. The plan is read-only and may be shared by threads */
+BatchPlan *batch_plan(const eval_compiled *ce, int ncols, const char **names,
+	const double **cols);
+
+/* allocate the scratch space for running a plan in one thread, returns NULL
+** if out of memory */
+BatchScratch *batch_scratch(const BatchPlan *bp);
+
+/* evaluate rows row0 to row0+rows-1 of a plan into out, returns 0 (zero)
+** on success or an EVAL_* error code */
+int batch_rows(const BatchPlan *bp, BatchScratch *bs, size_t row0,
+	size_t rows, double *out);
+
+/* evaluate all the rows of a plan, spread over the thread pool (see
+** pool.c), returns 0 (zero) on success or an EVAL_* error code */
+int pool_run(const BatchPlan *bp, size_t rows, double *out);
+
+/* map a whole file into memory, read-only (see file.c), returns NULL if
+** it can't be read or is empty. Sequential files are read ahead */
+const char *file_map(const char *path, size_t *size, int sequential);
+
+/* release a file mapped by file_map() */
+void file_unmap(const char *data, size_t size);
+
+/* a task of a job run by the thread pool: runs task number task with the
+** job's argument and the thread's state, returns 0 (zero) on success or an
+** EVAL_* error code */
+typedef int (*PoolTask)(void *arg, void *state, long task);
+
+/* run tasks 0 to ntasks-1 (fewer than 2^32) spread over the thread pool,
+** with no thread state, returns 0 (zero) on success or the first error of
+** a task. After an error, tasks not yet started aren't run */
+int pool_tasks(PoolTask run, void *arg, long ntasks);
+
+/* the number of threads set by eval_batch_threads(), also used to load
+** CSV files (see csv.c) */
+int pool_threads(void);
+
+/* give the standard functions their vector versions (see vfunc.c), returns
+** 0 (zero) on success, non-zero on error */
+int vfunc_set_default_env(eval_ctx *ctx);
+
+/* generate native code for a compiled expression, returns 0 (zero) on
+** success, non-zero if native code could not be generated */
+int jit_compile(eval_compiled *ce);
+
+/* release the native code of a compiled expression (if any) */
+void jit_free(eval_compiled *ce);
+
+#endif
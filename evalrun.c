@@ -0,0 +1,736 @@
+/*
+** simple expression evaluator library (bulk evaluation tool)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* evalrun reads newline separated expressions and name=expr assignments
+** (of any length) from files or the standard input and writes one line of
+** output for each line of input: the value of an expression, name = value
+** for an assignment, an error message, or an empty line for an empty one.
+**
+** The work is split into four stages, each on its own thread, that pass
+** blocks of lines along bounded queues:
+**
+**   read     reads the input in large chunks, splits it into lines and
+**            splits assignments into name and expression
+**   compile  compiles each expression with eval_ctx_compile(), and defines
+**            the variables assigned to, so that later lines can use them
+**   evaluate runs the compiled expressions in order with eval_run() and
+**            sets the assigned variables
+**   write    formats the results into a large stdio buffer
+**
+** The compile and evaluate stages use two contexts sharing one table of
+** variables, so names are defined and set without waiting for each other.
+** A line only sees the assignments above it: the compile stage defines an
+** assigned name when it reaches the assignment, and the evaluate stage sets
+** its value before running the lines after it. When the input is a
+** terminal every line is passed along and written as soon as it is read */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "eval.h"
+
+#define CHUNK (1024*1024) /* bytes read at a time */
+#define QUEUE_LEN 8 /* blocks waiting between two stages */
+#define OUT_BUFFER (1024*1024) /* output buffer size */
+#define SLICES 64 /* CSV output slices formatted at once */
+#define SLICE_ROWS 16384 /* rows per slice */
+
+#define LINE_BLANK 0 /* kinds of line */
+#define LINE_EXPR 1
+#define LINE_ASSIGN 2
+
+typedef struct
+{
+	int kind; /* LINE_* */
+	char *name; /* the variable assigned to, LINE_ASSIGN only */
+	char *expr; /* the expression */
+	eval_compiled *ce; /* set by the compile stage */
+	int err; /* error code, 0 (zero) if none */
+	double value; /* set by the evaluate stage */
+} Line;
+
+/* a block of lines, the text holds each line, nul terminated */
+typedef struct
+{
+	char *text;
+	size_t len, size; /* bytes used and allocated */
+	Line *line;
+	int nlines, maxlines;
+} Block;
+
+/* a bounded queue of blocks between two stages, a NULL block marks the
+** end of the input */
+typedef struct
+{
+	Block *block[QUEUE_LEN];
+	int head, count;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} Queue;
+
+/* the state shared by the stages */
+typedef struct
+{
+	char **files; /* input files, "-" is the standard input */
+	int nfiles;
+	int interactive; /* the input is a terminal */
+	int digits; /* significant digits written */
+	int failed; /* a stage failed */
+	FILE *out;
+	eval_ctx *compile_ctx, *eval_ctx;
+	Queue read_q, compile_q, eval_q; /* into compile, evaluate and write */
+} Pipeline;
+
+static void queue_init(Queue *q)
+{
+	q->head = 0;
+	q->count = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->changed, NULL);
+	
+	return;
+}
+
+static void queue_put(Queue *q, Block *b)
+{
+	pthread_mutex_lock(&q->lock);
+	while(q->count == QUEUE_LEN)
+		pthread_cond_wait(&q->changed, &q->lock);
+	q->block[(q->head+q->count++)%QUEUE_LEN] = b;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	
+	return;
+}
+
+static Block *queue_get(Queue *q)
+{
+	Block *b;
+	
+	pthread_mutex_lock(&q->lock);
+	while(q->count == 0)
+		pthread_cond_wait(&q->changed, &q->lock);
+	b = q->block[q->head];
+	q->head = (q->head+1)%QUEUE_LEN;
+	q->count--;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	
+	return b;
+}
+
+static Block *new_block(size_t size)
+{
+	Block *b;
+	
+	b = (Block*)malloc(sizeof(Block));
+	if(b == NULL)
+		return NULL;
+	b->text = (char*)malloc(size+1);
+	b->len = 0;
+	b->size = size;
+	b->line = NULL;
+	b->nlines = 0;
+	b->maxlines = 0;
+	if(b->text == NULL)
+	{
+		free(b);
+		return NULL;
+	}
+	
+	return b;
+}
+
+static void free_block(Block *b)
+{
+	free(b->text);
+	free(b->line);
+	free(b);
+	
+	return;
+}
+
+/* strip leading and trailing white space */
+static char *trim(char *s)
+{
+	char *e;
+	
+	while(*s == ' ' || *s == '\t')
+		s++;
+	for(e = s+strlen(s); e > s && (e[-1] == ' ' || e[-1] == '\t' ||
+		e[-1] == '\r'); e--)
+		;
+	*e = '\0';
+	
+	return s;
+}
+
+/* split the text of a block into lines, up to end, returns non-zero if
+** out of memory */
+static int split_lines(Block *b, size_t end)
+{
+	char *s, *nl, *eq;
+	Line *l;
+	
+	for(s = b->text; s < b->text+end; s = nl+1)
+	{
+		nl = memchr(s, '\n', b->text+end-s);
+		if(nl == NULL)
+			nl = b->text+end; /* the last line has no newline */
+		*nl = '\0';
+		if(b->nlines == b->maxlines)
+		{
+			b->maxlines = b->maxlines > 0 ? b->maxlines*2 : 1024;
+			l = (Line*)realloc(b->line, sizeof(Line)*b->maxlines);
+			if(l == NULL)
+				return 1;
+			b->line = l;
+		}
+		l = b->line+b->nlines++;
+		l->name = NULL;
+		l->ce = NULL;
+		l->err = 0;
+		l->value = 0.0;
+		if((eq = strchr(s, '=')) != NULL)
+		{
+			*eq = '\0';
+			l->kind = LINE_ASSIGN;
+			l->name = trim(s);
+			l->expr = trim(eq+1);
+		}else
+		{
+			l->expr = trim(s);
+			l->kind = *l->expr == '\0' ? LINE_BLANK : LINE_EXPR;
+		}
+	}
+	
+	return 0;
+}
+
+/* read one file into blocks of whole lines, returns non-zero on failure */
+static int read_file(Pipeline *pl, const char *file)
+{
+	Block *b, *next;
+	size_t size, end = 0, i;
+	ssize_t got = 0;
+	char *text;
+	int fd, eof = 0;
+	
+	fd = strcmp(file, "-") == 0 ? 0 : open(file, O_RDONLY);
+	if(fd < 0)
+	{
+		fprintf(stderr, "evalrun: can't open %s: %s\n", file, strerror(errno));
+		return 1;
+	}
+	size = pl->interactive ? 4096 : CHUNK;
+	if((b = new_block(size)) == NULL)
+	{
+		fprintf(stderr, "evalrun: out of memory\n");
+		if(fd != 0)
+			close(fd);
+		return 2;
+	}
+	while(!eof)
+	{
+		got = read(fd, b->text+b->len, b->size-b->len);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got < 0)
+		{
+			fprintf(stderr, "evalrun: can't read %s: %s\n", file,
+				strerror(errno));
+			break;
+		}
+		eof = got == 0;
+		b->len += got;
+		/* pass on the whole lines, the rest starts the next block */
+		for(i = b->len; i > b->len-got; i--)
+		{
+			if(b->text[i-1] == '\n')
+			{
+				end = i;
+				break;
+			}
+		}
+		if(eof)
+			end = b->len;
+		else if(end == 0)
+		{ /* no whole line yet, make room for more of a long line */
+			if(b->len < b->size)
+				continue;
+			size = b->size*2;
+			text = (char*)realloc(b->text, size+1);
+			if(text == NULL)
+				break;
+			b->text = text;
+			b->size = size;
+			continue;
+		}
+		if(!pl->interactive && !eof && b->len < b->size)
+			continue; /* fill the chunk */
+		for(size = pl->interactive ? 4096 : CHUNK; size < 2*(b->len-end);
+			size *= 2)
+			; /* room for the partial line and more */
+		if((next = new_block(size)) == NULL)
+			break;
+		memcpy(next->text, b->text+end, b->len-end);
+		next->len = b->len-end;
+		if(split_lines(b, end))
+		{
+			free_block(next);
+			break;
+		}
+		end = 0;
+		if(b->nlines > 0)
+			queue_put(&pl->read_q, b);
+		else
+			free_block(b);
+		b = next;
+	}
+	if(fd != 0)
+		close(fd);
+	if(!eof && got >= 0)
+		fprintf(stderr, "evalrun: out of memory\n");
+	free_block(b);
+	if(!eof)
+		return 3;
+	
+	return 0;
+}
+
+/* the read stage */
+static void *read_stage(void *arg)
+{
+	Pipeline *pl = (Pipeline*)arg;
+	int i;
+	
+	for(i = 0; i < pl->nfiles; i++)
+	{
+		if(read_file(pl, pl->files[i]))
+		{
+			pl->failed = 1;
+			break;
+		}
+	}
+	queue_put(&pl->read_q, NULL);
+	
+	return NULL;
+}
+
+/* the compile stage */
+static void *compile_stage(void *arg)
+{
+	Pipeline *pl = (Pipeline*)arg;
+	Block *b;
+	Line *l;
+	double v;
+	int i;
+	
+	while((b = queue_get(&pl->read_q)) != NULL)
+	{
+		for(i = 0; i < b->nlines; i++)
+		{
+			l = b->line+i;
+			if(l->kind == LINE_BLANK)
+				continue;
+			if(l->kind == LINE_ASSIGN &&
+				eval_ctx_get_var(pl->compile_ctx, l->name, &v) != 0)
+				eval_ctx_set_var(pl->compile_ctx, l->name, 0.0);
+			l->err = eval_ctx_compile(pl->compile_ctx, l->expr, &l->ce);
+		}
+		queue_put(&pl->compile_q, b);
+	}
+	queue_put(&pl->compile_q, NULL);
+	
+	return NULL;
+}
+
+/* the evaluate stage */
+static void *eval_stage(void *arg)
+{
+	Pipeline *pl = (Pipeline*)arg;
+	Block *b;
+	Line *l;
+	int i;
+	
+	while((b = queue_get(&pl->compile_q)) != NULL)
+	{
+		for(i = 0; i < b->nlines; i++)
+		{
+			l = b->line+i;
+			if(l->ce == NULL)
+				continue;
+			if(l->err == 0)
+				l->err = eval_run(l->ce, &l->value);
+			eval_free(l->ce);
+			l->ce = NULL;
+			if(l->err == 0 && l->kind == LINE_ASSIGN &&
+				eval_ctx_set_var(pl->eval_ctx, l->name, l->value) != 0)
+				l->err = -1;
+		}
+		queue_put(&pl->eval_q, b);
+	}
+	queue_put(&pl->eval_q, NULL);
+	
+	return NULL;
+}
+
+/* the write stage, run by the main thread */
+static void write_stage(Pipeline *pl)
+{
+	Block *b;
+	Line *l;
+	int i;
+	
+	while((b = queue_get(&pl->eval_q)) != NULL)
+	{
+		for(i = 0; i < b->nlines; i++)
+		{
+			l = b->line+i;
+			if(l->err < 0)
+				fprintf(pl->out, "error: can't set %s\n", l->name);
+			else if(l->err)
+				fprintf(pl->out, "error #%d: %s\n", l->err, eval_error(l->err));
+			else if(l->kind == LINE_ASSIGN)
+				fprintf(pl->out, "%s = %.*g\n", l->name, pl->digits, l->value);
+			else if(l->kind == LINE_EXPR)
+				fprintf(pl->out, "%.*g\n", pl->digits, l->value);
+			else
+				putc('\n', pl->out);
+		}
+		free_block(b);
+		if(pl->interactive)
+			fflush(pl->out);
+	}
+	
+	return;
+}
+
+/* in CSV mode the output rows are formatted by several threads, a slice
+** of rows each, and written in order */
+typedef struct
+{
+	size_t row0, rows;
+	int ncols, digits;
+	double **col;
+	char *text; /* the formatted rows, NULL if out of memory */
+	size_t len;
+} Slice;
+
+static void *format_slice(void *arg)
+{
+	Slice *sl = (Slice*)arg;
+	size_t r, size = 65536;
+	char *t;
+	int j;
+	
+	sl->len = 0;
+	sl->text = (char*)malloc(size);
+	for(r = sl->row0; r < sl->row0+sl->rows && sl->text != NULL; r++)
+	{
+		for(j = 0; j < sl->ncols; j++)
+		{
+			if(size-sl->len < 40)
+			{
+				size *= 2;
+				t = (char*)realloc(sl->text, size);
+				if(t == NULL)
+				{
+					free(sl->text);
+					sl->text = NULL;
+					break;
+				}
+				sl->text = t;
+			}
+			sl->len += sprintf(sl->text+sl->len, "%.*g%c", sl->digits,
+				sl->col[j][r], j+1 < sl->ncols ? ',' : '\n');
+		}
+	}
+	
+	return NULL;
+}
+
+/* write a header field, quoted if it holds a comma or a quote */
+static void write_field(FILE *out, const char *s)
+{
+	if(strpbrk(s, ",\"") == NULL)
+	{
+		fputs(s, out);
+		return;
+	}
+	putc('"', out);
+	for(; *s != '\0'; s++)
+	{
+		if(*s == '"')
+			putc('"', out);
+		putc(*s, out);
+	}
+	putc('"', out);
+	
+	return;
+}
+
+/* CSV mode: evaluate each expression over the rows of a CSV file, and
+** write a CSV file with a column for each expression. An expression given
+** as name=expr names its column, and later expressions can use the name */
+static int csv_mode(FILE *out, const char *path, char **exprs, int nexprs,
+	int digits)
+{
+	pthread_t tid[SLICES];
+	Slice slice[SLICES];
+	eval_ctx *ctx;
+	eval_csv *csv;
+	eval_compiled *ce;
+	const char **names;
+	const double **cols;
+	char **label, *eq;
+	double **res;
+	size_t rows, r, step;
+	int ncols, nbound, started[SLICES], nslices, err, i, k;
+	
+	eval_batch_threads(0, 0);
+	ctx = eval_ctx_create();
+	if(ctx == NULL || eval_ctx_set_default_env(ctx))
+	{
+		fprintf(stderr, "evalrun: out of memory\n");
+		return 1;
+	}
+	if((err = eval_ctx_csv_load(ctx, path, &csv)) != 0)
+	{
+		fprintf(stderr, "evalrun: can't load %s: %s\n", path, eval_error(err));
+		return 1;
+	}
+	rows = eval_csv_rows(csv);
+	ncols = eval_csv_cols(csv);
+	names = (const char**)malloc(sizeof(char*)*(ncols+nexprs));
+	cols = (const double**)malloc(sizeof(double*)*(ncols+nexprs));
+	label = (char**)malloc(sizeof(char*)*nexprs);
+	res = (double**)calloc(nexprs, sizeof(double*));
+	if(names == NULL || cols == NULL || label == NULL || res == NULL)
+	{
+		fprintf(stderr, "evalrun: out of memory\n");
+		return 1;
+	}
+	for(i = 0; i < ncols; i++)
+	{
+		names[i] = eval_csv_name(csv, i);
+		cols[i] = eval_csv_column(csv, i);
+	}
+	nbound = ncols;
+	for(k = 0; k < nexprs; k++)
+	{
+		label[k] = trim(exprs[k]);
+		if((eq = strchr(exprs[k], '=')) != NULL)
+		{
+			*eq = '\0';
+			label[k] = trim(exprs[k]);
+			exprs[k] = trim(eq+1);
+			eval_ctx_set_var(ctx, label[k], 0.0);
+		}
+		res[k] = (double*)malloc(sizeof(double)*(rows > 0 ? rows : 1));
+		if(res[k] == NULL)
+		{
+			fprintf(stderr, "evalrun: out of memory\n");
+			return 1;
+		}
+		err = eval_ctx_compile(ctx, exprs[k], &ce);
+		if(err == 0 && rows > 0)
+			err = eval_run_batch(ce, rows, nbound, names, cols, res[k]);
+		if(err == 0)
+			eval_free(ce);
+		if(err)
+		{
+			fprintf(stderr, "evalrun: %s: %s\n", exprs[k], eval_error(err));
+			return 1;
+		}
+		if(eq != NULL)
+		{ /* later expressions can use the column */
+			names[nbound] = label[k];
+			cols[nbound++] = res[k];
+		}
+	}
+	
+	for(k = 0; k < nexprs; k++)
+	{
+		write_field(out, label[k]);
+		putc(k+1 < nexprs ? ',' : '\n', out);
+	}
+	for(r = 0; r < rows && nexprs > 0; r += step)
+	{ /* format a round of slices at once */
+		step = rows-r < SLICES*SLICE_ROWS ? rows-r : SLICES*SLICE_ROWS;
+		nslices = (int)((step+SLICE_ROWS-1)/SLICE_ROWS);
+		for(i = 0; i < nslices; i++)
+		{
+			slice[i].row0 = r+SLICE_ROWS*i;
+			slice[i].rows = i+1 < nslices ? SLICE_ROWS : step-SLICE_ROWS*i;
+			slice[i].ncols = nexprs;
+			slice[i].digits = digits;
+			slice[i].col = res;
+			started[i] = i > 0 &&
+				pthread_create(tid+i, NULL, format_slice, slice+i) == 0;
+		}
+		for(i = 0; i < nslices; i++)
+		{
+			if(started[i])
+				pthread_join(tid[i], NULL);
+			else
+				format_slice(slice+i);
+			if(slice[i].text == NULL)
+			{
+				fprintf(stderr, "evalrun: out of memory\n");
+				return 1;
+			}
+			fwrite(slice[i].text, 1, slice[i].len, out);
+			free(slice[i].text);
+		}
+	}
+	
+	for(k = 0; k < nexprs; k++)
+		free(res[k]);
+	free(res);
+	free(label);
+	free(cols);
+	free(names);
+	eval_csv_free(csv);
+	eval_ctx_free(ctx);
+	
+	return 0;
+}
+
+/* run the four stages, the calling thread writes, returns non-zero if
+** they can't be started */
+static int run_pipeline(Pipeline *pl)
+{
+	pthread_t reader, compiler, evaluator;
+	
+	pl->compile_ctx = eval_ctx_create();
+	if(pl->compile_ctx == NULL || eval_ctx_set_default_env(pl->compile_ctx) ||
+		(pl->eval_ctx = eval_ctx_create_shared(pl->compile_ctx)) == NULL)
+	{
+		fprintf(stderr, "evalrun: out of memory\n");
+		return 1;
+	}
+	queue_init(&pl->read_q);
+	queue_init(&pl->compile_q);
+	queue_init(&pl->eval_q);
+	if(pthread_create(&reader, NULL, read_stage, pl) != 0 ||
+		pthread_create(&compiler, NULL, compile_stage, pl) != 0 ||
+		pthread_create(&evaluator, NULL, eval_stage, pl) != 0)
+	{
+		fprintf(stderr, "evalrun: can't start threads\n");
+		return 1;
+	}
+	write_stage(pl);
+	pthread_join(reader, NULL);
+	pthread_join(compiler, NULL);
+	pthread_join(evaluator, NULL);
+	eval_ctx_free(pl->eval_ctx);
+	eval_ctx_free(pl->compile_ctx);
+	
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: evalrun [-p digits] [-o output] [file ...]\n");
+	fprintf(stderr, "       evalrun [-p digits] [-o output] -csv file -e expr [-e expr ...]\n");
+	fprintf(stderr, "  evaluates each line of the files (or the standard input), which\n");
+	fprintf(stderr, "  are expressions or name=expr assignments, and writes the results,\n");
+	fprintf(stderr, "  one line per input line.\n");
+	fprintf(stderr, "  -p digits  significant digits of the results (default 15)\n");
+	fprintf(stderr, "  -o output  write the results to a file\n");
+	fprintf(stderr, "  -csv file  evaluate the -e expressions for each row of a CSV file,\n");
+	fprintf(stderr, "             with its header names as variables, and write a CSV file\n");
+	fprintf(stderr, "             of the results (name=expr names a result column)\n");
+	
+	return;
+}
+
+int main(int args, char *arg[])
+{
+	static char *stdin_file[] = {"-"};
+	Pipeline pl;
+	const char *output = NULL, *csv = NULL;
+	char *outbuf, **exprs;
+	int a, nexprs = 0, err = 0;
+	
+	pl.digits = 15;
+	exprs = (char**)malloc(sizeof(char*)*args);
+	if(exprs == NULL)
+		return 1;
+	for(a = 1; a < args && arg[a][0] == '-' && arg[a][1] != '\0'; a++)
+	{
+		if(strcmp(arg[a], "-p") == 0 && a+1 < args)
+			pl.digits = atoi(arg[++a]);
+		else if(strcmp(arg[a], "-o") == 0 && a+1 < args)
+			output = arg[++a];
+		else if(strcmp(arg[a], "-csv") == 0 && a+1 < args)
+			csv = arg[++a];
+		else if(strcmp(arg[a], "-e") == 0 && a+1 < args)
+			exprs[nexprs++] = arg[++a];
+		else
+			break;
+	}
+	if((a < args && (csv != NULL || (arg[a][0] == '-' && arg[a][1] != '\0')))
+		|| (csv == NULL) != (nexprs == 0))
+	{
+		usage();
+		return 2;
+	}
+	if(pl.digits < 1 || pl.digits > 17)
+		pl.digits = 17;
+	pl.files = a < args ? arg+a : stdin_file;
+	pl.nfiles = a < args ? args-a : 1;
+	pl.interactive = pl.nfiles == 1 && strcmp(pl.files[0], "-") == 0 &&
+		isatty(0);
+	pl.failed = 0;
+	pl.out = output != NULL ? fopen(output, "w") : stdout;
+	if(pl.out == NULL)
+	{
+		fprintf(stderr, "evalrun: can't create %s: %s\n", output,
+			strerror(errno));
+		return 1;
+	}
+	outbuf = (char*)malloc(OUT_BUFFER);
+	if(outbuf != NULL)
+		setvbuf(pl.out, outbuf, _IOFBF, OUT_BUFFER);
+	if(csv != NULL)
+		pl.failed = csv_mode(pl.out, csv, exprs, nexprs, pl.digits);
+	else if(run_pipeline(&pl))
+		return 1;
+	
+	if(fflush(pl.out) != 0 || ferror(pl.out))
+	{
+		fprintf(stderr, "evalrun: can't write the results\n");
+		err = 1;
+	}
+	if(pl.out != stdout)
+		fclose(pl.out);
+	else
+		setvbuf(stdout, NULL, _IONBF, 0);
+	free(outbuf);
+	free(exprs);
+	
+	return err || pl.failed;
+}
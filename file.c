@@ -0,0 +1,96 @@
+/*
+** simple expression evaluator library (file mapping)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* whole files are mapped into memory where there is mmap(), and read into
+** a malloc()'d block elsewhere. Used to load CSV files (see csv.c) and
+** saved compiled expressions (see plan.c). */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "evalcode.h"
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define FILE_MMAP 1
+#endif
+
+/* map a whole file into memory, read-only */
+const char *file_map(const char *path, size_t *size, int sequential)
+{
+	char *data;
+#ifdef FILE_MMAP
+	struct stat st;
+	int fd;
+	
+	if((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if(fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+	data = (char*)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == (char*)MAP_FAILED)
+		return NULL;
+	if(sequential)
+		madvise(data, *size, MADV_SEQUENTIAL);
+#else
+	FILE *f;
+	long n;
+	
+	(void)sequential;
+	if((f = fopen(path, "rb")) == NULL)
+		return NULL;
+	if(fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) <= 0 ||
+		fseek(f, 0, SEEK_SET) != 0)
+	{
+		fclose(f);
+		return NULL;
+	}
+	*size = (size_t)n;
+	data = (char*)malloc(*size);
+	if(data != NULL && fread(data, 1, *size, f) != *size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+#endif
+	
+	return data;
+}
+
+/* release a file mapped by file_map() */
+void file_unmap(const char *data, size_t size)
+{
+#ifdef FILE_MMAP
+	munmap((void*)data, size);
+#else
+	(void)size;
+	free((void*)data);
+#endif
+	
+	return;
+}
@@ -2,8 +2,9 @@
 #include <limits.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "eval.h"
+#include "evalcode.h"
 
 /* compare two doubles, return -1 if v1 < v2, 1 if v1 > v2, 0 if v1 = v2 */
 static int dcomp(const void *v1, const void *v2)
@@ -448,6 +449,14 @@ static FUNCTION((*fn[]),args,arg,rv,data) =
 	func_deg, func_rad, func_fact, func_sign, NULL
 };
 
+/* pure functions (everything but rand()) are evaluated at compile time
+** when their arguments are constant */
+static int fnpure[] =
+{
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0
+};
+
 /* positive numbers (including zero) indicate fixed number of arguments,
 ** negative one (-1) indicates variable number of arguments */
 static int fnargs[] =
@@ -456,19 +465,55 @@ static int fnargs[] =
 	-1, -1, -1, -1, -1, -1, -1, 1, 1, 1, 1, 0
 };
 
-int eval_set_default_env(void)
+int func_standard(FunctionPtr f)
+{
+	int i;
+	
+	for(i = 0; fn[i] != NULL; i++)
+		if(fn[i] == f)
+			return 1;
+	
+	return 0;
+}
+
+FunctionPtr func_find_standard(const char *name)
+{
+	int i;
+	
+	for(i = 0; fnname[i] != NULL; i++)
+		if(strcmp(fnname[i], name) == 0)
+			return fn[i];
+	
+	return NULL;
+}
+
+int eval_ctx_set_default_env(eval_ctx *ctx)
 {
 	int i;
 	
 	for(i = 0; fnname[i] != NULL; i++)
-		if(eval_def_fn(fnname[i], fn[i], NULL, fnargs[i]))
+	{
+		if(fnpure[i])
+		{
+			if(eval_ctx_def_pure_fn(ctx, fnname[i], fn[i], NULL, fnargs[i]))
+				return 1;
+		}else if(eval_ctx_def_fn(ctx, fnname[i], fn[i], NULL, fnargs[i]))
 			return 1;
+	}
+	
+	if(eval_ctx_def_const(ctx, "pi", PI))
+		return 1;
 	
-	if(eval_set_var("pi", PI))
+	if(eval_ctx_def_const(ctx, "e", exp(1)))
 		return 1;
 	
-	if(eval_set_var("e", exp(1)))
+	if(vfunc_set_default_env(ctx))
 		return 1;
 	
 	return 0;
 }
+
+int eval_set_default_env(void)
+{
+	return eval_ctx_set_default_env(NULL);
+}
@@ -21,6 +21,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef HT_DEBUG
 #include <stdio.h>
@@ -36,6 +41,7 @@
 struct hashbucket_struct
 {
 	int tag;
+	unsigned int hash; /* hash code of the key */
 	struct hashbucket_struct *link;
 	const void *key;
 	void *val;
@@ -50,6 +56,34 @@ struct hashblock_struct
 	struct hashbucket_struct bucket[BLOCK_SIZE];
 };
 
+/* slot of an open addressing table (see ht_create_flat()) */
+struct hashslot_struct
+{
+	unsigned int hash; /* hash code of the key */
+	const void *key;
+	void *val;
+};
+
+/* the slots and control bytes of an open addressing table, allocated in
+** one block with the control bytes following the slots */
+struct hashflat_struct
+{
+	unsigned long size; /* slots, a power of 2 and at least 16 */
+	unsigned long used; /* full or deleted slots */
+	unsigned char *ctrl;
+	struct hashslot_struct slot[1];
+};
+
+/* a key, value or set of arrays removed from a concurrent table, which
+** can't be deleted until the lookups that might be using it are done */
+struct hashretired_struct
+{
+	struct hashretired_struct *link;
+	unsigned long epoch; /* reads that began in this epoch can't see it */
+	int what; /* RETIRE_KEY, RETIRE_VAL or RETIRE_MEM */
+	void *ptr;
+};
+
 /* hashtable is implemented in a heap-friendly manner. By allocating the
 ** hash table structure, initial slot table and a bunch of buckets in a
 ** single malloc() call, we minimize heap fragmentation. Further buckets
@@ -71,28 +105,659 @@ struct hashtable_struct
 	void (*vdel)(void *val);
 	struct hashbucket_struct *pool;
 	struct hashblock_struct *blocks;
-	struct hashbucket_struct **old_table; /* prep for auto table resize */
-	unsigned long old_size, curr_slot;    /* prep for auto table resize */
-	unsigned long item_count;             /* prep for auto table resize */
-	struct hashbucket_struct *itable[1];  /* prep for auto table resize */
+	struct hashbucket_struct **old_table; /* table being emptied by a resize */
+	unsigned long old_size, curr_slot;    /* its size, next slot to move */
+	unsigned long item_count;             /* items in both tables */
+	struct hashflat_struct *flat, *old_flat; /* open addressing arrays */
+	int concurrent;                       /* see ht_concurrent() */
+	pthread_mutex_t lock;                 /* serializes concurrent writers */
+	struct hashretired_struct *retired;   /* waiting to be deleted */
+	struct hashbucket_struct *itable[1];  /* initial slot table */
 };
 
-/* with auto table resize we will detect when the current table is overfull
+/* with auto table resize we detect when the current table is overfull
 ** and allocate a new, larger, table. Then, with each lookup, insert or
-** remove we will transfer one slot's worth of buckets from the old table
-** to the new table. Each lookup will first be performed in the new table,
-** but, if the lookup fails, it will be performed again against the old
-** table. Only if both lookups fail will we return a lookup failure. 
+** remove we transfer a few slots' worth of buckets from the old table
+** to the new table. Each lookup is first performed in the new table,
+** but, if the lookup fails, it is performed again against the old
+** table. Only if both lookups fail do we return a lookup failure. 
 **
-** Any item lookedup in or inserted into the table after an auto resise
-** will go into the new table. After the lookup or insert is complete,
-** a slot in the old table will be selected to be transferred from the
-** old table to the new one. 
+** Any item looked up in or inserted into the table during an auto resize
+** goes into the new table, so no single operation ever has to move more
+** than a few slots and there are no latency spikes.
 **
-** The big problem with auto resize is knowing when to do the resize,
-** what we really want to do is detect when the table is no hashing well
-** (when we are putting lots of entries in the same slot) but that may
-** be hard to do reliably. */
+** The table is resized when it has more items than slots, which keeps the
+** average chain short. Each bucket keeps the hash code of its key, so the
+** buckets can be moved without hashing the keys again, and most of the
+** keys in a chain can be skipped without calling the compare function */
+#define RESIZE_LOAD 1 /* items per slot that start a resize */
+#define RESIZE_STEP 2 /* old slots moved by each operation */
+
+/* an open addressing table keeps its keys and values in an array of slots,
+** with a control byte for each slot in a second array. The control byte
+** of a slot in use holds 7 bits of the key's hash code, so a lookup checks
+** a group of 16 slots at once by comparing their control bytes (with one
+** SSE2 compare where we have it) and only looks at the slots whose byte
+** matches. The slots keep the whole hash code as well, so the compare
+** function is almost never called for the wrong key. Groups are probed in
+** a triangular sequence, and a lookup stops at the first group with an
+** empty slot.
+**
+** A removed slot is marked deleted, so lookups go on past it, unless its
+** group has an empty slot (then no lookup could have gone past it anyway).
+** Inserts reuse deleted slots. When 7/8ths of the slots are full or deleted
+** the items start moving to new arrays (twice as big, unless most of those
+** slots were deleted ones), a few groups with each operation, as with the
+** chained table. In the mean time curr_slot is the next old slot to move */
+#define GROUP 16 /* slots probed at once */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_FREE(C) ((C)&0x80) /* empty or deleted */
+#define IS_FLAT(HT) ((HT)->table == NULL) /* chained tables always have one */
+#define FLAT_FULL(S) ((S)/8*7) /* full or deleted slots that start a resize */
+
+#define RETIRE_KEY 0 /* kinds of hashretired_struct */
+#define RETIRE_VAL 1
+#define RETIRE_MEM 2
+
+static unsigned long G_epoch = 1; /* see struct hashreader_struct */
+
+/* groups and buckets examined by this thread's lookups, see ht_probes() */
+#ifdef __GNUC__
+static __thread unsigned long G_probes __attribute__((tls_model("initial-exec")));
+#define PROBED(N) (G_probes += (N))
+#else
+#define PROBED(N) ((void)0)
+#endif
+#ifdef __GNUC__
+#define FIRST_BIT(M) __builtin_ctz(M)
+#else
+static int first_bit(unsigned int m)
+{
+	int i;
+	
+	for(i = 0; (m&1) == 0; i++)
+		m >>= 1;
+	
+	return i;
+}
+#define FIRST_BIT(M) first_bit(M)
+#endif
+
+#ifdef __SSE2__
+/* bit i of the result is set if control byte i of the group is c */
+static unsigned int group_match(const unsigned char *ctrl, unsigned char c)
+{
+	__m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+	
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(g,
+		_mm_set1_epi8((char)c)));
+}
+
+/* bit i of the result is set if slot i of the group is empty or deleted */
+static unsigned int group_free(const unsigned char *ctrl)
+{
+	return (unsigned int)_mm_movemask_epi8(
+		_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+static unsigned int group_match(const unsigned char *ctrl, unsigned char c)
+{
+	unsigned int m = 0;
+	int i;
+	
+	for(i = 0; i < GROUP; i++)
+		if(__atomic_load_n(ctrl+i, __ATOMIC_ACQUIRE) == c)
+			m |= 1u<<i;
+	
+	return m;
+}
+
+static unsigned int group_free(const unsigned char *ctrl)
+{
+	unsigned int m = 0;
+	int i;
+	
+	for(i = 0; i < GROUP; i++)
+		if(CTRL_FREE(__atomic_load_n(ctrl+i, __ATOMIC_ACQUIRE)))
+			m |= 1u<<i;
+	
+	return m;
+}
+#endif
+
+/* the table's hash function needn't spread its codes over all 32 bits,
+** so they are mixed before picking a group and a control byte */
+static unsigned int flat_mix(unsigned int h)
+{
+	h ^= h>>16;
+	h *= 0x85ebca6bU;
+	h ^= h>>13;
+	h *= 0xc2b2ae35U;
+	h ^= h>>16;
+	
+	return h;
+}
+
+/* allocate the arrays for an open addressing table of p_size slots */
+static struct hashflat_struct *flat_alloc(unsigned long p_size)
+{
+	struct hashflat_struct *f;
+	
+	f = (struct hashflat_struct*)malloc(sizeof(struct hashflat_struct)
+		+(sizeof(struct hashslot_struct)+1)*p_size);
+	if(f == NULL)
+		return NULL;
+	f->size = p_size;
+	f->used = 0;
+	f->ctrl = (unsigned char*)(f->slot+p_size);
+	memset(f->ctrl, CTRL_EMPTY, p_size);
+	
+	return f;
+}
+
+/* find the slot holding a key, returns -1 if the key isn't there. This
+** is also how the readers of a concurrent table search it, so the control
+** bytes are read before the slots they describe */
+static long flat_find(const struct hashflat_struct *f, const void *p_key,
+	unsigned int hc, unsigned int mix,
+	int (*p_comp)(const void *key1, const void *key2))
+{
+	unsigned long g, step, mask = f->size/GROUP-1;
+	unsigned int m, e;
+	long i;
+	
+	g = (mix>>7)&mask;
+	for(step = 1; step <= mask+1; step++)
+	{
+		PROBED(1);
+		m = group_match(f->ctrl+g*GROUP, (unsigned char)(mix&0x7f));
+		e = group_match(f->ctrl+g*GROUP, CTRL_EMPTY);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		while(m != 0)
+		{
+			i = (long)(g*GROUP)+FIRST_BIT(m);
+			if(f->slot[i].hash == hc && p_comp(p_key,
+				__atomic_load_n(&f->slot[i].key, __ATOMIC_ACQUIRE)) == 0)
+				return i;
+			m &= m-1;
+		}
+		if(e != 0)
+			break;
+		g = (g+step)&mask;
+	}
+	
+	return -1;
+}
+
+/* find a free slot for a key that isn't in the arrays, an empty one or,
+** if deleted is non-zero, a deleted one. Returns -1 if there isn't one
+** (this shouldn't happen) */
+static long flat_place(const struct hashflat_struct *f, unsigned int mix,
+	int deleted)
+{
+	unsigned long g, step, mask = f->size/GROUP-1;
+	unsigned int m;
+	
+	g = (mix>>7)&mask;
+	for(step = 1; step <= mask+1; step++)
+	{
+		if(deleted)
+			m = group_free(f->ctrl+g*GROUP);
+		else
+			m = group_match(f->ctrl+g*GROUP, CTRL_EMPTY);
+		if(m != 0)
+			return (long)(g*GROUP)+FIRST_BIT(m);
+		g = (g+step)&mask;
+	}
+	
+	return -1;
+}
+
+/* put an item into a free slot, the control byte is stored last so a
+** concurrent reader never sees a half filled slot */
+static void flat_set(struct hashflat_struct *f, long i, unsigned int mix,
+	unsigned int hc, const void *p_key, void *p_val)
+{
+	if(f->ctrl[i] == CTRL_EMPTY)
+		f->used++;
+	f->slot[i].hash = hc;
+	f->slot[i].key = p_key;
+	f->slot[i].val = p_val;
+	__atomic_store_n(f->ctrl+i, (unsigned char)(mix&0x7f), __ATOMIC_RELEASE);
+	
+	return;
+}
+
+/* free a slot, marking it empty if its group has an empty slot (and no
+** lookup could have gone past it), otherwise deleted. The slots of a
+** concurrent table are only ever marked deleted, so that they aren't
+** reused while a reader may still be looking at them */
+static void flat_clear(hashtable *p_ht, struct hashflat_struct *f, long i)
+{
+	if(!p_ht->concurrent
+		&& group_match(f->ctrl+(i&~(long)(GROUP-1)), CTRL_EMPTY) != 0)
+	{
+		f->ctrl[i] = CTRL_EMPTY;
+		f->used--;
+		return;
+	}
+	__atomic_store_n(f->ctrl+i, CTRL_DELETED, __ATOMIC_RELEASE);
+	
+	return;
+}
+
+/* move the items in the next group of the old arrays into the current
+** arrays, and finish the resize when the old arrays are empty */
+static void flat_move_group(hashtable *p_ht)
+{
+	struct hashflat_struct *o = p_ht->old_flat;
+	struct hashslot_struct *hs;
+	unsigned long i;
+	unsigned int mix;
+	
+	for(i = p_ht->curr_slot; i < p_ht->curr_slot+GROUP; i++)
+	{
+		if(CTRL_FREE(o->ctrl[i]))
+			continue;
+		hs = o->slot+i;
+		mix = flat_mix(hs->hash);
+		flat_set(p_ht->flat, flat_place(p_ht->flat, mix, 1), mix, hs->hash,
+			hs->key, hs->val);
+		/* deleted, not empty, so lookups still probe past this group */
+		o->ctrl[i] = CTRL_DELETED;
+	}
+	p_ht->curr_slot += GROUP;
+	if(p_ht->curr_slot >= o->size)
+	{
+		D(fprintf(stderr, "resize to %lu slots done\n", p_ht->flat->size);
+			fflush(stderr));
+		free(o);
+		p_ht->old_flat = NULL;
+		p_ht->curr_slot = 0;
+	}
+	
+	return;
+}
+
+/* the oldest epoch any reader began in, or ULONG_MAX if none is reading */
+static unsigned long oldest_reader(void);
+
+/* keep a removed key, value or set of arrays of a concurrent table until
+** no reader can be using it. If the record can't be allocated, the thing
+** is never deleted, which is safe (if wasteful) */
+static void retire(hashtable *p_ht, int what, void *ptr)
+{
+	struct hashretired_struct *r;
+	
+	if((what == RETIRE_KEY && p_ht->kdel == NULL)
+		|| (what == RETIRE_VAL && p_ht->vdel == NULL))
+		return;
+	r = (struct hashretired_struct*)malloc(sizeof(struct hashretired_struct));
+	if(r == NULL)
+		return;
+	r->what = what;
+	r->ptr = ptr;
+	/* a reader that sees this epoch, or a later one, began after ptr was
+	** taken out of the table */
+	r->epoch = __atomic_add_fetch(&G_epoch, 1, __ATOMIC_SEQ_CST);
+	r->link = p_ht->retired;
+	p_ht->retired = r;
+	
+	return;
+}
+
+/* delete the retired things no reader can be using, all of them if all
+** is non-zero */
+static void reclaim(hashtable *p_ht, int all)
+{
+	struct hashretired_struct *r, **rp;
+	unsigned long oldest;
+	
+	oldest = all ? ~0UL : oldest_reader();
+	rp = &p_ht->retired;
+	while((r = *rp) != NULL)
+	{
+		if(r->epoch > oldest)
+		{
+			rp = &r->link;
+			continue;
+		}
+		*rp = r->link;
+		if(r->what == RETIRE_KEY)
+			p_ht->kdel(r->ptr);
+		else if(r->what == RETIRE_VAL)
+			p_ht->vdel(r->ptr);
+		else
+			free(r->ptr);
+		free(r);
+	}
+	
+	return;
+}
+
+/* start moving the items into new arrays, twice as big unless most of the
+** used slots are deleted ones. A concurrent table moves all of its items
+** at once, as the readers can't help, and then the new arrays replace the
+** old ones. If the arrays can't be allocated the table stays as it is */
+static void flat_grow(hashtable *p_ht)
+{
+	struct hashflat_struct *f, *o = p_ht->flat;
+	unsigned long size = o->size, i;
+	unsigned int mix;
+	
+	while(p_ht->old_flat != NULL)
+		flat_move_group(p_ht); /* finish the last resize first */
+	if(p_ht->item_count > FLAT_FULL(size)/2)
+		size *= 2;
+	f = flat_alloc(size);
+	if(f == NULL)
+		return;
+	D(fprintf(stderr, "resize from %lu slots\n", o->size); fflush(stderr));
+	if(p_ht->concurrent)
+	{
+		for(i = 0; i < o->size; i++)
+			if(!CTRL_FREE(o->ctrl[i]))
+			{
+				mix = flat_mix(o->slot[i].hash);
+				flat_set(f, flat_place(f, mix, 0), mix, o->slot[i].hash,
+					o->slot[i].key, o->slot[i].val);
+			}
+		__atomic_store_n(&p_ht->flat, f, __ATOMIC_RELEASE);
+		retire(p_ht, RETIRE_MEM, o);
+		return;
+	}
+	p_ht->old_flat = o;
+	p_ht->curr_slot = 0;
+	p_ht->flat = f;
+	
+	return;
+}
+
+/* find the slot holding a key, moving the item out of the old arrays if
+** it's there. Returns -1 if the key isn't in the table */
+static long flat_lookup(hashtable *p_ht, const void *p_key, unsigned int hc,
+	int (*p_comp)(const void *key1, const void *key2))
+{
+	struct hashflat_struct *o;
+	unsigned int mix = flat_mix(hc);
+	long i, j;
+	int k;
+	
+	for(k = 0; k < RESIZE_STEP && p_ht->old_flat != NULL; k++)
+		flat_move_group(p_ht);
+	i = flat_find(p_ht->flat, p_key, hc, mix, p_comp);
+	if(i >= 0 || (o = p_ht->old_flat) == NULL)
+		return i;
+	j = flat_find(o, p_key, hc, mix, p_comp);
+	if(j < 0)
+		return -1;
+	D(fprintf(stderr, "  found in old arrays, moved\n"); fflush(stderr));
+	i = flat_place(p_ht->flat, mix, 1);
+	if(i < 0)
+		return -1;
+	flat_set(p_ht->flat, i, mix, hc, o->slot[j].key, o->slot[j].val);
+	flat_clear(p_ht, o, j);
+	
+	return i;
+}
+
+/* ht_insert() for an open addressing table */
+static int flat_insert(hashtable *p_ht, const void *p_key, void *p_val)
+{
+	struct hashslot_struct *hs;
+	const void *okey;
+	void *oval;
+	unsigned int hc;
+	long i;
+	
+	hc = p_ht->hash(p_key);
+	i = flat_lookup(p_ht, p_key, hc, p_ht->comp);
+	if(i >= 0)
+	{ /* key already in table, update the slot with new key and value */
+		hs = p_ht->flat->slot+i;
+		okey = hs->key;
+		oval = hs->val;
+		__atomic_store_n(&hs->key, p_key, __ATOMIC_RELEASE);
+		__atomic_store_n(&hs->val, p_val, __ATOMIC_RELEASE);
+		if(p_ht->concurrent)
+		{ /* readers may have the old key and value, retire them only now
+		  ** that new readers can't find them */
+			retire(p_ht, RETIRE_KEY, (void*)okey);
+			retire(p_ht, RETIRE_VAL, oval);
+		}else
+		{
+			if(p_ht->kdel != NULL)
+				p_ht->kdel(okey);
+			if(p_ht->vdel != NULL)
+				p_ht->vdel(oval);
+		}
+		
+		return 0;
+	}
+	
+	i = flat_place(p_ht->flat, flat_mix(hc), !p_ht->concurrent);
+	if(i < 0)
+		return 3; /* no slot found (this shouldn't happen) */
+	flat_set(p_ht->flat, i, flat_mix(hc), hc, p_key, p_val);
+	
+	p_ht->item_count++;
+	if(p_ht->flat->used > FLAT_FULL(p_ht->flat->size))
+		flat_grow(p_ht);
+	
+	return 0;
+}
+
+/* ht_remove() for an open addressing table */
+static int flat_remove(hashtable *p_ht, const void *p_key, void **p_val)
+{
+	struct hashslot_struct *hs;
+	long i;
+	
+	i = flat_lookup(p_ht, p_key, p_ht->hash(p_key), p_ht->comp);
+	if(i < 0)
+	{
+		if(p_val != NULL)
+			*p_val = NULL;
+		return 2;
+	}
+	hs = p_ht->flat->slot+i;
+	if(p_val != NULL)
+		*p_val = hs->val;
+	flat_clear(p_ht, p_ht->flat, i);
+	if(p_ht->concurrent)
+	{
+		retire(p_ht, RETIRE_KEY, (void*)hs->key);
+		retire(p_ht, RETIRE_VAL, hs->val);
+	}else
+	{
+		if(p_ht->kdel != NULL)
+			p_ht->kdel(hs->key); /* delete key */
+		if(p_ht->vdel != NULL)
+			p_ht->vdel(hs->val); /* delete value */
+		hs->key = NULL;
+		hs->val = NULL;
+	}
+	p_ht->item_count--;
+	
+	return 0;
+}
+
+/* call p_func() for each item in a set of open addressing arrays */
+static int flat_iterate(const struct hashflat_struct *f,
+	int (*p_func)(unsigned long slot, const void *key, void *val), int *p_rv)
+{
+	unsigned long i;
+	int rv;
+	
+	for(i = 0; i < f->size; i++)
+	{
+		if(CTRL_FREE(__atomic_load_n(f->ctrl+i, __ATOMIC_ACQUIRE)))
+			continue;
+		rv = p_func(i, __atomic_load_n(&f->slot[i].key, __ATOMIC_ACQUIRE),
+			__atomic_load_n(&f->slot[i].val, __ATOMIC_ACQUIRE));
+		if(rv != 0)
+		{
+			D(fprintf(stderr, "func returned %d\n", rv); fflush(stderr));
+			if(p_rv != NULL)
+				*p_rv = rv;
+			return 5;
+		}
+	}
+	
+	return 0;
+}
+
+/* call the kdel and vdel functions for the items in a set of open
+** addressing arrays, and free the arrays */
+static void flat_free(hashtable *p_ht, struct hashflat_struct *f)
+{
+	unsigned long i;
+	
+	for(i = 0; i < f->size; i++)
+	{
+		if(CTRL_FREE(f->ctrl[i]))
+			continue;
+		if(p_ht->kdel != NULL)
+			p_ht->kdel(f->slot[i].key);
+		if(p_ht->vdel != NULL)
+			p_ht->vdel(f->slot[i].val);
+	}
+	free(f);
+	
+	return;
+}
+
+/* the readers of concurrent tables never lock or write anything shared
+** with the writers. Instead each thread that reads has a record of the
+** epoch in which its current read began (0 when it isn't reading). Things
+** removed from a table are kept, tagged with a later epoch, until no reader
+** is left from an earlier epoch. A thread's record is made the first time
+** it reads, which takes a lock, and is reused by another thread when the
+** thread exits. Records are never freed */
+struct hashreader_struct
+{
+	unsigned long epoch; /* epoch the current read began in, or 0 */
+	int depth; /* nested ht_read_begin() calls */
+	int used; /* the record belongs to a thread */
+	struct hashreader_struct *link;
+};
+
+static struct hashreader_struct *G_readers = NULL;
+static pthread_mutex_t G_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t G_readers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t G_reader_key;
+
+/* a thread with a reader record exited, let another thread have it */
+static void reader_exit(void *rec)
+{
+	struct hashreader_struct *r = (struct hashreader_struct*)rec;
+	
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	r->depth = 0;
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+	
+	return;
+}
+
+static void reader_key(void)
+{
+	pthread_key_create(&G_reader_key, reader_exit);
+	
+	return;
+}
+
+/* the calling thread's reader record, NULL if one can't be allocated */
+static struct hashreader_struct *reader_self(void)
+{
+	struct hashreader_struct *r;
+	
+	pthread_once(&G_readers_once, reader_key);
+	r = (struct hashreader_struct*)pthread_getspecific(G_reader_key);
+	if(r != NULL)
+		return r;
+	pthread_mutex_lock(&G_readers_lock);
+	for(r = G_readers; r != NULL; r = r->link)
+		if(__atomic_load_n(&r->used, __ATOMIC_ACQUIRE) == 0)
+			break;
+	if(r == NULL)
+	{
+		r = (struct hashreader_struct*)malloc(sizeof(struct hashreader_struct));
+		if(r != NULL)
+		{
+			r->epoch = 0;
+			r->depth = 0;
+			r->used = 1;
+			r->link = G_readers;
+			__atomic_store_n(&G_readers, r, __ATOMIC_RELEASE);
+		}
+	}else
+		r->used = 1;
+	pthread_mutex_unlock(&G_readers_lock);
+	if(r != NULL)
+		pthread_setspecific(G_reader_key, r);
+	
+	return r;
+}
+
+static unsigned long oldest_reader(void)
+{
+	struct hashreader_struct *r;
+	unsigned long e, oldest = ~0UL;
+	
+	for(r = __atomic_load_n(&G_readers, __ATOMIC_ACQUIRE); r != NULL;
+		r = r->link)
+	{
+		e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if(e != 0 && e < oldest)
+			oldest = e;
+	}
+	
+	return oldest;
+}
+
+/* begin a read of a concurrent table, returns the thread's record, or NULL
+** if it has none (and can't get one) */
+static struct hashreader_struct *read_begin(void)
+{
+	struct hashreader_struct *r;
+	
+	r = reader_self();
+	if(r != NULL && r->depth++ == 0)
+		__atomic_store_n(&r->epoch, __atomic_load_n(&G_epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+	
+	return r;
+}
+
+static void read_end(struct hashreader_struct *r)
+{
+	if(--r->depth == 0)
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	
+	return;
+}
+
+/* lookup in a concurrent table, without taking a lock or writing to the
+** table. Returns 0 (zero) if found, non-zero otherwise */
+static int flat_read(hashtable *p_ht, const void *p_key, unsigned int hc,
+	int (*p_comp)(const void *key, const void *tkey), void **p_val)
+{
+	struct hashreader_struct *r;
+	struct hashflat_struct *f;
+	long i;
+	
+	if((r = read_begin()) == NULL)
+		return 2;
+	f = __atomic_load_n(&p_ht->flat, __ATOMIC_ACQUIRE);
+	i = flat_find(f, p_key, hc, flat_mix(hc), p_comp);
+	if(p_val != NULL)
+		*p_val = i < 0 ? NULL
+			: __atomic_load_n(&f->slot[i].val, __ATOMIC_ACQUIRE);
+	read_end(r);
+	
+	return i < 0 ? 3 : 0;
+}
 
 /* create a new hashtable
 **
@@ -151,6 +816,56 @@ hashtable *ht_create(unsigned long p_size,
 	ht->old_size = 0; /* size of old table during resize */
 	ht->curr_slot = 0; /* current slot to copy to new table */
 	ht->item_count = 0; /* total number of items in hash table (old and new) */
+	ht->flat = ht->old_flat = NULL; /* not an open addressing table */
+	ht->concurrent = 0;
+	ht->retired = NULL;
+	
+	return ht;
+}
+
+/* create a new open addressing hashtable, with room for at least p_size
+** items before it grows
+**
+** returns a valid hashtable pointer on success, NULL on failure */
+hashtable *ht_create_flat(unsigned long p_size,
+	unsigned int (*p_hash)(const void *key),
+	int (*p_comp)(const void *key1, const void *key2),
+	void (*p_kdel)(const void *key),
+	void (*p_vdel)(void *val))
+{
+	hashtable *ht;
+	unsigned long size = GROUP;
+	
+	if(p_hash == NULL || p_comp == NULL)
+		return NULL;
+	
+	while(FLAT_FULL(size) < p_size)
+		size *= 2;
+	ht = (hashtable*)malloc(sizeof(hashtable));
+	if(ht == NULL)
+		return NULL;
+	ht->flat = flat_alloc(size);
+	if(ht->flat == NULL)
+	{
+		free(ht);
+		return NULL;
+	}
+	ht->old_flat = NULL;
+	ht->concurrent = 0;
+	ht->retired = NULL;
+	ht->size = 0;
+	ht->table = NULL; /* no chains, buckets or blocks */
+	ht->pool = NULL;
+	ht->blocks = NULL;
+	ht->old_table = NULL;
+	ht->old_size = 0;
+	ht->curr_slot = 0;
+	ht->item_count = 0;
+	ht->hash = p_hash;
+	ht->comp = p_comp;
+	ht->kdel = p_kdel;
+	ht->vdel = p_vdel;
+	ht->tag = HASHTABLE_TAG;
 	
 	return ht;
 }
@@ -165,6 +880,17 @@ void ht_delete(hashtable *p_ht)
 	if(p_ht == NULL || p_ht->tag != HASHTABLE_TAG)
 		return;
 	
+	if(p_ht->flat != NULL)
+	{ /* open addressing table, it has no chains or bucket blocks */
+		reclaim(p_ht, 1); /* nobody can be reading the table now */
+		flat_free(p_ht, p_ht->flat);
+		if(p_ht->old_flat != NULL)
+			flat_free(p_ht, p_ht->old_flat);
+		p_ht->flat = p_ht->old_flat = NULL;
+		if(p_ht->concurrent)
+			pthread_mutex_destroy(&p_ht->lock);
+	}
+	
 	if(p_ht->size > 0 && p_ht->table != NULL)
 	{
 		if(p_ht->kdel != NULL)
@@ -224,7 +950,7 @@ void ht_delete(hashtable *p_ht)
 			}
 		}
 		if(p_ht->old_table != p_ht->itable)
-			free(p_ht->table); /* delete the old table itself */
+			free(p_ht->old_table); /* delete the old table itself */
 	}
 	p_ht->old_table = NULL;
 	p_ht->old_size = 0;
@@ -252,23 +978,76 @@ void ht_delete(hashtable *p_ht)
 	return;
 }
 
+/* move the buckets of the next slot of the old table into the new table,
+** and finish the resize when the old table is empty */
+static void move_slot(hashtable *p_ht)
+{
+	struct hashbucket_struct *hb, *next, **slot;
+	
+	for(hb = p_ht->old_table[p_ht->curr_slot]; hb != NULL; hb = next)
+	{
+		next = hb->link;
+		slot = &(p_ht->table[hb->hash%p_ht->size]);
+		hb->link = *slot;
+		*slot = hb;
+	}
+	p_ht->old_table[p_ht->curr_slot++] = NULL;
+	if(p_ht->curr_slot >= p_ht->old_size)
+	{
+		D(fprintf(stderr, "resize to %lu slots done\n", p_ht->size);
+			fflush(stderr));
+		if(p_ht->old_table != p_ht->itable)
+			free(p_ht->old_table);
+		p_ht->old_table = NULL;
+		p_ht->old_size = 0;
+		p_ht->curr_slot = 0;
+	}
+	
+	return;
+}
+
+/* start moving the items into a table with twice as many slots, if the
+** new table can't be allocated the table just stays the same size */
+static void grow(hashtable *p_ht)
+{
+	struct hashbucket_struct **table;
+	
+	while(p_ht->old_table != NULL)
+		move_slot(p_ht); /* finish the last resize first */
+	table = (struct hashbucket_struct**)calloc(p_ht->size*2,
+		sizeof(struct hashbucket_struct*));
+	if(table == NULL)
+		return;
+	D(fprintf(stderr, "resize from %lu slots\n", p_ht->size); fflush(stderr));
+	p_ht->old_table = p_ht->table;
+	p_ht->old_size = p_ht->size;
+	p_ht->curr_slot = 0;
+	p_ht->table = table;
+	p_ht->size *= 2;
+	
+	return;
+}
+
 /* internal lookup routine, returns a pointer to the target slot, the
 ** target bucket (if any found) and the bucket before the target (again,
 ** if any found). Returns 0 (zero) on success, positive non-zero on
 ** failure and negative one (-1) when no bucket was found (but a slot
-** has been selected) */
-static int lookup(hashtable *p_ht, const void *p_key, void **p_val,
+** has been selected). The key's hash code and compare function are passed
+** in, so the key needn't be the same type as the table's keys */
+static int lookup(hashtable *p_ht, const void *p_key, unsigned int hc,
+	int (*p_comp)(const void *key1, const void *key2), void **p_val,
 	struct hashbucket_struct ***p_slot,
 	struct hashbucket_struct **p_bucket,
 	struct hashbucket_struct **p_previous)
 {
-	struct hashbucket_struct *hb, *prev, **slot;
-	int hc;
+	struct hashbucket_struct *hb, *prev, **slot, **oslot;
+	int i;
 	
 	D(fprintf(stderr, "lookup(ht=%p, key=%p, &val=%p, &slot=%p, &bckt=%p, &prev=%p)\n",
 		p_ht, p_key, p_val, p_slot, p_bucket, p_previous); fflush(stderr));
 	
-	hc = p_ht->hash(p_key); /* find the slot for this key */
+	for(i = 0; i < RESIZE_STEP && p_ht->old_table != NULL; i++)
+		move_slot(p_ht);
 	hb = p_ht->table[hc%p_ht->size];
 	D(fprintf(stderr, "hb = table[%zu] = %p\n", hc%p_ht->size, hb);
 		fflush(stderr));
@@ -280,7 +1059,8 @@ static int lookup(hashtable *p_ht, const void *p_key, void **p_val,
 			fflush(stderr));
 		if(hb->tag != HASHBUCKET_TAG)
 			return 4;
-		if(p_ht->comp(p_key, hb->key) == 0)
+		PROBED(1);
+		if(hb->hash == hc && p_comp(p_key, hb->key) == 0)
 			break;
 		D(fprintf(stderr, "  next=%p\n", hb->link); fflush(stderr));
 		prev = hb;
@@ -289,7 +1069,23 @@ static int lookup(hashtable *p_ht, const void *p_key, void **p_val,
 	
 	if(hb == NULL && p_ht->old_table != NULL && p_ht->old_size > 0)
 	{ /* look in the old table, move bucket to new table if found */
-		/*** IMPLEMENT ME! */
+		oslot = &(p_ht->old_table[hc%p_ht->old_size]);
+		for(hb = *oslot; hb != NULL; oslot = &hb->link, hb = hb->link)
+		{
+			if(hb->tag != HASHBUCKET_TAG)
+				return 4;
+			PROBED(1);
+			if(hb->hash == hc && p_comp(p_key, hb->key) == 0)
+				break;
+		}
+		if(hb != NULL)
+		{
+			D(fprintf(stderr, "  found in old table, moved\n"); fflush(stderr));
+			*oslot = hb->link;
+			hb->link = *slot;
+			*slot = hb;
+			prev = NULL;
+		}
 	}
 	
 	/* fill in slot and bucket parameters, even if no bucket was found */
@@ -322,17 +1118,29 @@ static int lookup(hashtable *p_ht, const void *p_key, void **p_val,
 int ht_insert(hashtable *p_ht, const void *p_key, void *p_val)
 {
 	struct hashbucket_struct *hb = NULL, **slot = NULL;
+	unsigned int hc;
+	int rv;
 	
 	D(fprintf(stderr, "ht_insert(ht=%p, key=%p, val=%p)\n", p_ht, p_key, p_val);
 		fflush(stderr));
 	if(p_ht == NULL || p_ht->tag != HASHTABLE_TAG)
 		return 1;
-	
-	/*** IMPLEMENT ME! check table for 'fullness' and resize if necessary */
+	if(IS_FLAT(p_ht) && p_ht->concurrent)
+	{
+		pthread_mutex_lock(&p_ht->lock);
+		rv = flat_insert(p_ht, p_key, p_val);
+		reclaim(p_ht, 0);
+		pthread_mutex_unlock(&p_ht->lock);
+		return rv;
+	}
+	if(IS_FLAT(p_ht))
+		return flat_insert(p_ht, p_key, p_val);
 	
 	D(fprintf(stderr, "call lookup(ht, key, NULL, &slot=%p, NULL, NULL)\n",
 		&slot);fflush(stderr));
-	if(lookup(p_ht, p_key, NULL, &slot, &hb, NULL) > 0) /* find slot for key */
+	hc = p_ht->hash(p_key);
+	if(lookup(p_ht, p_key, hc, p_ht->comp, NULL, &slot, &hb,
+		NULL) > 0) /* find slot for key */
 		return 2;
 	if(slot == NULL)
 		return 3; /* no slot found (this shouldn't happen) */
@@ -380,11 +1188,14 @@ int ht_insert(hashtable *p_ht, const void *p_key, void *p_val)
 	/* add bucket to selected table slot bucket list */
 	hb->val = p_val;
 	hb->key = p_key;
+	hb->hash = hc;
 	hb->link = *slot;
 	*slot = hb;
 	hb->tag = HASHBUCKET_TAG;
 	
 	p_ht->item_count++;
+	if(p_ht->item_count > p_ht->size*RESIZE_LOAD)
+		grow(p_ht); /* check table for 'fullness' and resize if necessary */
 	
 	return 0;
 }
@@ -394,15 +1205,27 @@ int ht_insert(hashtable *p_ht, const void *p_key, void *p_val)
 int ht_remove(hashtable *p_ht, const void *p_key, void **p_val)
 {
 	struct hashbucket_struct *hb, *prev, **slot;
+	int rv;
 	
 	D(fprintf(stderr, "ht_remove(ht=%p, key=%p, &val=%p)\n:",
 		p_ht, p_key, p_val);fflush(stderr));
 	if(p_ht == NULL || p_ht->tag != HASHTABLE_TAG)
 		return 1; /* no valid hashtable provided */
+	if(IS_FLAT(p_ht) && p_ht->concurrent)
+	{
+		pthread_mutex_lock(&p_ht->lock);
+		rv = flat_remove(p_ht, p_key, p_val);
+		reclaim(p_ht, 0);
+		pthread_mutex_unlock(&p_ht->lock);
+		return rv;
+	}
+	if(IS_FLAT(p_ht))
+		return flat_remove(p_ht, p_key, p_val);
 	
 	D(fprintf(stderr, "call lookup(%p, %p, %p, %p, %p, %p)\n", p_ht, p_key,
 		p_val, &slot, &hb, &prev); fflush(stderr));
-	if(lookup(p_ht, p_key, p_val, &slot, &hb, &prev) != 0) /* find bucket with key */
+	if(lookup(p_ht, p_key, p_ht->hash(p_key), p_ht->comp, p_val, &slot, &hb,
+		&prev) != 0) /* find bucket with key */
 		return 2; /* lookup failed */
 	
 	D(fprintf(stderr, "hb=%p, kdel=%p, vdel=%p\n", hb, p_ht->kdel, p_ht->vdel);
@@ -444,10 +1267,13 @@ int ht_lookup(hashtable *p_ht, const void *p_key, void **p_val)
 		fflush(stderr));
 	if(p_ht == NULL || p_ht->tag != HASHTABLE_TAG)
 		return 1;
+	if(IS_FLAT(p_ht))
+		return ht_lookup_hash(p_ht, p_key, p_ht->hash(p_key), p_ht->comp, p_val);
 	
 	D(fprintf(stderr, "call lookup(%p, %p, %p, NULL, %p, NULL)\n", p_ht, p_key,
 		p_val, &hb); fflush(stderr));
-	if(lookup(p_ht, p_key, p_val, NULL, &hb, NULL) != 0) /* find bucket with key */
+	if(lookup(p_ht, p_key, p_ht->hash(p_key), p_ht->comp, p_val, NULL, &hb,
+		NULL) != 0) /* find bucket with key */
 		return 2;
 	
 	D(fprintf(stderr, "hb=%p\n", hb); fflush(stderr));
@@ -457,6 +1283,44 @@ int ht_lookup(hashtable *p_ht, const void *p_key, void **p_val)
 	return 0;
 }
 
+/* lookup a key that may be of another type than the table's keys, given
+** the hash code the table's hash function gives the equal table key and a
+** function comparing the key (first parameter) with a table key. Returns
+** 0 (zero) on success, non-zero on failure */
+int ht_lookup_hash(hashtable *p_ht, const void *p_key, unsigned int p_hc,
+	int (*p_comp)(const void *key, const void *tkey), void **p_val)
+{
+	struct hashbucket_struct *hb;
+	long i;
+	
+	D(fprintf(stderr, "ht_lookup_hash(ht=%p, key=%p, hc=%u, val=%p)\n", p_ht,
+		p_key, p_hc, p_val); fflush(stderr));
+	if(p_ht == NULL || p_ht->tag != HASHTABLE_TAG || p_comp == NULL)
+		return 1;
+	
+	if(IS_FLAT(p_ht) && p_ht->concurrent)
+		return flat_read(p_ht, p_key, p_hc, p_comp, p_val);
+	if(IS_FLAT(p_ht))
+	{
+		i = flat_lookup(p_ht, p_key, p_hc, p_comp);
+		if(i < 0)
+		{
+			if(p_val != NULL)
+				*p_val = NULL;
+			return 3;
+		}
+		if(p_val != NULL)
+			*p_val = p_ht->flat->slot[i].val;
+		return 0;
+	}
+	if(lookup(p_ht, p_key, p_hc, p_comp, p_val, NULL, &hb, NULL) != 0)
+		return 2;
+	if(hb == NULL)
+		return 3;
+	
+	return 0;
+}
+
 /* apply a user-supplied function to each entry in the hashtable */
 int ht_iterate(hashtable *p_ht, int (*p_func)(unsigned long slot,
 	const void *key, void *val), int *p_rv)
@@ -474,6 +1338,26 @@ int ht_iterate(hashtable *p_ht, int (*p_func)(unsigned long slot,
 	if(p_func == NULL)
 		return 0;
 	
+	if(IS_FLAT(p_ht) && p_ht->concurrent)
+	{
+		struct hashreader_struct *r;
+		
+		if((r = read_begin()) == NULL)
+			return 2;
+		rv = flat_iterate(__atomic_load_n(&p_ht->flat, __ATOMIC_ACQUIRE),
+			p_func, p_rv);
+		read_end(r);
+		return rv;
+	}
+	if(IS_FLAT(p_ht))
+	{
+		if(flat_iterate(p_ht->flat, p_func, p_rv) != 0)
+			return 5;
+		if(p_ht->old_flat != NULL)
+			return flat_iterate(p_ht->old_flat, p_func, p_rv);
+		return 0;
+	}
+	
 	D(fprintf(stderr, "%zu slots\n", p_ht->size);fflush(stderr));
 	for(i = 0; i < p_ht->size; i++)
 	{ /* for each slot in the table, iterate over each bucket in the list */
@@ -522,6 +1406,51 @@ int ht_iterate(hashtable *p_ht, int (*p_func)(unsigned long slot,
 	return 0;
 }
 
+/* let several threads use an open addressing table at once */
+int ht_concurrent(hashtable *p_ht)
+{
+	if(p_ht == NULL || p_ht->tag != HASHTABLE_TAG || !IS_FLAT(p_ht))
+		return 1;
+	if(p_ht->concurrent)
+		return 0;
+	while(p_ht->old_flat != NULL)
+		flat_move_group(p_ht); /* readers mustn't have to move items */
+	if(pthread_mutex_init(&p_ht->lock, NULL) != 0)
+		return 2;
+	p_ht->concurrent = 1;
+	
+	return 0;
+}
+
+/* the groups and buckets this thread's lookups have examined */
+unsigned long ht_probes(void)
+{
+#ifdef __GNUC__
+	return G_probes;
+#else
+	return 0;
+#endif
+}
+
+/* keep the values found in concurrent tables from being deleted until
+** ht_read_end(), returns 0 (zero) on success, non-zero on failure */
+int ht_read_begin(void)
+{
+	return read_begin() == NULL;
+}
+
+void ht_read_end(void)
+{
+	struct hashreader_struct *r;
+	
+	pthread_once(&G_readers_once, reader_key);
+	r = (struct hashreader_struct*)pthread_getspecific(G_reader_key);
+	if(r != NULL && r->depth > 0)
+		read_end(r);
+	
+	return;
+}
+
 #ifdef HASHTABLE_TEST
 
 #include <stdio.h>
@@ -553,11 +1482,13 @@ int comp(const void *p_key1, const void *p_key2)
 
 void kdel(const void *p_key)
 {
+	(void)p_key;
 	return;
 }
 
 void vdel(void *p_val)
 {
+	(void)p_val;
 	return;
 }
 
@@ -574,6 +1505,8 @@ int iter(unsigned long slot, const void *p_key, void *p_val)
 {
 	int i;
 	
+	(void)slot;
+	(void)p_val;
 	printf(".");fflush(stdout);
 	iteration++;
 	for(i = 0; i < entries; i++)
@@ -595,7 +1528,10 @@ int main(int args, char *arg[])
 	printf("Hashtable Test Program\n");
 	fflush(stdout);
 	
-	ht = ht_create(HTSIZE, hash, comp, kdel, vdel);
+	if(args > 1 && strcmp(arg[1], "-flat") == 0)
+		ht = ht_create_flat(HTSIZE, hash, comp, kdel, vdel);
+	else
+		ht = ht_create(HTSIZE, hash, comp, kdel, vdel);
 	if(ht == NULL)
 		return 1;
 	printf("hashtable created successfully\n");
@@ -605,8 +1541,8 @@ int main(int args, char *arg[])
 	fflush(stdout);
 	for(i = 0; i < entries; i++)
 	{
-		sprintf(key[i], "%c%c%c%3.3d", 'A'+random()%26, 'A'+random()%26,
-			'A'+random()%26, i+123);
+		sprintf(key[i], "%c%c%c%3.3d", (int)('A'+random()%26),
+			(int)('A'+random()%26), (int)('A'+random()%26), i+123);
 		value[i] = random();
 		del[i] = 0;
 		if(ht_insert(ht, (void*)(key[i]), (void*)&(value[i])))
@@ -633,8 +1569,9 @@ int main(int args, char *arg[])
 		{
 		case 1: /* lookup a non-existing value */
 			printf("x");fflush(stdout);
-			sprintf(k, "%3.3d%c%c%c", 123+random()%100, 'A'+random()%26,
-				'A'+random()%26, 'A'+random()%26);
+			sprintf(k, "%3.3d%c%c%c", (int)(123+random()%100),
+				(int)('A'+random()%26), (int)('A'+random()%26),
+				(int)('A'+random()%26));
 			D(printf("(%s) ", k);fflush(stdout));
 			if(ht_lookup(ht, (void*)k, (void*)&v) == 0)
 			{
@@ -649,7 +1586,7 @@ int main(int args, char *arg[])
 			D(printf("(%d,%s) ", del[n], key[n]);fflush(stdout));
 			if(del[n] == 0)
 			{
-				long *v;
+				int *v;
 				
 				if(ht_lookup(ht, (void*)(key[n]), (void*)&v) != 0)
 				{
@@ -721,3 +1658,349 @@ int main(int args, char *arg[])
 }
 
 #endif
+
+#ifdef HASHTABLE_BENCH
+
+/* hashtable benchmark: times inserts, lookups that hit and miss, removes
+** and iterations, for each backend, hash function and kind of key, over
+** tables of 100 to 10,000,000 keys. Memory per entry is the growth of the
+** heap while the keys are inserted (the keys themselves are allocated
+** beforehand, so they aren't counted) */
+
+#include <stdio.h>
+#include <time.h>
+#include <malloc.h>
+
+/* hash functions */
+static unsigned int fnv1a(const void *p_key)
+{
+	const unsigned char *k;
+	unsigned int h = 2166136261U;
+	
+	for(k = (const unsigned char*)p_key; *k; k++)
+		h = (h^*k)*16777619U;
+	
+	return h;
+}
+
+static unsigned int djb2(const void *p_key)
+{
+	const unsigned char *k;
+	unsigned int h = 5381;
+	
+	for(k = (const unsigned char*)p_key; *k; k++)
+		h = h*33+*k;
+	
+	return h;
+}
+
+/* the hash function of libeval 1.0 */
+static unsigned int shift(const void *p_key)
+{
+	const char *k = (const char*)p_key;
+	int i, h = 0;
+	
+	for(i = 0; k[i] && i < 32; i++)
+		h += k[i]<<i;
+	
+	return h;
+}
+
+static const struct
+{
+	const char *name;
+	unsigned int (*hash)(const void *key);
+} G_hashes[] = {{"fnv1a", fnv1a}, {"djb2", djb2}, {"shift", shift}};
+#define NHASHES ((int)(sizeof(G_hashes)/sizeof(G_hashes[0])))
+
+static const char *G_backends[] = {"chain", "flat", "concurrent"};
+#define NBACKENDS ((int)(sizeof(G_backends)/sizeof(G_backends[0])))
+
+/* kinds of keys, shaped like variable names: sequential suffixes
+** (cpu_0, cpu_1, ...), random names and long shared prefixes */
+static const char *G_keys[] = {"seq", "random", "prefix"};
+#define NKEYS ((int)(sizeof(G_keys)/sizeof(G_keys[0])))
+
+static int comp(const void *p_key1, const void *p_key2)
+{
+	return strcmp((const char*)p_key1, (const char*)p_key2);
+}
+
+static unsigned long G_seed = 88172645463325252UL;
+
+static unsigned long xorshift(void)
+{
+	G_seed ^= G_seed<<13;
+	G_seed ^= G_seed>>7;
+	G_seed ^= G_seed<<17;
+	
+	return G_seed;
+}
+
+/* make n keys of a kind, in one block of text, returns the key pointers
+** (key[0] points to the start of the block), or NULL if out of memory */
+static char **make_keys(int kind, unsigned long n)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+	char **key, *text;
+	unsigned long i, pos = 0;
+	int len, j;
+	
+	key = (char**)malloc(sizeof(char*)*n);
+	text = (char*)malloc(48*n);
+	if(key == NULL || text == NULL)
+	{
+		free(key);
+		free(text);
+		return NULL;
+	}
+	for(i = 0; i < n; i++)
+	{
+		key[i] = text+pos;
+		if(kind == 0)
+			len = sprintf(key[i], "cpu_%lu", i);
+		else if(kind == 1)
+		{
+			len = 6+xorshift()%15;
+			key[i][0] = chars[xorshift()%26];
+			for(j = 1; j < len; j++)
+				key[i][j] = chars[xorshift()%(sizeof(chars)-1)];
+			key[i][len] = '\0';
+		}else
+			len = sprintf(key[i], "region.eu.west.latency_p99.host_%lu", i);
+		pos += len+1;
+	}
+	
+	return key;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static size_t heap_used(void)
+{
+	struct mallinfo2 mi;
+	
+	mi = mallinfo2();
+	
+	return mi.uordblks+mi.hblkhd;
+}
+
+static int count(unsigned long slot, const void *key, void *val)
+{
+	(void)slot;
+	(void)key;
+	(void)val;
+	
+	return 0;
+}
+
+/* the results of one benchmark, ns per operation */
+typedef struct
+{
+	double insert, hit, miss, remove, iterate;
+	double bytes; /* heap bytes per entry */
+} Result;
+
+/* benchmark a backend and hash function over n keys, the keys to insert
+** are the even numbered keys of key[], the odd ones are the misses. The
+** table starts small, so the inserts include its growth. Small tables are
+** filled and emptied again and again, for up to 2,000,000 operations of
+** each kind or about a second. Returns 0 (zero) on success, non-zero on
+** failure */
+static int bench(int backend, int hash, char **key, unsigned long n,
+	const unsigned long *order, Result *res)
+{
+	hashtable *ht;
+	unsigned long i, reps, r;
+	double t, t_ins = 0, t_hit = 0, t_miss = 0, t_rem = 0, t_iter = 0;
+	size_t before;
+	void *val;
+	int rv;
+	
+	reps = n < 2000000 ? 2000000/n : 1;
+	res->bytes = 0;
+	for(r = 0; r < reps; r++)
+	{
+		before = heap_used();
+		if(backend == 0)
+			ht = ht_create(16, G_hashes[hash].hash, comp, NULL, NULL);
+		else
+			ht = ht_create_flat(16, G_hashes[hash].hash, comp, NULL, NULL);
+		if(ht == NULL || (backend == 2 && ht_concurrent(ht)))
+			return 1;
+		
+		t = now();
+		for(i = 0; i < n; i++)
+			if(ht_insert(ht, key[2*i], key[2*i]))
+				return 2;
+		t_ins += now()-t;
+		if(r == 0)
+			res->bytes = (double)(heap_used()-before)/n;
+		
+		t = now();
+		for(i = 0; i < n; i++)
+			if(ht_lookup(ht, key[2*order[i]], &val) || val != key[2*order[i]])
+				return 3;
+		t_hit += now()-t;
+		
+		t = now();
+		for(i = 0; i < n; i++)
+			if(ht_lookup(ht, key[2*order[i]+1], &val) == 0)
+				return 4;
+		t_miss += now()-t;
+		
+		t = now();
+		if(ht_iterate(ht, count, &rv))
+			return 5;
+		t_iter += now()-t;
+		
+		t = now();
+		for(i = 0; i < n; i++)
+			if(ht_remove(ht, key[2*order[i]], NULL))
+				return 6;
+		t_rem += now()-t;
+		
+		ht_delete(ht);
+		if(t_ins+t_hit+t_miss+t_iter+t_rem > 1.0)
+			reps = r+1; /* a slow table, this is enough */
+	}
+	res->insert = t_ins*1e9/(n*reps);
+	res->hit = t_hit*1e9/(n*reps);
+	res->miss = t_miss*1e9/(n*reps);
+	res->iterate = t_iter*1e9/(n*reps);
+	res->remove = t_rem*1e9/(n*reps);
+	
+	return 0;
+}
+
+/* index of name in a list of names, -1 if not found */
+static int find(const char *name, const char **names, int count)
+{
+	int i;
+	
+	for(i = 0; i < count; i++)
+		if(strcmp(name, names[i]) == 0)
+			return i;
+	
+	return -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: htbench [-min keys] [-max keys] [-backend chain|flat|"
+		"concurrent]\n\t[-hash fnv1a|djb2|shift] [-keys seq|random|prefix]\n");
+	
+	return;
+}
+
+int main(int args, char *arg[])
+{
+	const char *hash_names[NHASHES];
+	unsigned long n, min = 100, max = 10000000, *order, i, j, tmp;
+	int backend = -1, hash = -1, keys = -1, b, h, k, a, err;
+	char **key;
+	Result res;
+	
+	for(h = 0; h < NHASHES; h++)
+		hash_names[h] = G_hashes[h].name;
+	for(a = 1; a < args; a++)
+	{
+		if(a+1 < args && strcmp(arg[a], "-min") == 0)
+			min = (unsigned long)atof(arg[++a]);
+		else if(a+1 < args && strcmp(arg[a], "-max") == 0)
+			max = (unsigned long)atof(arg[++a]);
+		else if(a+1 < args && strcmp(arg[a], "-backend") == 0)
+		{
+			if((backend = find(arg[++a], G_backends, NBACKENDS)) < 0)
+				break;
+		}else if(a+1 < args && strcmp(arg[a], "-hash") == 0)
+		{
+			if((hash = find(arg[++a], hash_names, NHASHES)) < 0)
+				break;
+		}else if(a+1 < args && strcmp(arg[a], "-keys") == 0)
+		{
+			if((keys = find(arg[++a], G_keys, NKEYS)) < 0)
+				break;
+		}else
+			break;
+	}
+	if(a < args || min < 1 || max < min)
+	{
+		usage();
+		return 1;
+	}
+	
+	printf("hashtable benchmark, ns per operation, memory excludes the keys\n");
+	printf("%-10s %-5s %-6s %8s %8s %8s %8s %8s %8s %11s\n", "backend",
+		"hash", "keys", "entries", "insert", "hit", "miss", "remove",
+		"iterate", "bytes/entry");
+	fflush(stdout);
+	for(k = 0; k < NKEYS; k++)
+	{
+		if(keys >= 0 && k != keys)
+			continue;
+		for(b = 0; b < NBACKENDS; b++)
+		{
+			if(backend >= 0 && b != backend)
+				continue;
+			for(h = 0; h < NHASHES; h++)
+			{
+				if(hash >= 0 && h != hash)
+					continue;
+				for(n = min; n <= max; n *= 10)
+				{
+					G_seed = 88172645463325252UL; /* same keys every time */
+					key = make_keys(k, 2*n);
+					order = (unsigned long*)malloc(sizeof(unsigned long)*n);
+					if(key == NULL || order == NULL)
+					{
+						fprintf(stderr, "out of memory for %lu keys\n", n);
+						return 2;
+					}
+					for(i = 0; i < n; i++)
+						order[i] = i;
+					for(i = n-1; i > 0; i--)
+					{ /* look the keys up in random order */
+						j = xorshift()%(i+1);
+						tmp = order[i];
+						order[i] = order[j];
+						order[j] = tmp;
+					}
+					err = bench(b, h, key, n, order, &res);
+					free(key[0]);
+					free(key);
+					free(order);
+					if(err)
+					{
+						fprintf(stderr, "%s %s %s %lu: failed (%d)\n",
+							G_backends[b], G_hashes[h].name, G_keys[k], n, err);
+						return 3;
+					}
+					printf("%-10s %-5s %-6s %8lu %8.1f %8.1f %8.1f %8.1f %8.1f "
+						"%11.1f\n", G_backends[b], G_hashes[h].name, G_keys[k],
+						n, res.insert, res.hit, res.miss, res.remove,
+						res.iterate, res.bytes);
+					fflush(stdout);
+					if(res.insert > 5000 || res.hit > 5000)
+					{ /* the hash degenerates, larger tables take too long */
+						if(n*10 <= max)
+							printf("%-10s %-5s %-6s skipping larger tables\n",
+								G_backends[b], G_hashes[h].name, G_keys[k]);
+						break;
+					}
+				}
+			}
+		}
+	}
+	
+	return 0;
+}
+
+#endif
@@ -22,7 +22,8 @@
 
 typedef struct hashtable_struct hashtable;
 
-/* create an empty hashtable with p_size slots, the p_hash() function is used
+/* create an empty hashtable with p_size slots (the table grows, a little at
+** a time, as items are inserted), the p_hash() function is used
 ** to generate a slot number (hash code) given a key value, the p_comp()
 ** function is used to compare two key values, returning -1 if key1 is less
 ** than key2, 0 if the two keys are equal and 1 if key1 is greater than key2,
@@ -35,6 +36,18 @@ hashtable *ht_create(unsigned long p_size,
 	void (*p_kdel)(const void *key),
 	void (*p_vdel)(void *val));
 
+/* create an empty hashtable like ht_create(), but with open addressing:
+** the keys and values are kept in an array of slots that is searched 16
+** slots at a time, using a control byte per slot that holds part of the
+** key's hash code, instead of chains of buckets. Room is made for p_size
+** items, and the table grows as items are inserted. The tables returned by
+** ht_create() and ht_create_flat() are used with the same functions */
+hashtable *ht_create_flat(unsigned long p_size,
+	unsigned int (*p_hash)(const void *key),
+	int (*p_comp)(const void *key1,const void *key2),
+	void (*p_kdel)(const void *key),
+	void (*p_vdel)(void *val));
+
 /* delete the entire table, calling the kdel and vdel functions
 ** provided to ht_create as needed, return 0 (zero) on success,
 ** non-zero otherwise */
@@ -51,6 +64,14 @@ int ht_remove(hashtable *p_ht, const void *p_key, void **p_val);
 /* lookup key in table, return 0 (zero) if found, non-zero otherwise */
 int ht_lookup(hashtable *p_ht, const void *p_key, void **p_val);
 
+/* lookup a key that needn't be the same type as the table's keys (a string
+** that isn't null terminated, say). p_hc is the hash code the table's hash
+** function gives the matching table key, p_comp() compares p_key with a
+** table key, returning 0 (zero) if they match. Returns 0 (zero) if found,
+** non-zero otherwise */
+int ht_lookup_hash(hashtable *p_ht, const void *p_key, unsigned int p_hc,
+	int (*p_comp)(const void *key, const void *tkey), void **p_val);
+
 /* iterate over the entries in the hashtable calling the provided function
 ** (p_func) for each entry. The p_func() function takes three parameters:
 ** the slot number of the current key-value pair, the key and the value.
@@ -60,4 +81,27 @@ int ht_lookup(hashtable *p_ht, const void *p_key, void **p_val);
 int ht_iterate(hashtable *p_ht, int (*p_func)(unsigned long slot,
 	const void *key, void *val), int *p_rv);
 
+/* let several threads use a table made by ht_create_flat() at once:
+** lookups and iterations never take a lock or wait for another thread
+** (after a thread's first lookup) and can go on while other threads insert
+** and remove, which take turns. Keys and values removed or replaced are
+** only passed to the kdel and vdel functions once every lookup that might
+** have found them is done, so a value found by ht_lookup() may be deleted
+** as soon as ht_lookup() returns unless the lookup is made between
+** ht_read_begin() and ht_read_end(). Call ht_concurrent() before the table
+** is shared; there is no going back. Returns 0 (zero) on success, non-zero
+** on failure (tables made by ht_create() can't be made concurrent) */
+int ht_concurrent(hashtable *p_ht);
+
+/* begin and end a read of concurrent tables, the values found between the
+** two calls aren't deleted before ht_read_end() is called. The calls can be
+** nested. ht_read_begin() returns 0 (zero) on success, non-zero on failure */
+int ht_read_begin(void);
+void ht_read_end(void);
+
+/* the number of groups (open addressing) and buckets (chained) the calling
+** thread's lookups have examined so far; the difference between two calls
+** is what the lookups in between cost. Always 0 (zero) without GCC */
+unsigned long ht_probes(void);
+
 #endif
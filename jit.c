@@ -0,0 +1,304 @@
+/*
+** simple expression evaluator library (x86-64 native code generator)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* the code generator translates compiled expression code, one instruction
+** at a time, into x86-64 SSE2 machine code in an mmap()'d page. Registers
+** stay in the register file (addressed through rbx), so the generated code
+** is a straight line of loads, arithmetic and stores with direct calls to
+** libm and user functions. The generated function has the prototype
+**
+**   int native(double *reg, double *argv, double *result);
+**
+** and returns the same error codes as vm_run(). On anything other than
+** x86-64 unix (or with -DEVAL_NO_JIT) jit_compile() always fails, and the
+** compiled expression is run by the interpreter. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "evalcode.h"
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(EVAL_NO_JIT)
+
+#include <sys/mman.h>
+
+typedef struct
+{
+	unsigned char *buf; /* code buffer */
+	size_t len; /* bytes emitted */
+	size_t size; /* bytes of the buffer */
+	int full; /* set if the code didn't fit, nothing more is emitted */
+} Emitter;
+
+static void emit(Emitter *e, const void *bytes, int n)
+{
+	if(e->full || (size_t)n > e->size-e->len)
+	{ /* instr_size() is wrong, the caller gives up */
+		e->full = 1;
+		return;
+	}
+	memcpy(e->buf+e->len, bytes, n);
+	e->len += n;
+	return;
+}
+
+static void emit32(Emitter *e, int v)
+{
+	emit(e, &v, 4);
+	return;
+}
+
+static void emit64(Emitter *e, const void *v)
+{
+	emit(e, v, 8);
+	return;
+}
+
+/* mov rax, imm64 (the 8 bytes at imm) */
+static void emit_mov_rax(Emitter *e, const void *imm)
+{
+	emit(e, "\x48\xb8", 2);
+	emit64(e, imm);
+	return;
+}
+
+/* jmp or jcc to an earlier position in the code */
+static void emit_jump_back(Emitter *e, const char *op, int oplen, size_t target)
+{
+	emit(e, op, oplen);
+	emit32(e, (int)(target-(e->len+4)));
+	return;
+}
+
+/* movsd xmmN, [rbx+8*reg] */
+static void emit_load(Emitter *e, int xmm, int reg)
+{
+	char modrm = (char)(0x83|(xmm<<3));
+	
+	emit(e, "\xf2\x0f\x10", 3);
+	emit(e, &modrm, 1);
+	emit32(e, reg*8);
+	return;
+}
+
+/* movsd [rbx+8*reg], xmm0 */
+static void emit_store(Emitter *e, int reg)
+{
+	emit(e, "\xf2\x0f\x11\x83", 4);
+	emit32(e, reg*8);
+	return;
+}
+
+/* jump to the error exit if xmm1 is zero (NaN is not zero) */
+static void emit_zero_check(Emitter *e, size_t err)
+{
+	emit(e, "\x66\x0f\x57\xd2", 4); /* xorpd xmm2, xmm2 */
+	emit(e, "\x66\x0f\x2e\xca", 4); /* ucomisd xmm1, xmm2 */
+	emit(e, "\x7a\x06", 2); /* jp +6 (unordered) */
+	emit_jump_back(e, "\x0f\x84", 2, err); /* je err */
+	return;
+}
+
+/* upper bound on the bytes of code generated for an instruction: a call
+** is 45 bytes plus 18 (a load and a store) for each argument */
+static size_t instr_size(const eval_compiled *ce, const Instr *ip)
+{
+	if(ip->op == OP_CALL)
+		return 64+18*(size_t)ce->call[ip->a].nargs;
+	return 64;
+}
+
+int jit_compile(eval_compiled *ce)
+{
+	static const char arith[] = { 0, 0x58, 0x5c, 0x59, 0x5e }; /* add sub mul div */
+	const double hundred = 100.0;
+	double (*libm)(double, double);
+	const double **slot;
+	Emitter e;
+	const Instr *ip;
+	const Call *c;
+	size_t size, exit_pos, div_err, fn_err, entry;
+	int i, j;
+	
+	size = 128;
+	for(i = 0; i < ce->ninstr; i++)
+		size += instr_size(ce, ce->code+i);
+	e.buf = (unsigned char*)mmap(NULL, size, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(e.buf == (unsigned char*)MAP_FAILED)
+		return 1;
+	e.len = 0;
+	e.size = size;
+	e.full = 0;
+	
+	/* the exit and error paths come first, so that every jump to them is
+	** a backward jump to a known address and nothing needs patching */
+	exit_pos = e.len;
+	emit(&e, "\x41\x5d\x41\x5c\x5b\xc3", 6); /* pop r13, pop r12, pop rbx, ret */
+	div_err = e.len;
+	emit(&e, "\xb8", 1); /* mov eax, EVAL_DIVIDE_BY_ZERO */
+	emit32(&e, EVAL_DIVIDE_BY_ZERO);
+	emit_jump_back(&e, "\xe9", 1, exit_pos);
+	fn_err = e.len;
+	emit(&e, "\xb8", 1); /* mov eax, EVAL_FUNCTION_ERROR */
+	emit32(&e, EVAL_FUNCTION_ERROR);
+	emit_jump_back(&e, "\xe9", 1, exit_pos);
+	
+	/* three pushes realign the stack to 16 bytes for the calls we make */
+	entry = e.len;
+	emit(&e, "\x53\x41\x54\x41\x55", 5); /* push rbx, push r12, push r13 */
+	emit(&e, "\x48\x89\xfb", 3); /* mov rbx, rdi (registers) */
+	emit(&e, "\x49\x89\xf4", 3); /* mov r12, rsi (argument scratch) */
+	emit(&e, "\x49\x89\xd5", 3); /* mov r13, rdx (result) */
+	
+	for(i = 0, ip = ce->code; i < ce->ninstr; i++, ip++)
+	{
+		switch(ip->op)
+		{
+		case OP_LOADV: /* load through the slot, it may be rebound */
+			slot = ce->var+ip->a;
+			emit_mov_rax(&e, &slot);
+			emit(&e, "\x48\x8b\x00", 3); /* mov rax, [rax] */
+			emit(&e, "\xf2\x0f\x10\x00", 4); /* movsd xmm0, [rax] */
+			emit_store(&e, ip->dst);
+			break;
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+			emit_load(&e, 0, ip->a);
+			emit(&e, "\xf2\x0f", 2); /* addsd/subsd/mulsd xmm0, [rbx+8*b] */
+			emit(&e, arith+ip->op, 1);
+			emit(&e, "\x83", 1);
+			emit32(&e, ip->b*8);
+			emit_store(&e, ip->dst);
+			break;
+		case OP_DIV:
+			emit_load(&e, 1, ip->b);
+			emit_zero_check(&e, div_err);
+			emit_load(&e, 0, ip->a);
+			emit(&e, "\xf2\x0f\x5e\xc1", 4); /* divsd xmm0, xmm1 */
+			emit_store(&e, ip->dst);
+			break;
+		case OP_MOD:
+		case OP_POW:
+			emit_load(&e, 1, ip->b);
+			if(ip->op == OP_MOD)
+				emit_zero_check(&e, div_err);
+			emit_load(&e, 0, ip->a);
+			libm = ip->op == OP_MOD ? fmod : pow;
+			emit_mov_rax(&e, &libm);
+			emit(&e, "\xff\xd0", 2); /* call rax */
+			emit_store(&e, ip->dst);
+			break;
+		case OP_NEG: /* flip the sign bit, like the interpreter's -x */
+			emit(&e, "\x48\x8b\x83", 3); /* mov rax, [rbx+8*a] */
+			emit32(&e, ip->a*8);
+			emit(&e, "\x48\x0f\xba\xf8\x3f", 5); /* btc rax, 63 */
+			emit(&e, "\x48\x89\x83", 3); /* mov [rbx+8*dst], rax */
+			emit32(&e, ip->dst*8);
+			break;
+		case OP_PCT:
+			emit_load(&e, 0, ip->a);
+			emit_mov_rax(&e, &hundred);
+			emit(&e, "\x66\x48\x0f\x6e\xc8", 5); /* movq xmm1, rax */
+			emit(&e, "\xf2\x0f\x5e\xc1", 4); /* divsd xmm0, xmm1 */
+			emit_store(&e, ip->dst);
+			break;
+		case OP_CALL: /* copy the arguments, functions may modify them */
+			c = ce->call+ip->a;
+			for(j = 0; j < c->nargs; j++)
+			{
+				emit_load(&e, 0, c->arg[j]);
+				emit(&e, "\xf2\x41\x0f\x11\x84\x24", 6); /* movsd [r12+8*j], xmm0 */
+				emit32(&e, j*8);
+			}
+			emit(&e, "\xbf", 1); /* mov edi, nargs */
+			emit32(&e, c->nargs);
+			emit(&e, "\x4c\x89\xe6", 3); /* mov rsi, r12 */
+			emit(&e, "\x48\x8d\x93", 3); /* lea rdx, [rbx+8*dst] */
+			emit32(&e, ip->dst*8);
+			emit(&e, "\x48\xb9", 2); /* mov rcx, data */
+			emit64(&e, &c->data);
+			emit_mov_rax(&e, &c->fn);
+			emit(&e, "\xff\xd0", 2); /* call rax */
+			emit(&e, "\x85\xc0", 2); /* test eax, eax */
+			emit_jump_back(&e, "\x0f\x85", 2, fn_err); /* jne fn_err */
+			break;
+		case OP_RET:
+			emit_load(&e, 0, ip->a);
+			emit(&e, "\x4d\x85\xed", 3); /* test r13, r13 */
+			emit(&e, "\x74\x06", 2); /* je +6 */
+			emit(&e, "\xf2\x41\x0f\x11\x45\x00", 6); /* movsd [r13], xmm0 */
+			emit(&e, "\x31\xc0", 2); /* xor eax, eax */
+			emit_jump_back(&e, "\xe9", 1, exit_pos);
+			break;
+		default: /* unknown opcode, leave it to the interpreter */
+			munmap(e.buf, size);
+			return 2;
+		}
+	}
+	
+	if(e.full)
+	{ /* leave it to the interpreter */
+		munmap(e.buf, size);
+		return 4;
+	}
+	if(mprotect(e.buf, size, PROT_READ|PROT_EXEC) != 0)
+	{
+		munmap(e.buf, size);
+		return 3;
+	}
+	jit_free(ce);
+	ce->native_mem = e.buf;
+	ce->native_size = size;
+	*(void**)(&ce->native) = e.buf+entry;
+	
+	return 0;
+}
+
+void jit_free(eval_compiled *ce)
+{
+	if(ce->native_mem != NULL)
+		munmap(ce->native_mem, ce->native_size);
+	ce->native = NULL;
+	ce->native_mem = NULL;
+	ce->native_size = 0;
+	
+	return;
+}
+
+#else /* no native code generator for this platform */
+
+int jit_compile(eval_compiled *ce)
+{
+	(void)ce;
+	return 1;
+}
+
+void jit_free(eval_compiled *ce)
+{
+	ce->native = NULL;
+	ce->native_mem = NULL;
+	ce->native_size = 0;
+	
+	return;
+}
+
+#endif
@@ -0,0 +1,639 @@
+/*
+** simple expression evaluator library (saved compiled expressions)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* a compiled expression is saved as a plan: its code, constants and call
+** table, with every pointer replaced by an index and every variable and
+** function by its name. Loading a plan checks it, copies it into a new
+** compiled expression and binds the names to a context (see code_bind()),
+** so nothing is parsed. The plan is in the machine's own byte order, a
+** plan from a machine with another order or sizes is rejected.
+**
+** The layout, all counts and indexes are ints:
+**   header: magic, version, byte order, sizes, bytes of the plan, nconst,
+**       ninstr, nvars, nfolded, ncalls, nargs, bytes of the names
+**   doubles: the constants, then the value of each folded constant
+**   code: op, dst, a and b of each instruction
+**   calls: argument count, name and pure flag of each call
+**   args: the argument registers of each call in turn
+**   vars: the name of each variable slot
+**   folded: the name and kind (FOLDED_*) of each name folded away
+**   names: the names, each null terminated, named by offset
+**
+** The plan cache (see eval_plan_cache()) keeps one file per expression
+** in a directory, named by the FNV-1a hash of the expression text. The
+** file holds the length of the text, the text and then the plan, so a
+** hash collision is just a miss. Files are written to a temporary name
+** and renamed, so readers never see half a file. Expressions that folded
+** away a call to a user's pure function aren't kept, as their plans never
+** load (see code_bind()). */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+
+#include "evalcode.h"
+
+#if defined(__unix__)
+#include <unistd.h>
+#define PLAN_MKSTEMP 1
+#endif
+
+#if defined(__GNUC__) && defined(__unix__) && !defined(EVAL_NO_THREADS)
+#include <pthread.h>
+#define PLAN_THREADS 1
+#endif
+
+#define PLAN_MAGIC 0x6e6c5045 /* EPln */
+#define PLAN_VERSION 2
+#define PLAN_ORDER 0x01020304
+#define PLAN_SIZES ((int)(sizeof(int)<<8 | sizeof(double)))
+#define PLAN_HEADER 12 /* ints */
+
+static char *G_plan_dir = NULL; /* plan cache directory, NULL if off */
+#ifdef PLAN_THREADS
+static pthread_mutex_t G_plan_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* a position in a plan being written or read */
+typedef struct
+{
+	unsigned char *out; /* NULL while reading */
+	const unsigned char *in;
+	size_t pos, size;
+} Cursor;
+
+/* the next n bytes of a plan being read, NULL if past the end */
+static const unsigned char *take(Cursor *c, size_t n)
+{
+	const unsigned char *p;
+	
+	if(c->pos > c->size || n > c->size-c->pos)
+		return NULL;
+	p = c->in+c->pos;
+	c->pos += n;
+	
+	return p;
+}
+
+static void put_int(Cursor *c, int v)
+{
+	memcpy(c->out+c->pos, &v, sizeof(int));
+	c->pos += sizeof(int);
+	
+	return;
+}
+
+static void put_double(Cursor *c, double v)
+{
+	memcpy(c->out+c->pos, &v, sizeof(double));
+	c->pos += sizeof(double);
+	
+	return;
+}
+
+/* the ints read from a plan, which may not be aligned, -1 past the end */
+static int get_int(Cursor *c)
+{
+	const unsigned char *p;
+	int v;
+	
+	if((p = take(c, sizeof(int))) == NULL)
+		return -1;
+	memcpy(&v, p, sizeof(int));
+	
+	return v;
+}
+
+static int get_double(Cursor *c, double *v)
+{
+	const unsigned char *p;
+	
+	if((p = take(c, sizeof(double))) == NULL)
+		return 1;
+	memcpy(v, p, sizeof(double));
+	
+	return 0;
+}
+
+/* the bytes of the names of a compiled expression */
+static size_t names_size(const eval_compiled *ce)
+{
+	size_t size = 0;
+	int i;
+	
+	for(i = 0; i < ce->nvars; i++)
+		size += strlen(ce->slot[i].name)+1;
+	for(i = 0; i < ce->ncalls; i++)
+		size += strlen(ce->call[i].name)+1;
+	for(i = 0; i < ce->nfolded; i++)
+		size += strlen(ce->folded[i].name)+1;
+	
+	return size;
+}
+
+/* copy a name into the names of a plan, returns its offset */
+static int put_name(Cursor *c, unsigned char *names, size_t *pos,
+	const char *name)
+{
+	size_t len = strlen(name)+1;
+	int off = (int)*pos;
+	
+	if(c->out != NULL)
+		memcpy(names+*pos, name, len);
+	*pos += len;
+	
+	return off;
+}
+
+/* public: save a compiled expression into a buffer */
+size_t eval_serialize(const eval_compiled *compiled, void *buf, size_t size)
+{
+	const eval_compiled *ce = compiled;
+	unsigned char *names;
+	size_t need, nsize, npos = 0;
+	Cursor c;
+	int nargs = 0, i, j;
+	
+	if(ce == NULL || ce->tag != COMPILED_TAG)
+		return 0;
+	for(i = 0; i < ce->ncalls; i++)
+		nargs += ce->call[i].nargs;
+	nsize = names_size(ce);
+	need = sizeof(int)*(PLAN_HEADER+4*ce->ninstr+3*ce->ncalls+nargs
+		+ce->nvars+2*ce->nfolded)
+		+sizeof(double)*(ce->nconst+ce->nfolded)+nsize;
+	if(buf == NULL || size < need || need > INT_MAX)
+		return need;
+	
+	c.out = (unsigned char*)buf;
+	c.in = NULL;
+	c.pos = 0;
+	c.size = need;
+	names = c.out+need-nsize;
+	put_int(&c, PLAN_MAGIC);
+	put_int(&c, PLAN_VERSION);
+	put_int(&c, PLAN_ORDER);
+	put_int(&c, PLAN_SIZES);
+	put_int(&c, (int)need);
+	put_int(&c, ce->nconst);
+	put_int(&c, ce->ninstr);
+	put_int(&c, ce->nvars);
+	put_int(&c, ce->nfolded);
+	put_int(&c, ce->ncalls);
+	put_int(&c, nargs);
+	put_int(&c, (int)nsize);
+	for(i = 0; i < ce->nconst; i++)
+		put_double(&c, ce->reg[i]);
+	for(i = 0; i < ce->nfolded; i++)
+		put_double(&c, ce->folded[i].value);
+	for(i = 0; i < ce->ninstr; i++)
+	{
+		put_int(&c, ce->code[i].op);
+		put_int(&c, ce->code[i].dst);
+		put_int(&c, ce->code[i].a);
+		put_int(&c, ce->code[i].b);
+	}
+	for(i = 0; i < ce->ncalls; i++)
+	{
+		put_int(&c, ce->call[i].nargs);
+		put_int(&c, put_name(&c, names, &npos, ce->call[i].name));
+		put_int(&c, ce->call[i].pure != 0);
+	}
+	for(i = 0; i < ce->ncalls; i++)
+		for(j = 0; j < ce->call[i].nargs; j++)
+			put_int(&c, ce->call[i].arg[j]);
+	for(i = 0; i < ce->nvars; i++)
+		put_int(&c, put_name(&c, names, &npos, ce->slot[i].name));
+	for(i = 0; i < ce->nfolded; i++)
+	{
+		put_int(&c, put_name(&c, names, &npos, ce->folded[i].name));
+		put_int(&c, ce->folded[i].fn);
+	}
+	
+	return need;
+}
+
+/* a name of a plan given its offset, NULL if it isn't one */
+static const char *get_name(Cursor *c, const char *names, int nsize)
+{
+	int off = get_int(c);
+	
+	if(off < 0 || off >= nsize)
+		return NULL;
+	
+	return names+off;
+}
+
+/* check that an instruction only reads registers written before it */
+static int bad_instr(const eval_compiled *ce, const Instr *in, int i)
+{
+	int j;
+	
+	if(in->op < 0 || in->op >= OP_COUNT || in->dst != ce->nconst+i)
+		return 1;
+	if((in->op == OP_RET) != (i == ce->ninstr-1))
+		return 1; /* the code must end with its only return */
+	switch(in->op)
+	{
+	case OP_LOADV:
+		return in->a < 0 || in->a >= ce->nvars;
+	case OP_CALL:
+		if(in->a < 0 || in->a >= ce->ncalls)
+			return 1;
+		for(j = 0; j < ce->call[in->a].nargs; j++)
+			if(ce->call[in->a].arg[j] < 0 || ce->call[in->a].arg[j] >= in->dst)
+				return 1;
+		return 0;
+	case OP_NEG:
+	case OP_PCT:
+	case OP_RET:
+		return in->a < 0 || in->a >= in->dst;
+	default:
+		return in->a < 0 || in->a >= in->dst || in->b < 0 || in->b >= in->dst;
+	}
+}
+
+/* read and check a plan into a new compiled expression, its names point
+** into the plan until it is bound. Returns 0 (zero) or an EVAL_* error */
+static int read_plan(const unsigned char *buf, size_t size,
+	eval_compiled **compiled)
+{
+	eval_compiled *ce;
+	const char *names;
+	int hdr[PLAN_HEADER], nconst, ninstr, nvars, nfolded, ncalls, nargs;
+	int nsize, maxargs = 0, argc = 0, i, j;
+	Cursor c;
+	Call *call;
+	int *args;
+	
+	c.out = NULL;
+	c.in = buf;
+	c.pos = 0;
+	c.size = size;
+	for(i = 0; i < PLAN_HEADER; i++)
+		hdr[i] = get_int(&c);
+	if(hdr[0] != PLAN_MAGIC || hdr[1] != PLAN_VERSION || hdr[2] != PLAN_ORDER
+		|| hdr[3] != PLAN_SIZES || hdr[4] < 0 || (size_t)hdr[4] > size)
+		return EVAL_PLAN_ERROR;
+	c.size = (size_t)hdr[4];
+	nconst = hdr[5];
+	ninstr = hdr[6];
+	nvars = hdr[7];
+	nfolded = hdr[8];
+	ncalls = hdr[9];
+	nargs = hdr[10];
+	nsize = hdr[11];
+	/* every count takes at least a byte of the plan, which bounds them */
+	for(i = 5; i < PLAN_HEADER; i++)
+		if(hdr[i] < 0 || hdr[i] > hdr[4])
+			return EVAL_PLAN_ERROR;
+	if(ninstr < 1 || nsize > hdr[4] || (nsize > 0 && buf[hdr[4]-1] != '\0')
+		|| nconst > INT_MAX-ninstr)
+		return EVAL_PLAN_ERROR;
+	names = (const char*)buf+(hdr[4]-nsize);
+	c.size -= nsize;
+	
+	/* find the largest call before allocating */
+	c.pos = sizeof(int)*PLAN_HEADER
+		+sizeof(double)*((size_t)nconst+nfolded)+sizeof(int)*4*(size_t)ninstr;
+	for(i = 0; i < ncalls; i++)
+	{
+		j = get_int(&c);
+		if(j < 0 || j > nargs-argc)
+			return EVAL_PLAN_ERROR;
+		argc += j;
+		if(j > maxargs)
+			maxargs = j;
+		get_int(&c);
+		get_int(&c);
+	}
+	if(argc != nargs)
+		return EVAL_PLAN_ERROR;
+	
+	ce = code_alloc(nconst+ninstr, nconst, ninstr, nvars, nfolded, ncalls,
+		maxargs, nargs);
+	if(ce == NULL)
+		return EVAL_MEM_ERROR;
+	c.pos = sizeof(int)*PLAN_HEADER;
+	for(i = 0; i < nconst; i++)
+		get_double(&c, ce->reg+i);
+	for(i = nconst; i < ce->nregs; i++)
+		ce->reg[i] = 0.0;
+	for(i = 0; i < nfolded; i++)
+		get_double(&c, &ce->folded[i].value);
+	for(i = 0; i < ninstr; i++)
+	{
+		ce->code[i].op = get_int(&c);
+		ce->code[i].dst = get_int(&c);
+		ce->code[i].a = get_int(&c);
+		ce->code[i].b = get_int(&c);
+	}
+	args = (int*)(ce->code+ninstr);
+	for(i = 0; i < ncalls; i++)
+	{
+		call = ce->call+i;
+		call->fn = NULL;
+		call->vfn = NULL;
+		call->data = NULL;
+		call->nargs = get_int(&c);
+		call->name = get_name(&c, names, nsize);
+		call->pure = get_int(&c);
+		call->arg = args;
+		args += call->nargs;
+		if(call->name == NULL)
+			goto bad;
+	}
+	args = (int*)(ce->code+ninstr);
+	for(i = 0; i < nargs; i++)
+		args[i] = get_int(&c);
+	for(i = 0; i < nvars; i++)
+	{
+		ce->slot[i].name = get_name(&c, names, nsize);
+		ce->slot[i].home = NULL;
+		ce->var[i] = NULL;
+		if(ce->slot[i].name == NULL)
+			goto bad;
+	}
+	for(i = 0; i < nfolded; i++)
+	{
+		ce->folded[i].name = get_name(&c, names, nsize);
+		ce->folded[i].fn = get_int(&c);
+		if(ce->folded[i].name == NULL)
+			goto bad;
+	}
+	if(c.pos != c.size)
+		goto bad; /* short, or the names don't follow the rest */
+	for(i = 0; i < ninstr; i++)
+		if(bad_instr(ce, ce->code+i, i))
+			goto bad;
+	*compiled = ce;
+	
+	return 0;
+	
+bad:
+	eval_free(ce);
+	return EVAL_PLAN_ERROR;
+}
+
+/* public: load a compiled expression saved by eval_serialize() */
+int eval_ctx_deserialize(eval_ctx *ctx, const void *buf, size_t size,
+	eval_compiled **compiled)
+{
+	eval_compiled *ce;
+	int err;
+	
+	if(compiled == NULL)
+		return EVAL_NULL_EXPRESSION;
+	*compiled = NULL;
+	if(buf == NULL)
+		return EVAL_NULL_EXPRESSION;
+	if((err = read_plan((const unsigned char*)buf, size, &ce)) != 0)
+		return err;
+	if((err = code_bind(ctx, ce)) != 0)
+	{
+		eval_free(ce);
+		return err;
+	}
+	*compiled = ce;
+	
+	return 0;
+}
+
+int eval_deserialize(const void *buf, size_t size, eval_compiled **compiled)
+{
+	return eval_ctx_deserialize(NULL, buf, size, compiled);
+}
+
+/* write a file through a temporary file in the same directory, so that
+** it appears whole or not at all. Returns 0 (zero) or an EVAL_* error */
+static int write_file(const char *path, const void *head, size_t hsize,
+	const void *body, size_t bsize)
+{
+	char *tmp;
+	const char *slash;
+	size_t dlen;
+	FILE *f;
+	int ok;
+#ifdef PLAN_MKSTEMP
+	int fd;
+#endif
+	
+	slash = strrchr(path, '/');
+	dlen = slash != NULL ? (size_t)(slash-path)+1 : 0;
+	if((tmp = (char*)malloc(dlen+sizeof(".plan-XXXXXX"))) == NULL)
+		return EVAL_MEM_ERROR;
+	memcpy(tmp, path, dlen);
+	strcpy(tmp+dlen, ".plan-XXXXXX");
+#ifdef PLAN_MKSTEMP
+	if((fd = mkstemp(tmp)) < 0 || (f = fdopen(fd, "wb")) == NULL)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return EVAL_PLAN_ERROR;
+	}
+#else
+	free(tmp); /* no mkstemp(), write in place */
+	tmp = NULL;
+	if((f = fopen(path, "wb")) == NULL)
+		return EVAL_PLAN_ERROR;
+#endif
+	ok = (hsize == 0 || fwrite(head, 1, hsize, f) == hsize)
+		&& fwrite(body, 1, bsize, f) == bsize;
+	ok = fclose(f) == 0 && ok;
+#ifdef PLAN_MKSTEMP
+	if(ok)
+		ok = rename(tmp, path) == 0;
+	if(!ok)
+		unlink(tmp);
+	free(tmp);
+#endif
+	
+	return ok ? 0 : EVAL_PLAN_ERROR;
+}
+
+/* save a compiled expression into a new block, returns NULL if out of
+** memory */
+static unsigned char *plan_block(const eval_compiled *ce, size_t *size)
+{
+	unsigned char *buf;
+	
+	*size = eval_serialize(ce, NULL, 0);
+	if(*size == 0 || *size > INT_MAX)
+		return NULL;
+	if((buf = (unsigned char*)malloc(*size)) != NULL)
+		eval_serialize(ce, buf, *size);
+	
+	return buf;
+}
+
+/* public: save a compiled expression to a file */
+int eval_save(const eval_compiled *compiled, const char *path)
+{
+	unsigned char *buf;
+	size_t size;
+	int err;
+	
+	if(compiled == NULL || compiled->tag != COMPILED_TAG || path == NULL)
+		return EVAL_NULL_EXPRESSION;
+	if((buf = plan_block(compiled, &size)) == NULL)
+		return EVAL_MEM_ERROR;
+	err = write_file(path, NULL, 0, buf, size);
+	free(buf);
+	
+	return err;
+}
+
+/* public: load a compiled expression saved by eval_save() */
+int eval_ctx_load(eval_ctx *ctx, const char *path, eval_compiled **compiled)
+{
+	const unsigned char *data;
+	size_t size;
+	int err;
+	
+	if(compiled == NULL)
+		return EVAL_NULL_EXPRESSION;
+	*compiled = NULL;
+	if(path == NULL)
+		return EVAL_NULL_EXPRESSION;
+	if((data = (const unsigned char*)file_map(path, &size, 0)) == NULL)
+		return EVAL_PLAN_ERROR;
+	err = eval_ctx_deserialize(ctx, data, size, compiled);
+	file_unmap((const char*)data, size);
+	
+	return err;
+}
+
+int eval_load(const char *path, eval_compiled **compiled)
+{
+	return eval_ctx_load(NULL, path, compiled);
+}
+
+/* public: set the plan cache directory, NULL turns the cache off */
+int eval_plan_cache(const char *dir)
+{
+	char *copy = NULL, *old;
+	
+	if(dir != NULL)
+	{
+		if((copy = (char*)malloc(strlen(dir)+1)) == NULL)
+			return EVAL_MEM_ERROR;
+		strcpy(copy, dir);
+	}
+#ifdef PLAN_THREADS
+	pthread_mutex_lock(&G_plan_lock);
+#endif
+	old = G_plan_dir;
+	__atomic_store_n(&G_plan_dir, copy, __ATOMIC_RELEASE);
+#ifdef PLAN_THREADS
+	pthread_mutex_unlock(&G_plan_lock);
+#endif
+	free(old);
+	
+	return 0;
+}
+
+/* the cache file of an expression in a malloc()'d string, NULL if the
+** cache is off or out of memory */
+static char *plan_path(const char *expr)
+{
+	unsigned long long h = 14695981039346656037ULL; /* FNV-1a, 64 bits */
+	char *path = NULL;
+	size_t i;
+	
+	if(__atomic_load_n(&G_plan_dir, __ATOMIC_ACQUIRE) == NULL)
+		return NULL; /* the usual case, without taking the lock */
+	for(i = 0; expr[i] != '\0'; i++)
+		h = (h ^ (unsigned char)expr[i])*1099511628211ULL;
+#ifdef PLAN_THREADS
+	pthread_mutex_lock(&G_plan_lock);
+#endif
+	if(G_plan_dir != NULL)
+	{
+		path = (char*)malloc(strlen(G_plan_dir)+sizeof("/0123456789abcdef.plan"));
+		if(path != NULL)
+			sprintf(path, "%s/%016llx.plan", G_plan_dir, h);
+	}
+#ifdef PLAN_THREADS
+	pthread_mutex_unlock(&G_plan_lock);
+#endif
+	
+	return path;
+}
+
+/* load an expression from the plan cache, returns 0 (zero) on a hit */
+int plan_find(eval_ctx *ctx, const char *expr, eval_compiled **compiled)
+{
+	const unsigned char *data;
+	char *path;
+	size_t size, len;
+	int err = EVAL_PLAN_ERROR, n = -1;
+	
+	if((path = plan_path(expr)) == NULL)
+		return EVAL_PLAN_ERROR;
+	data = (const unsigned char*)file_map(path, &size, 0);
+	free(path);
+	if(data == NULL)
+		return EVAL_PLAN_ERROR;
+	len = strlen(expr);
+	if(size >= sizeof(int))
+		memcpy(&n, data, sizeof(int));
+	if(size >= sizeof(int) && (size_t)n == len && size-sizeof(int) >= len
+		&& memcmp(data+sizeof(int), expr, len) == 0)
+		err = eval_ctx_deserialize(ctx, data+sizeof(int)+len,
+			size-sizeof(int)-len, compiled);
+	file_unmap((const char*)data, size);
+	
+	return err;
+}
+
+/* save a newly compiled expression in the plan cache, if it is on.
+** Failures are ignored, the expression is just compiled next time */
+void plan_keep(const char *expr, const eval_compiled *compiled)
+{
+	unsigned char *buf, *head;
+	char *path;
+	size_t size, len;
+	int n;
+	
+	for(n = 0; n < compiled->nfolded; n++)
+		if(compiled->folded[n].fn == FOLDED_USER)
+			return;
+	if((path = plan_path(expr)) == NULL)
+		return;
+	len = strlen(expr);
+	buf = plan_block(compiled, &size);
+	head = (unsigned char*)malloc(sizeof(int)+len);
+	if(buf != NULL && head != NULL && len <= INT_MAX)
+	{
+		n = (int)len;
+		memcpy(head, &n, sizeof(int));
+		memcpy(head+sizeof(int), expr, len);
+		write_file(path, head, sizeof(int)+len, buf, size);
+	}
+	free(head);
+	free(buf);
+	free(path);
+	
+	return;
+}
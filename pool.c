@@ -0,0 +1,406 @@
+/*
+** simple expression evaluator library (thread pool for batch evaluation)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* large jobs are split into tasks and spread over a pool of threads. A
+** batch (eval_run_batch()) is split into chunks of rows, a CSV file into
+** chunks of lines (see csv.c). Every thread starts with an equal share of
+** the tasks and works through them in order; a thread that runs out steals
+** the far half of the remaining tasks of another thread, so threads that
+** finish early (or run cheap tasks) take over the work of slow ones. Each
+** task always writes the same part of the output, so the result doesn't
+** depend on which thread ran it. Each thread can have state of its own,
+** like a batch's scratch space. The calling thread works too, and the pool
+** threads are started the first time they are needed, then wait for the
+** next job. */
+
+#include <stdlib.h>
+
+#include "evalcode.h"
+
+/* a job: tasks 0 to ntasks-1, run by run() with the state each thread gets
+** from start() (if it isn't NULL), which finish() releases */
+typedef struct
+{
+	PoolTask run;
+	void *(*start)(void *arg);
+	void (*finish)(void *state);
+	void *arg;
+	long ntasks;
+	int nthreads; /* threads working on this job, including the caller */
+	int err; /* first error from any task, 0 (zero) if none */
+	struct Range_struct *range; /* one range of tasks per thread */
+} Job;
+
+/* run all the tasks of a job in the calling thread */
+static int run_alone(const Job *job)
+{
+	void *state = NULL;
+	long i;
+	int err = 0;
+	
+	if(job->start != NULL && (state = job->start(job->arg)) == NULL)
+		return EVAL_MEM_ERROR;
+	for(i = 0; i < job->ntasks && err == 0; i++)
+		err = job->run(job->arg, state, i);
+	if(job->finish != NULL)
+		job->finish(state);
+	
+	return err;
+}
+
+/* a batch's tasks are chunks of its rows */
+typedef struct
+{
+	const BatchPlan *bp;
+	size_t rows, chunk; /* total rows, rows per chunk */
+	double *out;
+} BatchJob;
+
+static void *batch_start(void *arg)
+{
+	return batch_scratch(((const BatchJob*)arg)->bp);
+}
+
+static void batch_finish(void *state)
+{
+	free(state);
+	
+	return;
+}
+
+static int batch_task(void *arg, void *state, long task)
+{
+	const BatchJob *bj = (const BatchJob*)arg;
+	size_t row0, n;
+	
+	row0 = (size_t)task*bj->chunk;
+	n = bj->rows-row0 < bj->chunk ? bj->rows-row0 : bj->chunk;
+	
+	return batch_rows(bj->bp, (BatchScratch*)state, row0, n, bj->out);
+}
+
+static int pool_job(Job *job);
+static size_t pool_chunk(void);
+
+/* evaluate all the rows of a batch plan, on several threads if the batch
+** is big enough, returns 0 (zero) on success or an EVAL_* error code */
+int pool_run(const BatchPlan *bp, size_t rows, double *out)
+{
+	BatchJob bj;
+	Job job;
+	
+	bj.bp = bp;
+	bj.rows = rows;
+	bj.chunk = pool_chunk();
+	bj.out = out;
+	while(rows/bj.chunk >= 0xffffffffUL)
+		bj.chunk *= 2; /* chunk numbers must fit a range */
+	job.run = batch_task;
+	job.start = batch_start;
+	job.finish = batch_finish;
+	job.arg = &bj;
+	job.ntasks = (long)((rows+bj.chunk-1)/bj.chunk);
+	
+	return pool_job(&job);
+}
+
+/* run tasks 0 to ntasks-1 over the pool */
+int pool_tasks(PoolTask run, void *arg, long ntasks)
+{
+	Job job;
+	
+	job.run = run;
+	job.start = NULL;
+	job.finish = NULL;
+	job.arg = arg;
+	job.ntasks = ntasks;
+	
+	return pool_job(&job);
+}
+
+#if defined(__GNUC__) && defined(__unix__) && !defined(EVAL_NO_THREADS)
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define POOL_MAX 256 /* most threads a job will use */
+#define DEFAULT_CHUNK (16*BATCH_ROWS) /* rows per chunk */
+
+typedef struct Range_struct
+{
+	unsigned long long range;
+	char pad[64-sizeof(unsigned long long)];
+} Range;
+
+#define RANGE(LO,HI) ((unsigned long long)(LO) | ((unsigned long long)(HI) << 32))
+#define RANGE_LO(R) ((unsigned long)((R) & 0xffffffffULL))
+#define RANGE_HI(R) ((unsigned long)((R) >> 32))
+
+static pthread_mutex_t G_pool_busy = PTHREAD_MUTEX_INITIALIZER; /* one job at a time */
+static pthread_mutex_t G_pool_lock = PTHREAD_MUTEX_INITIALIZER; /* guards the following */
+static pthread_cond_t G_pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t G_pool_done = PTHREAD_COND_INITIALIZER;
+static Job *G_job = NULL; /* current job */
+static int G_job_threads = 0; /* threads working on the current job */
+static unsigned long G_job_no = 0; /* bumped for each job */
+static int G_job_running = 0; /* pool threads still working on the job */
+static int G_pool_size = 0; /* pool threads started */
+static unsigned long G_pool_seen[POOL_MAX]; /* last job each thread saw */
+
+static int G_threads = 1; /* threads used by a job, including the caller */
+static size_t G_chunk = DEFAULT_CHUNK;
+
+/* take the next task of a range, -1 if the range is empty */
+static long take_task(Range *r)
+{
+	unsigned long long old;
+	unsigned long lo, hi;
+	
+	old = __atomic_load_n(&r->range, __ATOMIC_ACQUIRE);
+	do
+	{
+		lo = RANGE_LO(old);
+		hi = RANGE_HI(old);
+		if(lo >= hi)
+			return -1;
+	}while(!__atomic_compare_exchange_n(&r->range, &old, RANGE(lo+1, hi),
+		0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	
+	return (long)lo;
+}
+
+/* move the back half of a victim's tasks into an empty range, returns
+** non-zero if anything was stolen */
+static int steal_tasks(Range *victim, Range *r)
+{
+	unsigned long long old;
+	unsigned long lo, hi, mid;
+	
+	old = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+	do
+	{
+		lo = RANGE_LO(old);
+		hi = RANGE_HI(old);
+		if(lo >= hi)
+			return 0;
+		mid = lo+(hi-lo)/2; /* the last task goes to the thief */
+	}while(!__atomic_compare_exchange_n(&victim->range, &old, RANGE(lo, mid),
+		0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	/* our range is empty, so no thief can be updating it */
+	__atomic_store_n(&r->range, RANGE(mid, hi), __ATOMIC_RELEASE);
+	
+	return 1;
+}
+
+/* record the first error of a job */
+static void job_error(Job *job, int err)
+{
+	int zero = 0;
+	
+	__atomic_compare_exchange_n(&job->err, &zero, err, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	
+	return;
+}
+
+/* run tasks of a job until there are none left anywhere */
+static void run_job(Job *job, int self)
+{
+	void *state = NULL;
+	long c;
+	int err, i;
+	
+	if(job->start != NULL && (state = job->start(job->arg)) == NULL)
+	{ /* leave our tasks for the other threads, the job fails anyway */
+		job_error(job, EVAL_MEM_ERROR);
+		return;
+	}
+	for(;;)
+	{
+		c = take_task(job->range+self);
+		for(i = 1; c < 0 && i < job->nthreads; i++)
+			if(steal_tasks(job->range+(self+i)%job->nthreads, job->range+self))
+				c = take_task(job->range+self);
+		if(c < 0 || __atomic_load_n(&job->err, __ATOMIC_ACQUIRE) != 0)
+			break; /* all done, or no point going on */
+		err = job->run(job->arg, state, c);
+		if(err != 0)
+			job_error(job, err);
+	}
+	if(job->finish != NULL)
+		job->finish(state);
+	
+	return;
+}
+
+/* pool threads wait for a job, work on it if they are one of the job's
+** threads, then wait for the next */
+static void *pool_thread(void *arg)
+{
+	int self = (int)(size_t)arg;
+	unsigned long seen;
+	Job *job;
+	
+	pthread_mutex_lock(&G_pool_lock);
+	seen = G_pool_seen[self]; /* the job number when we were started */
+	for(;;)
+	{
+		while(G_job_no == seen)
+			pthread_cond_wait(&G_pool_start, &G_pool_lock);
+		seen = G_job_no;
+		if(self >= G_job_threads)
+			continue; /* not needed for this job */
+		job = G_job;
+		pthread_mutex_unlock(&G_pool_lock);
+		run_job(job, self);
+		pthread_mutex_lock(&G_pool_lock);
+		if(--G_job_running == 0)
+			pthread_cond_signal(&G_pool_done);
+	}
+	
+	return NULL;
+}
+
+/* start pool threads until there are n, returns the number available (n,
+** or less if some won't start) */
+static int grow_pool(int n)
+{
+	pthread_attr_t attr;
+	pthread_t t;
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&G_pool_lock);
+	while(G_pool_size < n)
+	{ /* the new thread has seen every job so far */
+		G_pool_seen[G_pool_size+1] = G_job_no;
+		if(pthread_create(&t, &attr, pool_thread, (void*)(size_t)(G_pool_size+1)))
+			break;
+		G_pool_size++;
+	}
+	if(n > G_pool_size)
+		n = G_pool_size;
+	pthread_mutex_unlock(&G_pool_lock);
+	pthread_attr_destroy(&attr);
+	
+	return n;
+}
+
+/* run the tasks of a job, on several threads if there are enough tasks,
+** returns 0 (zero) on success or the first task's error */
+static int pool_job(Job *job)
+{
+	Range *range;
+	int nthreads = G_threads, i;
+	
+	if(nthreads > job->ntasks)
+		nthreads = (int)job->ntasks;
+	if(nthreads <= 1 || pthread_mutex_trylock(&G_pool_busy) != 0)
+		return run_alone(job); /* small, or the pool is busy */
+	nthreads = 1+grow_pool(nthreads-1); /* less if threads won't start */
+	range = nthreads > 1 ? (Range*)malloc(sizeof(Range)*nthreads) : NULL;
+	if(range == NULL)
+	{
+		pthread_mutex_unlock(&G_pool_busy);
+		return run_alone(job);
+	}
+	for(i = 0; i < nthreads; i++) /* an equal share of the tasks each */
+		range[i].range = RANGE(job->ntasks*i/nthreads,
+			job->ntasks*(i+1)/nthreads);
+	job->nthreads = nthreads;
+	job->err = 0;
+	job->range = range;
+	
+	pthread_mutex_lock(&G_pool_lock);
+	G_job = job;
+	G_job_threads = nthreads;
+	G_job_no++;
+	G_job_running = nthreads-1;
+	pthread_cond_broadcast(&G_pool_start);
+	pthread_mutex_unlock(&G_pool_lock);
+	
+	run_job(job, 0);
+	
+	pthread_mutex_lock(&G_pool_lock);
+	while(G_job_running > 0)
+		pthread_cond_wait(&G_pool_done, &G_pool_lock);
+	pthread_mutex_unlock(&G_pool_lock);
+	pthread_mutex_unlock(&G_pool_busy);
+	free(range);
+	
+	return job->err;
+}
+
+/* public: set the threads and chunk size used by eval_run_batch() */
+int eval_batch_threads(int threads, size_t chunk)
+{
+	long n;
+	
+	if(threads < 0)
+		return 1;
+	if(threads == 0)
+	{ /* one per processor */
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? (int)n : 1;
+	}
+	if(threads > POOL_MAX)
+		threads = POOL_MAX;
+	G_threads = threads;
+	G_chunk = chunk > 0 ? chunk : DEFAULT_CHUNK;
+	
+	return 0;
+}
+
+/* the threads set by eval_batch_threads() */
+int pool_threads(void)
+{
+	return G_threads;
+}
+
+/* the rows of a batch's chunks, set by eval_batch_threads() */
+static size_t pool_chunk(void)
+{
+	return G_chunk;
+}
+
+#else /* no threads on this platform, jobs run in the calling thread */
+
+static int pool_job(Job *job)
+{
+	return run_alone(job);
+}
+
+static size_t pool_chunk(void)
+{
+	return 16*BATCH_ROWS;
+}
+
+int eval_batch_threads(int threads, size_t chunk)
+{
+	(void)chunk;
+	
+	return threads != 1;
+}
+
+int pool_threads(void)
+{
+	return 1;
+}
+
+#endif
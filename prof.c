@@ -0,0 +1,710 @@
+/*
+** simple expression evaluator library (sampling profiler)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* while profiling is on, one run in every G_prof_period (counted in each
+** thread) is run here instead of by vm_run() or the native code, timing
+** each instruction with the cycle counter. The time is added to a
+** profile record of the expression, which has a node for each
+** instruction: the subexpression it computes (as text), the node using
+** its value (its parent in the expression tree; with common
+** subexpressions removed a value may have several users, the first one
+** is taken) and the time and calls counted. Records are found by the
+** compiled code, saved as by eval_serialize() (which keeps variables and
+** functions by name), so the runs of every compiled copy of an
+** expression add up, and outlive the compiled expressions. The labels
+** are cut short, so they can't tell long expressions apart. The compiled
+** expression keeps a pointer to its record, checked against G_prof_gen
+** since eval_profile_reset() throws the records away. A sampled run may
+** still be adding to a record thrown away, so records are only freed
+** when no sampled run is in flight (G_prof_busy), by that reset or a
+** later one. The report is either folded stacks (one line per node, its
+** path from the root of the expression and its time in nanoseconds, the
+** input of flamegraph.pl and most flame graph viewers) or a table of the
+** time spent in each function. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+#include "evalcode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define TICKS() __rdtsc()
+#define CYCLE_COUNTER 1
+#else
+#define TICKS() prof_clock()
+#endif
+
+#define LABEL_MAX 80 /* longest subexpression label, longer ones are cut */
+#define LABEL_DEPTH 32 /* deepest subexpression written out in a label */
+
+typedef struct
+{
+	unsigned long long ticks; /* time counted, cycle counter ticks */
+	unsigned long calls; /* times run */
+	int parent; /* node using this value, -1 for the root */
+	int op; /* OP_* opcode */
+	int standard; /* a standard function (see func.c) */
+	const char *fn; /* interned function name, calls only */
+	char *label; /* the subexpression */
+} ProfNode;
+
+struct ProfExpr_struct
+{
+	struct ProfExpr_struct *link; /* next record made */
+	unsigned long hash; /* hash code of the code */
+	unsigned long runs; /* sampled runs */
+	int nnodes; /* one node per instruction */
+	ProfNode *node;
+	const char *text; /* the expression, the root node's label */
+	const unsigned char *code; /* the compiled code, see eval_serialize() */
+	size_t code_size;
+};
+
+/* the search key of a record */
+typedef struct
+{
+	const unsigned char *code;
+	size_t code_size;
+	unsigned long hash;
+} ProfKey;
+
+int G_prof_period = 0;
+static unsigned long G_prof_gen = 1; /* incremented by eval_profile_reset() */
+static pthread_mutex_t G_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static hashtable *G_prof_table = NULL; /* records by compiled code */
+static ProfExpr *G_prof_list = NULL; /* every record */
+static ProfExpr *G_prof_retired = NULL; /* records reset, not yet freed */
+static int G_prof_busy = 0; /* sampled runs in flight */
+static unsigned long long G_prof_overhead = 0; /* ticks to read the counter */
+static unsigned long long G_prof_ticks0 = 0; /* counter and clock when */
+static unsigned long G_prof_ns0 = 0; /* profiling was turned on */
+
+#ifdef __GNUC__
+static __thread int G_countdown __attribute__((tls_model("initial-exec")));
+#else
+static int G_countdown;
+#endif
+
+/* the time in nanoseconds */
+static unsigned long prof_clock(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (unsigned long)ts.tv_sec*1000000000UL+ts.tv_nsec;
+}
+
+/* a growing label, text past LABEL_MAX is dropped */
+typedef struct
+{
+	char buf[LABEL_MAX+4];
+	int len;
+} Label;
+
+static void label_add(Label *l, const char *s)
+{
+	while(*s != '\0' && l->len < LABEL_MAX)
+		l->buf[l->len++] = *s++;
+	if(*s != '\0')
+		strcpy(l->buf+LABEL_MAX, "...");
+	
+	return;
+}
+
+/* non-zero if a register holds the result of a binary operator */
+static int is_binary(const eval_compiled *ce, int reg)
+{
+	int op;
+	
+	if(reg < ce->nconst)
+		return 0;
+	op = ce->code[reg-ce->nconst].op;
+	
+	return op >= OP_ADD && op <= OP_POW;
+}
+
+static void label_reg(Label *l, const eval_compiled *ce, int reg, int depth);
+
+/* write an operand, in parentheses if it is a binary operator */
+static void label_operand(Label *l, const eval_compiled *ce, int reg,
+	int depth)
+{
+	if(is_binary(ce, reg))
+	{
+		label_add(l, "(");
+		label_reg(l, ce, reg, depth);
+		label_add(l, ")");
+	}else
+		label_reg(l, ce, reg, depth);
+	
+	return;
+}
+
+/* write the subexpression computing a register */
+static void label_reg(Label *l, const eval_compiled *ce, int reg, int depth)
+{
+	static const char *ops = "?+-*/%^";
+	const Instr *ip;
+	const Call *c;
+	char num[32];
+	int i;
+	
+	if(l->len >= LABEL_MAX)
+		return;
+	if(depth > LABEL_DEPTH)
+	{
+		label_add(l, "...");
+		return;
+	}
+	if(reg < ce->nconst)
+	{
+		sprintf(num, "%.15g", ce->reg[reg]);
+		label_add(l, num);
+		return;
+	}
+	ip = ce->code+reg-ce->nconst;
+	switch(ip->op)
+	{
+	case OP_LOADV:
+		label_add(l, ce->slot[ip->a].name);
+		break;
+	case OP_NEG:
+		label_add(l, "-");
+		label_operand(l, ce, ip->a, depth+1);
+		break;
+	case OP_PCT:
+		label_operand(l, ce, ip->a, depth+1);
+		label_add(l, "%");
+		break;
+	case OP_CALL:
+		c = ce->call+ip->a;
+		label_add(l, c->name);
+		label_add(l, "(");
+		for(i = 0; i < c->nargs; i++)
+		{
+			if(i > 0)
+				label_add(l, ",");
+			label_reg(l, ce, c->arg[i], depth+1);
+		}
+		label_add(l, ")");
+		break;
+	case OP_RET:
+		label_reg(l, ce, ip->a, depth);
+		break;
+	default:
+		label_operand(l, ce, ip->a, depth+1);
+		num[0] = ops[ip->op];
+		num[1] = '\0';
+		label_add(l, num);
+		label_operand(l, ce, ip->b, depth+1);
+	}
+	
+	return;
+}
+
+/* hash code of a record's code (FNV-1a) */
+static unsigned long code_hash(const unsigned char *s, size_t n)
+{
+	unsigned long h = 2166136261UL;
+	
+	while(n-- > 0)
+		h = (h ^ *s++)*16777619UL;
+	
+	return h;
+}
+
+static unsigned int expr_hash(const void *p_key)
+{
+	return (unsigned int)((const ProfExpr*)p_key)->hash;
+}
+
+static int expr_comp(const void *p_key1, const void *p_key2)
+{
+	const ProfExpr *p1 = (const ProfExpr*)p_key1;
+	const ProfExpr *p2 = (const ProfExpr*)p_key2;
+	
+	return p1->code_size != p2->code_size
+		|| memcmp(p1->code, p2->code, p1->code_size) != 0;
+}
+
+/* compare a search key to a record */
+static int key_comp(const void *p_key1, const void *p_key2)
+{
+	const ProfKey *k = (const ProfKey*)p_key1;
+	const ProfExpr *p = (const ProfExpr*)p_key2;
+	
+	return k->code_size != p->code_size
+		|| memcmp(k->code, p->code, k->code_size) != 0;
+}
+
+/* make the profile record of a compiled expression, returns NULL if out
+** of memory. Called with G_prof_lock held */
+static ProfExpr *new_expr(const eval_compiled *ce, Label *labels,
+	const ProfKey *key)
+{
+	ProfExpr *p;
+	char *s;
+	size_t size;
+	int i, j, k;
+	
+	size = sizeof(ProfExpr)+sizeof(ProfNode)*ce->ninstr+key->code_size;
+	for(i = 0; i < ce->ninstr; i++)
+		size += strlen(labels[i].buf)+1;
+	p = (ProfExpr*)malloc(size);
+	if(p == NULL)
+		return NULL;
+	p->hash = key->hash;
+	p->runs = 0;
+	p->nnodes = ce->ninstr;
+	p->node = (ProfNode*)(p+1);
+	p->code = (unsigned char*)memcpy(p->node+ce->ninstr, key->code,
+		key->code_size);
+	p->code_size = key->code_size;
+	s = (char*)(p->code+key->code_size);
+	for(i = 0; i < ce->ninstr; i++)
+	{
+		p->node[i].ticks = 0;
+		p->node[i].calls = 0;
+		p->node[i].parent = -1;
+		p->node[i].op = ce->code[i].op;
+		p->node[i].standard = 0;
+		p->node[i].fn = NULL;
+		if(p->node[i].op == OP_CALL)
+		{
+			p->node[i].fn = ce->call[ce->code[i].a].name;
+			p->node[i].standard = func_standard(ce->call[ce->code[i].a].fn);
+		}
+		p->node[i].label = strcpy(s, labels[i].buf);
+		s += strlen(s)+1;
+	}
+	for(i = ce->ninstr-1; i >= 0; i--)
+	{ /* the first user of each value is its parent */
+		switch(ce->code[i].op)
+		{
+		case OP_LOADV:
+			continue;
+		case OP_CALL:
+			for(k = 0; k < ce->call[ce->code[i].a].nargs; k++)
+			{
+				j = ce->call[ce->code[i].a].arg[k]-ce->nconst;
+				if(j >= 0)
+					p->node[j].parent = i;
+			}
+			continue;
+		case OP_NEG: case OP_PCT: case OP_RET:
+			j = ce->code[i].a-ce->nconst;
+			break;
+		default:
+			j = ce->code[i].b-ce->nconst;
+			if(j >= 0)
+				p->node[j].parent = i;
+			j = ce->code[i].a-ce->nconst;
+		}
+		if(j >= 0)
+			p->node[j].parent = i;
+	}
+	/* the return is the root, its label is the whole expression */
+	p->node[ce->ninstr-1].parent = -1;
+	p->text = p->node[ce->ninstr-1].label;
+	if(G_prof_table == NULL)
+		G_prof_table = ht_create(256, expr_hash, expr_comp, NULL, NULL);
+	if(G_prof_table == NULL || ht_insert(G_prof_table, p, p) != 0)
+	{
+		free(p);
+		return NULL;
+	}
+	p->link = G_prof_list;
+	G_prof_list = p;
+	
+	return p;
+}
+
+/* find or make the profile record of a compiled expression */
+static ProfExpr *find_expr(eval_compiled *ce)
+{
+	ProfExpr *p = NULL;
+	ProfKey key;
+	Label *labels;
+	unsigned char *code;
+	unsigned long gen;
+	int i;
+	
+	gen = __atomic_load_n(&G_prof_gen, __ATOMIC_SEQ_CST);
+	if(ce->prof != NULL && ce->prof_gen == gen)
+		return ce->prof;
+	key.code_size = eval_serialize(ce, NULL, 0);
+	if(key.code_size == 0 || key.code_size > INT_MAX)
+		return NULL; /* not saved by eval_serialize() */
+	code = (unsigned char*)malloc(key.code_size);
+	labels = (Label*)malloc(sizeof(Label)*ce->ninstr);
+	if(code == NULL || labels == NULL)
+	{
+		free(code);
+		free(labels);
+		return NULL;
+	}
+	eval_serialize(ce, code, key.code_size);
+	for(i = 0; i < ce->ninstr; i++)
+	{
+		labels[i].len = 0;
+		label_reg(&labels[i], ce, INSTR_REG(ce, i), 0);
+		labels[i].buf[labels[i].len] = '\0';
+		if(labels[i].len >= LABEL_MAX)
+			strcpy(labels[i].buf+LABEL_MAX, "...");
+	}
+	key.code = code;
+	key.hash = code_hash(code, key.code_size);
+	pthread_mutex_lock(&G_prof_lock);
+	if(G_prof_table == NULL || ht_lookup_hash(G_prof_table, &key,
+		(unsigned int)key.hash, key_comp, (void**)(&p)) != 0)
+		p = new_expr(ce, labels, &key);
+	gen = G_prof_gen;
+	pthread_mutex_unlock(&G_prof_lock);
+	free(labels);
+	free(code);
+	if(p != NULL)
+	{
+		ce->prof = p;
+		ce->prof_gen = gen;
+	}
+	
+	return p;
+}
+
+/* run one instruction, returns 0 (zero) on success or an EVAL_* error
+** code, OP_RET stores the result */
+static int prof_step(const eval_compiled *ce, const Instr *ip, double *r,
+	double *argv, double *result)
+{
+	const Call *c;
+	int i;
+	
+	switch(ip->op)
+	{
+	case OP_LOADV:
+		__atomic_load(ce->var[ip->a], r+ip->dst, __ATOMIC_RELAXED);
+		break;
+	case OP_ADD:
+		r[ip->dst] = r[ip->a]+r[ip->b];
+		break;
+	case OP_SUB:
+		r[ip->dst] = r[ip->a]-r[ip->b];
+		break;
+	case OP_MUL:
+		r[ip->dst] = r[ip->a]*r[ip->b];
+		break;
+	case OP_DIV:
+		if(r[ip->b] == 0.0)
+			return EVAL_DIVIDE_BY_ZERO;
+		r[ip->dst] = r[ip->a]/r[ip->b];
+		break;
+	case OP_MOD:
+		if(r[ip->b] == 0.0)
+			return EVAL_DIVIDE_BY_ZERO;
+		r[ip->dst] = fmod(r[ip->a], r[ip->b]);
+		break;
+	case OP_POW:
+		r[ip->dst] = pow(r[ip->a], r[ip->b]);
+		break;
+	case OP_NEG:
+		r[ip->dst] = -r[ip->a];
+		break;
+	case OP_PCT:
+		r[ip->dst] = r[ip->a]/100.0;
+		break;
+	case OP_CALL:
+		c = ce->call+ip->a;
+		for(i = 0; i < c->nargs; i++)
+			argv[i] = r[c->arg[i]];
+		if(c->fn(c->nargs, argv, r+ip->dst, c->data) != 0)
+			return EVAL_FUNCTION_ERROR;
+		break;
+	case OP_RET:
+		if(result != NULL)
+			*result = r[ip->a];
+		break;
+	default:
+		return EVAL_SYNTAX_ERROR;
+	}
+	
+	return 0;
+}
+
+/* run compiled code like vm_run(), or the native code if it has any,
+** profiling one run in every G_prof_period */
+int prof_run(eval_compiled *ce, double *reg, double *argv, double *result)
+{
+	unsigned long long t0, t1;
+	int i, err = 0, period;
+	ProfExpr *p;
+	
+	period = __atomic_load_n(&G_prof_period, __ATOMIC_RELAXED);
+	p = NULL;
+	if(period != 0 && ++G_countdown >= period)
+	{ /* busy before the record is found, see eval_profile_reset() */
+		G_countdown = 0;
+		__atomic_fetch_add(&G_prof_busy, 1, __ATOMIC_SEQ_CST);
+		if((p = find_expr(ce)) == NULL)
+			__atomic_fetch_sub(&G_prof_busy, 1, __ATOMIC_RELEASE);
+	}
+	if(p == NULL)
+	{
+		if(ce->native != NULL && reg == ce->reg)
+			return ce->native(reg, argv, result);
+		return vm_run(ce, reg, argv, result);
+	}
+	__atomic_fetch_add(&p->runs, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < ce->ninstr && err == 0; i++)
+	{
+		t0 = TICKS();
+		err = prof_step(ce, ce->code+i, reg, argv, result);
+		t1 = TICKS()-t0;
+		t1 = t1 > G_prof_overhead ? t1-G_prof_overhead : 0;
+		__atomic_fetch_add(&p->node[i].ticks, t1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&p->node[i].calls, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_sub(&G_prof_busy, 1, __ATOMIC_RELEASE);
+	
+	return err;
+}
+
+/* public: turn profiling on (one run in every period is profiled) or off
+** (period is 0 (zero)) */
+int eval_profile_enable(int period)
+{
+	unsigned long long t, least = ~0ULL;
+	int i;
+	
+	if(period < 0)
+		return 1;
+	if(period > 0 && __atomic_load_n(&G_prof_period, __ATOMIC_RELAXED) == 0)
+	{
+		pthread_mutex_lock(&G_prof_lock);
+		for(i = 0; i < 100; i++)
+		{ /* the cost of reading the counter, taken off each reading */
+			t = TICKS();
+			t = TICKS()-t;
+			if(t < least)
+				least = t;
+		}
+		G_prof_overhead = least;
+		if(G_prof_ns0 == 0)
+		{
+			G_prof_ticks0 = TICKS();
+			G_prof_ns0 = prof_clock();
+		}
+		pthread_mutex_unlock(&G_prof_lock);
+	}
+	__atomic_store_n(&G_prof_period, period, __ATOMIC_RELAXED);
+	
+	return 0;
+}
+
+/* public: throw away the profile gathered so far */
+int eval_profile_reset(void)
+{
+	ProfExpr *p;
+	
+	pthread_mutex_lock(&G_prof_lock);
+	while((p = G_prof_list) != NULL)
+	{
+		G_prof_list = p->link;
+		p->link = G_prof_retired;
+		G_prof_retired = p;
+	}
+	if(G_prof_table != NULL)
+		ht_delete(G_prof_table);
+	G_prof_table = NULL;
+	__atomic_store_n(&G_prof_gen, G_prof_gen+1, __ATOMIC_SEQ_CST);
+	/* a run that wasn't busy yet will see the new generation, and won't
+	** use a retired record */
+	if(__atomic_load_n(&G_prof_busy, __ATOMIC_SEQ_CST) == 0)
+	{
+		while((p = G_prof_retired) != NULL)
+		{
+			G_prof_retired = p->link;
+			free(p);
+		}
+	}
+	pthread_mutex_unlock(&G_prof_lock);
+	
+	return 0;
+}
+
+/* nanoseconds per tick of the counter, measured against the clock since
+** profiling was turned on (waiting a little if that was very recent) */
+static double ns_per_tick(void)
+{
+	struct timespec wait = {0, 10000000};
+	unsigned long ns;
+	
+#ifndef CYCLE_COUNTER
+	return 1.0; /* the counter is the clock */
+#endif
+	if(G_prof_ns0 == 0)
+		return 1.0;
+	if(prof_clock()-G_prof_ns0 < 10000000UL)
+		nanosleep(&wait, NULL);
+	ns = prof_clock()-G_prof_ns0;
+	
+	return (double)ns/(double)(TICKS()-G_prof_ticks0);
+}
+
+/* the time of each function, most first */
+typedef struct
+{
+	const char *fn;
+	int standard;
+	unsigned long calls;
+	unsigned long long ticks;
+} FnTime;
+
+static int fn_order(const void *p1, const void *p2)
+{
+	const FnTime *f1 = (const FnTime*)p1;
+	const FnTime *f2 = (const FnTime*)p2;
+	
+	if(f1->ticks != f2->ticks)
+		return f1->ticks < f2->ticks ? 1 : -1;
+	return strcmp(f1->fn, f2->fn);
+}
+
+/* write the folded stacks of one record */
+static void write_stacks(FILE *out, const ProfExpr *p, int *path,
+	double scale)
+{
+	unsigned long long ns;
+	int i, j, n;
+	
+	for(i = 0; i < p->nnodes; i++)
+	{
+		ns = (unsigned long long)(p->node[i].ticks*scale+0.5);
+		if(ns == 0)
+			continue;
+		n = 0;
+		for(j = i; j >= 0 && n < p->nnodes; j = p->node[j].parent)
+			if(j == i || p->node[j].op != OP_RET)
+				path[n++] = j; /* the return and the root are one frame */
+		while(n-- > 0)
+			fprintf(out, "%s%c", p->node[path[n]].label, n > 0 ? ';' : ' ');
+		fprintf(out, "%llu\n", ns);
+	}
+	
+	return;
+}
+
+/* write the time of each function */
+static int write_functions(FILE *out, double scale)
+{
+	const ProfExpr *p;
+	FnTime *fns = NULL, *f;
+	int nfns = 0, size = 0, i, j;
+	
+	for(p = G_prof_list; p != NULL; p = p->link)
+	{
+		for(i = 0; i < p->nnodes; i++)
+		{
+			if(p->node[i].op != OP_CALL)
+				continue;
+			for(j = 0; j < nfns && fns[j].fn != p->node[i].fn; j++)
+				;
+			if(j == nfns)
+			{
+				if(nfns == size)
+				{
+					size = size > 0 ? size*2 : 16;
+					f = (FnTime*)realloc(fns, sizeof(FnTime)*size);
+					if(f == NULL)
+					{
+						free(fns);
+						return 2;
+					}
+					fns = f;
+				}
+				fns[j].fn = p->node[i].fn;
+				fns[j].standard = p->node[i].standard;
+				fns[j].calls = 0;
+				fns[j].ticks = 0;
+				nfns++;
+			}
+			fns[j].calls += p->node[i].calls;
+			fns[j].ticks += p->node[i].ticks;
+		}
+	}
+	qsort(fns, nfns, sizeof(FnTime), fn_order);
+	fprintf(out, "# function\tkind\tcalls\tns\tns/call\n");
+	for(i = 0; i < nfns; i++)
+		fprintf(out, "%s\t%s\t%lu\t%.0f\t%.1f\n", fns[i].fn,
+			fns[i].standard ? "standard" : "user", fns[i].calls,
+			fns[i].ticks*scale, fns[i].ticks*scale/fns[i].calls);
+	free(fns);
+	
+	return 0;
+}
+
+/* public: write the profile to a file ("-" is the standard output) */
+int eval_profile_write(const char *path, int format)
+{
+	const ProfExpr *p;
+	FILE *out;
+	double scale;
+	int *path_buf = NULL, size = 0, err = 0;
+	
+	if(path == NULL || (format != EVAL_PROFILE_FOLDED &&
+		format != EVAL_PROFILE_FUNCTIONS))
+		return 1;
+	out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	if(out == NULL)
+		return 3;
+	pthread_mutex_lock(&G_prof_lock);
+	scale = ns_per_tick();
+	if(format == EVAL_PROFILE_FUNCTIONS)
+		err = write_functions(out, scale);
+	else for(p = G_prof_list; p != NULL && err == 0; p = p->link)
+	{
+		if(p->nnodes > size)
+		{
+			free(path_buf);
+			size = p->nnodes;
+			path_buf = (int*)malloc(sizeof(int)*size);
+			if(path_buf == NULL)
+				err = 2;
+		}
+		if(path_buf != NULL)
+			write_stacks(out, p, path_buf, scale);
+	}
+	pthread_mutex_unlock(&G_prof_lock);
+	free(path_buf);
+	if(ferror(out))
+		err = 3;
+	if(out != stdout && fclose(out) != 0)
+		err = 3;
+	else if(out == stdout)
+		fflush(out);
+	
+	return err;
+}
@@ -0,0 +1,493 @@
+/*
+** simple expression evaluator library (vector versions of the functions)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* vector versions of the standard functions, used by eval_run_batch() to
+** evaluate a whole block of calls at once. The functions are written once,
+** on vectors of 8 doubles, and compiled for each x86 instruction set (8
+** doubles are 4 sse2 registers, 2 avx2 registers or 1 avx512 register), the
+** widest set the cpu supports is picked when the functions are defined.
+**
+** abs(), sign(), floor(), ceil(), round(), trunc(), sqrt(), deg() and rad()
+** give exactly the same results as the scalar functions. exp(), ln(),
+** log(), sin(), cos() and tanh() use polynomial approximations (after
+** fdlibm) that can differ from the C library in the last bits, measured
+** against glibc over 10^7 random arguments the largest differences are:
+**
+**   exp   1 ulp      |x| <= 708
+**   ln    1 ulp      all normal x > 0
+**   log   2 ulp      all normal x > 0
+**   sin   1 ulp      |x| <= 2^19
+**   cos   1 ulp      |x| <= 2^19
+**   tanh  2 ulp      all x
+**
+** arguments outside those ranges (including infinities, NaNs, subnormals
+** and negative logarithms) are passed to the C library one at a time, so
+** special values come out exactly as they do from the scalar functions. */
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "evalcode.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(EVAL_NO_SIMD)
+
+#include <immintrin.h>
+
+/* the approximations depend on each operation being rounded on its own,
+** don't let the compiler fuse multiplies and adds (it would only do so for
+** some of the instruction sets, giving results that depend on the cpu) */
+#pragma GCC optimize ("fp-contract=off")
+
+typedef double v8d __attribute__((vector_size(64)));
+typedef long long v8l __attribute__((vector_size(64))); /* masks and bits */
+
+#define VINLINE static inline __attribute__((always_inline))
+
+#define SIGN_BIT ((long long)0x8000000000000000ULL)
+#define ROUND_MAGIC 6755399441055744.0 /* 1.5*2^52 */
+
+#define PI  3.14159265358979323 /* same as func.c */
+#define DEGREES_PER_RADIAN (360.0/(2.0*PI))
+#define RADIANS_PER_DEGREE ((2.0*PI)/360.0)
+
+/* pick a where m is set, b elsewhere */
+VINLINE v8d vsel(v8l m, v8d a, v8d b)
+{
+	return (v8d)((m & (v8l)a) | (~m & (v8l)b));
+}
+
+VINLINE v8d vsplat(double c)
+{
+	v8d v = {c, c, c, c, c, c, c, c};
+	
+	return v;
+}
+
+VINLINE v8d vabs(v8d x)
+{
+	return (v8d)((v8l)x & ~SIGN_BIT);
+}
+
+/* round to the nearest integer, for |x| < 2^51 */
+VINLINE v8d vrint(v8d x)
+{
+	return (x+ROUND_MAGIC)-ROUND_MAGIC;
+}
+
+/* a zero result gets the sign of x, like floor(-0.0) or ceil(-0.5) */
+VINLINE v8d vzero_sign(v8d t, v8d x)
+{
+	return vsel(t == 0.0, (v8d)((v8l)x & SIGN_BIT), t);
+}
+
+VINLINE int vany(v8l m)
+{
+	return (m[0]|m[1]|m[2]|m[3]|m[4]|m[5]|m[6]|m[7]) != 0;
+}
+
+/* load w values, padding the vector with ones */
+VINLINE v8d vload(const double *a, size_t w)
+{
+	v8d x = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+	
+	if(w == 8)
+		memcpy(&x, a, sizeof(x));
+	else
+		memcpy(&x, a, sizeof(double)*w);
+	return x;
+}
+
+/* store the first w values of y */
+VINLINE void vstore(double *d, v8d y, size_t w)
+{
+	if(w == 8)
+		memcpy(d, &y, sizeof(y));
+	else
+		memcpy(d, &y, sizeof(double)*w);
+	return;
+}
+
+/* the vector cores return the function of each lane, and mark the lanes
+** they can't handle in bad, those lanes are recomputed by the scalar
+** function */
+
+VINLINE v8d v_abs(v8d x, v8l *bad)
+{
+	(void)bad;
+	return vabs(x);
+}
+
+VINLINE v8d v_sign(v8d x, v8l *bad)
+{
+	(void)bad;
+	return vsel(x < 0.0, vsplat(-1.0), vsplat(1.0));
+}
+
+VINLINE v8d v_floor(v8d x, v8l *bad)
+{
+	v8d t;
+	
+	*bad |= ~(vabs(x) < 0x1p51);
+	t = vrint(x);
+	t = vsel(t > x, t-1.0, t);
+	return vzero_sign(t, x);
+}
+
+VINLINE v8d v_ceil(v8d x, v8l *bad)
+{
+	v8d t;
+	
+	*bad |= ~(vabs(x) < 0x1p51);
+	t = vrint(x);
+	t = vsel(t < x, t+1.0, t);
+	return vzero_sign(t, x);
+}
+
+/* trunc() and round() as func.c defines them, from floor() and ceil() */
+VINLINE v8d v_trunc(v8d x, v8l *bad)
+{
+	return vsel(x <= 0.0, v_ceil(x, bad), v_floor(x, bad));
+}
+
+VINLINE v8d v_round(v8d x, v8l *bad)
+{
+	v8d r;
+	
+	*bad |= ~(vabs(x) < 0x1p50);
+	r = vsel(x <= -0.5, v_ceil(x-0.5, bad), v_floor(x+0.5, bad));
+	return vsel((x <= -0.5) | (x >= 0.5), r, vsplat(0.0));
+}
+
+VINLINE v8d v_deg(v8d x, v8l *bad)
+{
+	(void)bad;
+	return x*DEGREES_PER_RADIAN;
+}
+
+VINLINE v8d v_rad(v8d x, v8l *bad)
+{
+	(void)bad;
+	return x*RADIANS_PER_DEGREE;
+}
+
+/* exp(x) = 2^k*exp(r), with r = x-k*ln2 split into hi and lo parts and a
+** rational approximation of exp(r) on |r| <= ln2/2 (fdlibm e_exp.c) */
+VINLINE v8d v_exp(v8d x, v8l *bad)
+{
+	v8d k, hi, lo, r, t, c, y;
+	v8l e;
+	
+	*bad |= ~(vabs(x) <= 708.0);
+	k = vrint(x*1.44269504088896338700e+00);
+	hi = x-k*6.93147180369123816490e-01;
+	lo = k*1.90821492927058770002e-10;
+	r = hi-lo;
+	t = r*r;
+	c = r-t*(1.66666666666666019037e-01+t*(-2.77777777770155933842e-03
+		+t*(6.61375632143793436117e-05+t*(-1.65339022054652515390e-06
+		+t*4.13813679705723846039e-08))));
+	y = 1.0-((lo-(r*c)/(2.0-c))-hi);
+	e = __builtin_convertvector(k, v8l);
+	return y*(v8d)((e+1023) << 52);
+}
+
+/* split x into 2^k*(1+f) with sqrt(2)/2 <= 1+f < sqrt(2), and return
+** log(1+f)-f+f*f/2 (fdlibm k_log.h), the callers finish the sum */
+VINLINE v8d vlog_kernel(v8d x, v8d *k, v8d *f, v8l *bad)
+{
+	v8d m, s, z, w, r;
+	v8l b, e;
+	
+	*bad |= ~((x >= DBL_MIN) & (x <= DBL_MAX));
+	b = (v8l)x;
+	e = (b >> 52)-1023;
+	m = (v8d)((b & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
+	e -= m > 1.41421356237309504880; /* masks are -1 */
+	m = vsel(m > 1.41421356237309504880, m*0.5, m);
+	*k = __builtin_convertvector(e, v8d);
+	*f = m-1.0;
+	s = *f/(2.0+*f);
+	z = s*s;
+	w = z*z;
+	r = z*(6.666666666666735130e-01+w*(2.857142874366239149e-01
+		+w*(1.818357216161805012e-01+w*1.479819860511658591e-01)))
+		+w*(3.999999999940941908e-01+w*(2.222219843214978396e-01
+		+w*1.531383769920937332e-01));
+	return s*(0.5**f**f+r);
+}
+
+VINLINE v8d v_ln(v8d x, v8l *bad)
+{
+	v8d k, f, r, hfsq;
+	
+	r = vlog_kernel(x, &k, &f, bad);
+	hfsq = 0.5*f*f;
+	return k*6.93147180369123816490e-01
+		-((hfsq-(r+k*1.90821492927058770002e-10))-f);
+}
+
+/* log10(x) = k*log10(2)+log(1+f)/ln(10), carried in extra precision
+** (fdlibm e_log10.c) */
+VINLINE v8d v_log(v8d x, v8l *bad)
+{
+	v8d k, f, r, hfsq, hi, lo, val_hi, val_lo, y2, w;
+	
+	r = vlog_kernel(x, &k, &f, bad);
+	hfsq = 0.5*f*f;
+	hi = f-hfsq;
+	hi = (v8d)((v8l)hi & (long long)0xffffffff00000000ULL);
+	lo = (f-hi)-hfsq+r;
+	val_hi = hi*4.34294481878168880939e-01;
+	y2 = k*3.01029995663611771306e-01;
+	val_lo = k*3.69423907715893078616e-13+(lo+hi)*2.50829467116452752298e-11
+		+lo*4.34294481878168880939e-01;
+	w = y2+val_hi;
+	val_lo += (y2-w)+val_hi;
+	return val_lo+w;
+}
+
+/* reduce x to y0+y1 = x-n*pi/2 with |y0+y1| <= pi/4, pi/2 is split into
+** 33 bit parts so n*part is exact for |n| < 2^20 (fdlibm e_rem_pio2.c) */
+VINLINE v8l vrem_pio2(v8d x, v8d *y0, v8d *y1, v8l *bad)
+{
+	v8d n, r, t, w;
+	
+	*bad |= ~(vabs(x) <= 0x1p19);
+	n = vrint(x*6.36619772367581382433e-01);
+	r = x-n*1.57079632673412561417e+00;
+	t = r;
+	w = n*6.07710050630396597660e-11;
+	r = t-w;
+	w = n*2.02226624879595063154e-21-((t-r)-w);
+	*y0 = r-w;
+	*y1 = (r-*y0)-w;
+	return __builtin_convertvector(n, v8l);
+}
+
+/* sin(x+y) and cos(x+y) on |x+y| <= pi/4 (fdlibm k_sin.c and k_cos.c) */
+VINLINE v8d vksin(v8d x, v8d y)
+{
+	v8d z, v, r;
+	
+	z = x*x;
+	v = z*x;
+	r = 8.33333333332248946124e-03+z*(-1.98412698298579493134e-04
+		+z*(2.75573137070700676789e-06+z*(-2.50507602534068634195e-08
+		+z*1.58969099521155010221e-10)));
+	return x-((z*(0.5*y-v*r)-y)-v*-1.66666666666666324348e-01);
+}
+
+VINLINE v8d vkcos(v8d x, v8d y)
+{
+	v8d z, r, hz, w;
+	
+	z = x*x;
+	r = z*(4.16666666666666019037e-02+z*(-1.38888888888741095749e-03
+		+z*(2.48015872894767294178e-05+z*(-2.75573143513906633035e-07
+		+z*(2.08757232129817482790e-09+z*-1.13596475577881948265e-11)))));
+	hz = 0.5*z;
+	w = 1.0-hz;
+	return w+(((1.0-w)-hz)+(z*r-x*y));
+}
+
+/* the quadrant n picks sin or cos of the reduced argument, and its sign */
+VINLINE v8d v_sin(v8d x, v8l *bad)
+{
+	v8d y0, y1, s, c;
+	v8l n;
+	
+	n = vrem_pio2(x, &y0, &y1, bad);
+	s = vksin(y0, y1);
+	c = vkcos(y0, y1);
+	s = vsel((n & 1) != 0, c, s);
+	return (v8d)((v8l)s ^ ((n & 2) << 62));
+}
+
+VINLINE v8d v_cos(v8d x, v8l *bad)
+{
+	v8d y0, y1, s, c;
+	v8l n;
+	
+	n = vrem_pio2(x, &y0, &y1, bad);
+	s = vksin(y0, y1);
+	c = vkcos(y0, y1);
+	c = vsel((n & 1) != 0, s, c);
+	return (v8d)((v8l)c ^ (((n+1) & 2) << 62));
+}
+
+/* tanh(x) = 1-2/(exp(2|x|)+1) with the sign of x, small |x| (where that
+** would cancel) use the taylor series x+x^3*P(x^2) instead */
+VINLINE v8d v_tanh(v8d x, v8l *bad)
+{
+	v8d ax, z, ts, tb, t;
+	v8l ignore = {0};
+	
+	*bad |= x != x;
+	ax = vabs(x);
+	z = ax*ax;
+	ts = ax+ax*z*(-0.33333333333333331+z*(0.13333333333333333
+		+z*(-0.053968253968253971+z*(0.021869488536155203
+		+z*(-0.0088632355299021973+z*(0.0035921280365724811
+		+z*(-0.0014558343870513183+z*(0.00059002744094558595
+		+z*(-0.00023912911424355248+z*(9.6915379569294509e-05
+		+z*(-3.9278323883316833e-05+z*(1.5918905069328964e-05
+		+z*(-6.4516892156554306e-06+z*(2.6147711512907546e-06
+		+z*(-1.0597268320104654e-06+z*(4.2949110782738057e-07
+		+z*(-1.7406618963571648e-07+z*(7.0546369464009681e-08
+		+z*-2.859136662305254e-08))))))))))))))))));
+	tb = 1.0-2.0/(v_exp(vsel(ax < 22.0, 2.0*ax, vsplat(0.0)), &ignore)+1.0);
+	t = vsel(ax < 0.55, ts, tb);
+	t = vsel(ax < 22.0, t, vsplat(1.0));
+	return (v8d)((v8l)t | ((v8l)x & SIGN_BIT));
+}
+
+/* scalar versions for the lanes the cores can't handle */
+static double s_round(double x)
+{
+	if(x <= -0.5)
+		return ceil(x-0.5);
+	if(x >= 0.5)
+		return floor(x+0.5);
+	return 0.0;
+}
+
+static double s_trunc(double x)
+{
+	return x <= 0.0 ? ceil(x) : floor(x);
+}
+
+static double s_none(double x)
+{
+	return x; /* never called, the core handles every lane */
+}
+
+/* define one vector function for an instruction set, each block of 8 rows
+** is computed by the core, then any bad lanes are redone by the scalar
+** function */
+#define VMATH_FN(ISA, TARGET, NAME, CORE, SCALAR) \
+static __attribute__((target(TARGET))) \
+VECTOR_FUNCTION(ISA##_##NAME,args,rows,arg,rv,data) \
+{ \
+	const double *a = arg[0]; \
+	v8d x, y; \
+	v8l bad; \
+	size_t i, j, w; \
+	(void)args; \
+	(void)data; \
+	for(i = 0; i < rows; i += w) \
+	{ \
+		w = rows-i < 8 ? rows-i : 8; \
+		x = vload(a+i, w); \
+		bad = (v8l){0}; \
+		y = CORE(x, &bad); \
+		if(vany(bad)) \
+			for(j = 0; j < w; j++) \
+				if(bad[j]) \
+					y[j] = SCALAR(x[j]); \
+		vstore(rv+i, y, w); \
+	} \
+	return 0; \
+}
+
+/* sqrt() is exact in every instruction set, the vector is split into the
+** registers of the set */
+#define VMATH_SQRT(ISA, TARGET, VEC, WIDTH, SQRT) \
+static __attribute__((target(TARGET))) \
+VECTOR_FUNCTION(ISA##_sqrt,args,rows,arg,rv,data) \
+{ \
+	const double *a = arg[0]; \
+	VEC v; \
+	size_t i = 0; \
+	(void)args; \
+	(void)data; \
+	for(; i+WIDTH <= rows; i += WIDTH) \
+	{ \
+		memcpy(&v, a+i, sizeof(v)); \
+		v = SQRT(v); \
+		memcpy(rv+i, &v, sizeof(v)); \
+	} \
+	for(; i < rows; i++) \
+		rv[i] = sqrt(a[i]); \
+	return 0; \
+}
+
+#define VMATH_ISA(ISA, TARGET, VEC, WIDTH, SQRT) \
+VMATH_FN(ISA, TARGET, abs, v_abs, s_none) \
+VMATH_FN(ISA, TARGET, sign, v_sign, s_none) \
+VMATH_FN(ISA, TARGET, floor, v_floor, floor) \
+VMATH_FN(ISA, TARGET, ceil, v_ceil, ceil) \
+VMATH_FN(ISA, TARGET, trunc, v_trunc, s_trunc) \
+VMATH_FN(ISA, TARGET, round, v_round, s_round) \
+VMATH_FN(ISA, TARGET, deg, v_deg, s_none) \
+VMATH_FN(ISA, TARGET, rad, v_rad, s_none) \
+VMATH_FN(ISA, TARGET, exp, v_exp, exp) \
+VMATH_FN(ISA, TARGET, ln, v_ln, log) \
+VMATH_FN(ISA, TARGET, log, v_log, log10) \
+VMATH_FN(ISA, TARGET, sin, v_sin, sin) \
+VMATH_FN(ISA, TARGET, cos, v_cos, cos) \
+VMATH_FN(ISA, TARGET, tanh, v_tanh, tanh) \
+VMATH_SQRT(ISA, TARGET, VEC, WIDTH, SQRT) \
+static VECTOR_FUNCTION((*G_##ISA##_vfn[]),args,rows,arg,rv,data) = { \
+	ISA##_abs, ISA##_sign, ISA##_floor, ISA##_ceil, ISA##_trunc, \
+	ISA##_round, ISA##_deg, ISA##_rad, ISA##_exp, ISA##_ln, ISA##_log, \
+	ISA##_sin, ISA##_cos, ISA##_tanh, ISA##_sqrt, NULL \
+};
+
+static char *vfnname[] = {
+	"abs", "sign", "floor", "ceil", "trunc", "round", "deg", "rad",
+	"exp", "ln", "log", "sin", "cos", "tanh", "sqrt", NULL
+};
+
+VMATH_ISA(sse2, "sse2", __m128d, 2, _mm_sqrt_pd)
+VMATH_ISA(avx2, "avx2", __m256d, 4, _mm256_sqrt_pd)
+VMATH_ISA(avx512, "avx512f,avx512dq", __m512d, 8, _mm512_sqrt_pd)
+
+/* attach the vector functions for this cpu to the standard
+** functions, the instruction set matches the one picked in batch.c */
+int vfunc_set_default_env(eval_ctx *ctx)
+{
+	VectorFunctionPtr *vfn;
+	int i;
+	
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+		vfn = G_avx512_vfn;
+	else if(__builtin_cpu_supports("avx2"))
+		vfn = G_avx2_vfn;
+	else
+		vfn = G_sse2_vfn;
+	
+	for(i = 0; vfnname[i] != NULL; i++)
+		if(eval_ctx_def_vector_fn(ctx, vfnname[i], vfn[i]))
+			return 1;
+	
+	return 0;
+}
+
+#else
+
+/* without SIMD the standard functions are called once per row */
+int vfunc_set_default_env(eval_ctx *ctx)
+{
+	(void)ctx;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+** simple expression evaluator library (compiled expression interpreter)
+** Copyright (C) 2006, 2007  Jeffrey S. Dutky
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <math.h>
+#include <stddef.h>
+
+#include "evalcode.h"
+
+/* with gcc (and compatible compilers) each instruction jumps straight to
+** the handler of the next one through a table of label addresses (computed
+** goto), so there is no shared dispatch branch to mispredict. Elsewhere we
+** fall back to a switch statement in a loop. */
+#if defined(__GNUC__) && !defined(EVAL_NO_THREADED)
+#define THREADED 1
+#define DISPATCH() goto *dispatch[ip->op]
+#define CASE(OP) L_##OP:
+#define NEXT() ip++; DISPATCH()
+#else
+#define CASE(OP) case OP:
+#define NEXT() ip++; break
+#endif
+
+int vm_run(const eval_compiled *ce, double *reg, double *argv, double *result)
+{
+	const Instr *ip;
+	const Call *c;
+	double *r = reg;
+	int i;
+#ifdef THREADED
+	static const void *dispatch[OP_COUNT] = {
+		&&L_OP_LOADV, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV,
+		&&L_OP_MOD, &&L_OP_POW, &&L_OP_NEG, &&L_OP_PCT, &&L_OP_CALL,
+		&&L_OP_RET
+	};
+#endif
+	
+	ip = ce->code;
+#ifdef THREADED
+	DISPATCH();
+#else
+	for(;;) switch(ip->op)
+	{
+#endif
+	CASE(OP_LOADV) /* a shared table's variable may be set meanwhile */
+		__atomic_load(ce->var[ip->a], r+ip->dst, __ATOMIC_RELAXED);
+		NEXT();
+	CASE(OP_ADD)
+		r[ip->dst] = r[ip->a]+r[ip->b];
+		NEXT();
+	CASE(OP_SUB)
+		r[ip->dst] = r[ip->a]-r[ip->b];
+		NEXT();
+	CASE(OP_MUL)
+		r[ip->dst] = r[ip->a]*r[ip->b];
+		NEXT();
+	CASE(OP_DIV)
+		if(r[ip->b] == 0.0)
+			return EVAL_DIVIDE_BY_ZERO;
+		r[ip->dst] = r[ip->a]/r[ip->b];
+		NEXT();
+	CASE(OP_MOD)
+		if(r[ip->b] == 0.0)
+			return EVAL_DIVIDE_BY_ZERO;
+		r[ip->dst] = fmod(r[ip->a], r[ip->b]);
+		NEXT();
+	CASE(OP_POW)
+		r[ip->dst] = pow(r[ip->a], r[ip->b]);
+		NEXT();
+	CASE(OP_NEG)
+		r[ip->dst] = -r[ip->a];
+		NEXT();
+	CASE(OP_PCT)
+		r[ip->dst] = r[ip->a]/100.0;
+		NEXT();
+	CASE(OP_CALL)
+		c = ce->call+ip->a;
+		for(i = 0; i < c->nargs; i++) /* functions may modify their args */
+			argv[i] = r[c->arg[i]];
+		if(c->fn(c->nargs, argv, r+ip->dst, c->data) != 0)
+			return EVAL_FUNCTION_ERROR;
+		NEXT();
+	CASE(OP_RET)
+		if(result != NULL)
+			*result = r[ip->a];
+		return 0;
+#ifndef THREADED
+	default:
+		return EVAL_SYNTAX_ERROR; /* bad opcode, can't happen */
+	}
+#endif
+}